@@ -0,0 +1,417 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "adv_policy.h"
+#include "../time/time.h"
+#include "advertise.h"
+#include "connection.h"
+#include "radio.h"
+#include "services/bs/bas.h"
+#include "services/wens/wens.h"
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME adv_policy
+LOG_MODULE_REGISTER(adv_policy);
+
+#define POLICY_PERIOD 60 // Seconds between each time the policy is applied
+
+#define ADV_INTERVAL_MIN 0x0020 // 20 ms, the shortest interval allowed
+#define ADV_INTERVAL_MAX 0x4000 // 10.24 s, the longest for legacy advertising
+
+#define GAENS_INTERVAL_MIN 0x0140 // 200 ms, used if the ENS Settings are bad
+#define GAENS_INTERVAL_MAX 0x01B0 // 270 ms
+#define WENS_INTERVAL_MIN  0x0640 // 1.0 s
+#define WENS_INTERVAL_MAX  0x06E0 // 1.1 s
+
+#define LOW_BATTERY_LEVEL 20 // Percent
+
+// The device has no time zone, so the night is given in UTC
+#define NIGHT_START_HOUR 0
+#define NIGHT_END_HOUR   5
+
+#define SECONDS_PER_HOUR   3600
+#define SECONDS_PER_MINUTE 60
+#define SECONDS_PER_DAY    86400
+#define TIME_SET           1577836800 // 2020-01-01, the clock is not set before
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds how much a profile stretches the advertising intervals. */
+typedef struct
+{
+    uint8_t gaens_factor;
+    uint8_t wens_factor;
+} profile_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static const profile_t profiles[] = {
+    [ADV_POLICY_PROFILE_NORMAL] = {.gaens_factor = 1, .wens_factor = 1},
+    [ADV_POLICY_PROFILE_NIGHT] = {.gaens_factor = 2, .wens_factor = 4},
+    [ADV_POLICY_PROFILE_LOW_BATTERY] = {.gaens_factor = 2, .wens_factor = 8},
+};
+
+static adv_policy_profile_t current_profile = ADV_POLICY_PROFILE_NORMAL;
+
+static adv_policy_wens_mode_t wens_mode = ADV_POLICY_WENS_ON_DEMAND;
+static bool wens_wanted = false;
+static uint32_t wens_interval = WENS_INTERVAL_MIN; // In units of 0.625 ms
+
+// Sync windows in the morning and in the evening by default
+static adv_policy_window_t sync_windows[ADV_POLICY_MAX_SYNC_WINDOWS] = {
+    {.start = 8 * SECONDS_PER_HOUR, .duration = 10 * SECONDS_PER_MINUTE},
+    {.start = 20 * SECONDS_PER_HOUR, .duration = 10 * SECONDS_PER_MINUTE},
+};
+static size_t sync_window_count = 2;
+
+static int64_t window_end = 0; // Uptime (in ms) the open window ends at
+
+static adv_policy_counters_t counters;
+static int64_t connected_ms = 0;
+static int64_t saved_ms = 0;
+static int64_t last_account = 0;
+static int64_t last_wens_time = 0;
+static bool was_connected = false;
+
+K_MUTEX_DEFINE(_policy_mutex);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _apply_handler(struct k_work *unused);
+K_WORK_DEFINE(_apply_work, _apply_handler);
+
+static void _policy_timer_handler(struct k_timer *unused);
+K_TIMER_DEFINE(_policy_timer, _policy_timer_handler, NULL);
+
+static adv_policy_profile_t _select_profile(void);
+
+static bool _in_window(void);
+
+static void _account(void);
+
+static uint32_t _scale(uint32_t interval, uint8_t factor);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int adv_policy_init(void)
+{
+    last_account = k_uptime_get();
+    last_wens_time = advertise_wens_get_time();
+
+    adv_policy_open_window(ADV_POLICY_BOOT_WINDOW);
+
+    k_timer_start(&_policy_timer, K_SECONDS(POLICY_PERIOD),
+                  K_SECONDS(POLICY_PERIOD));
+
+    return 0;
+}
+
+void adv_policy_update(void) { k_work_submit(&_apply_work); }
+
+void adv_policy_set_wens_mode(adv_policy_wens_mode_t mode)
+{
+    wens_mode = mode;
+    k_work_submit(&_apply_work);
+}
+
+int adv_policy_set_sync_windows(const adv_policy_window_t *windows,
+                                size_t count)
+{
+    if (count > ADV_POLICY_MAX_SYNC_WINDOWS)
+    {
+        LOG_ERR("Too many sync windows");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (windows[i].start >= SECONDS_PER_DAY ||
+            windows[i].duration > SECONDS_PER_DAY)
+        {
+            LOG_ERR("Invalid sync window");
+            return -1;
+        }
+    }
+
+    k_mutex_lock(&_policy_mutex, K_FOREVER);
+    memcpy(sync_windows, windows, count * sizeof(adv_policy_window_t));
+    sync_window_count = count;
+    k_mutex_unlock(&_policy_mutex);
+
+    k_work_submit(&_apply_work);
+
+    return 0;
+}
+
+void adv_policy_open_window(uint32_t duration)
+{
+    int64_t end = k_uptime_get() + (int64_t)duration * MSEC_PER_SEC;
+
+    k_mutex_lock(&_policy_mutex, K_FOREVER);
+    window_end = MAX(window_end, end);
+    k_mutex_unlock(&_policy_mutex);
+
+    k_work_submit(&_apply_work);
+}
+
+void adv_policy_get_counters(adv_policy_counters_t *c)
+{
+    k_mutex_lock(&_policy_mutex, K_FOREVER);
+    *c = counters;
+    c->wens_time = advertise_wens_get_time() / MSEC_PER_SEC;
+    c->connected_time = connected_ms / MSEC_PER_SEC;
+    c->saved_time = saved_ms / MSEC_PER_SEC;
+    c->saved_radio_time_ms =
+        (uint64_t)counters.saved_events * RADIO_ADV_EVENT_TIME / 1000;
+    k_mutex_unlock(&_policy_mutex);
+}
+
+adv_policy_profile_t adv_policy_get_profile(void) { return current_profile; }
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Work handler applying the policy to the advertising sets.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _apply_handler(struct k_work *unused)
+{
+    adv_policy_profile_t profile = _select_profile();
+    ens_settings_t settings;
+    uint32_t gaens_min = GAENS_INTERVAL_MIN;
+    uint32_t gaens_max = GAENS_INTERVAL_MAX;
+    uint16_t wens_timeout = 0;
+    bool wanted = true;
+
+    wens_get_ens_settings(&settings);
+
+    if (settings.min_adv_interval >= ADV_INTERVAL_MIN &&
+        settings.min_adv_interval <= settings.max_adv_interval &&
+        settings.max_adv_interval <= ADV_INTERVAL_MAX)
+    {
+        gaens_min = settings.min_adv_interval;
+        gaens_max = settings.max_adv_interval;
+    }
+    else
+    {
+        LOG_WRN("Invalid advertising interval in ENS Settings");
+    }
+
+    // In continuous mode, WENS advertises for the maximum advertising duration
+    // (in seconds) in each policy period, and is started again below. In
+    // on-demand mode, WENS advertises for as long as a window is open.
+    if (wens_mode == ADV_POLICY_WENS_ON_DEMAND)
+    {
+        wanted = _in_window();
+    }
+    else if (settings.max_adv_duration > 0 &&
+             settings.max_adv_duration < POLICY_PERIOD)
+    {
+        wens_timeout = settings.max_adv_duration * 100;
+    }
+
+    if (profile != current_profile)
+    {
+        current_profile = profile;
+        LOG_INF("Advertising profile changed to %d", profile);
+    }
+
+    advertise_gaens_set_interval(
+        _scale(gaens_min, profiles[profile].gaens_factor),
+        _scale(gaens_max, profiles[profile].gaens_factor));
+    advertise_wens_set_interval(
+        _scale(WENS_INTERVAL_MIN, profiles[profile].wens_factor),
+        _scale(WENS_INTERVAL_MAX, profiles[profile].wens_factor));
+    advertise_wens_set_timeout(wens_timeout);
+
+    // Count the time up to now with the old interval and state
+    _account();
+    wens_interval = _scale((WENS_INTERVAL_MIN + WENS_INTERVAL_MAX) / 2,
+                           profiles[profile].wens_factor);
+
+    if (wanted && !wens_wanted)
+    {
+        counters.wens_windows++;
+    }
+    else if (!wanted && wens_wanted)
+    {
+        LOG_INF("WENS window closed (%u s advertised, %u s saved)",
+                (uint32_t)(advertise_wens_get_time() / MSEC_PER_SEC),
+                (uint32_t)(saved_ms / MSEC_PER_SEC));
+    }
+
+    wens_wanted = wanted;
+
+    // A phone is never disconnected to close a window. Connectable
+    // advertising can not go on once every connection is taken, and it is
+    // started again by a disconnection
+    if (connection_count() >= CONFIG_BT_MAX_CONN)
+    {
+        return;
+    }
+
+    // Directed advertising to a bonded phone is left to run out, and the
+    // policy is applied again when it does
+    if (advertise_wens_directed())
+    {
+        return;
+    }
+
+    if (wanted && !advertise_wens_active())
+    {
+        advertise_wens_start();
+    }
+    else if (!wanted && advertise_wens_active())
+    {
+        advertise_wens_stop();
+    }
+}
+
+/**
+ * @brief Timer handler applying the policy periodically.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _policy_timer_handler(struct k_timer *unused)
+{
+    k_work_submit(&_apply_work);
+}
+
+/**
+ * @brief Function for choosing the advertising profile from the battery level
+ * and the time of day.
+ *
+ * @return adv_policy_profile_t The profile.
+ */
+static adv_policy_profile_t _select_profile(void)
+{
+    uint32_t now;
+    uint32_t hour;
+
+    if (bt_bas_get_battery_level() < LOW_BATTERY_LEVEL)
+    {
+        return ADV_POLICY_PROFILE_LOW_BATTERY;
+    }
+
+    // The time of day is only known once the clock has been set
+    if (get_current_time(&now) < 0 || now < TIME_SET)
+    {
+        return ADV_POLICY_PROFILE_NORMAL;
+    }
+
+    hour = (now % SECONDS_PER_DAY) / SECONDS_PER_HOUR;
+
+    if (hour >= NIGHT_START_HOUR && hour < NIGHT_END_HOUR)
+    {
+        return ADV_POLICY_PROFILE_NIGHT;
+    }
+
+    return ADV_POLICY_PROFILE_NORMAL;
+}
+
+/**
+ * @brief Function for checking if a WENS window is open.
+ *
+ * @return bool True if WENS should advertise.
+ */
+static bool _in_window(void)
+{
+    bool open = false;
+    uint32_t now;
+    uint32_t time_of_day;
+
+    k_mutex_lock(&_policy_mutex, K_FOREVER);
+
+    if (k_uptime_get() < window_end)
+    {
+        open = true;
+    }
+    else if (get_current_time(&now) < 0 || now < TIME_SET)
+    {
+        // The sync windows can not be found without the clock. The phone can
+        // set it in the window after boot or after a command, and a bonded
+        // phone is reconnected to by directed advertising.
+        open = false;
+    }
+    else
+    {
+        time_of_day = now % SECONDS_PER_DAY;
+
+        for (size_t i = 0; i < sync_window_count && !open; i++)
+        {
+            open = (time_of_day + SECONDS_PER_DAY - sync_windows[i].start) %
+                       SECONDS_PER_DAY <
+                   sync_windows[i].duration;
+        }
+    }
+
+    k_mutex_unlock(&_policy_mutex);
+
+    return open;
+}
+
+/**
+ * @brief Function for updating the counters with the time since they were
+ * last updated. The time WENS did not advertise is counted as connected time
+ * if a phone was connected, and as saved time otherwise.
+ */
+static void _account(void)
+{
+    int64_t now = k_uptime_get();
+    int64_t wens_time = advertise_wens_get_time();
+    int64_t idle = (now - last_account) - (wens_time - last_wens_time);
+
+    k_mutex_lock(&_policy_mutex, K_FOREVER);
+
+    if (was_connected)
+    {
+        connected_ms += idle;
+    }
+    else if (idle > 0)
+    {
+        saved_ms += idle;
+
+        // The interval is in units of 0.625 ms
+        counters.saved_events += idle * 8 / (wens_interval * 5);
+    }
+
+    k_mutex_unlock(&_policy_mutex);
+
+    last_account = now;
+    last_wens_time = wens_time;
+    was_connected = connection_is_connected();
+}
+
+/**
+ * @brief Function for stretching an advertising interval.
+ *
+ * @param interval The interval in units of 0.625 ms.
+ * @param factor The factor to stretch the interval by.
+ *
+ * @return uint32_t The stretched interval, at most @c ADV_INTERVAL_MAX.
+ */
+static uint32_t _scale(uint32_t interval, uint8_t factor)
+{
+    return MIN(interval * factor, ADV_INTERVAL_MAX);
+}
@@ -0,0 +1,151 @@
+/**
+ * @file
+ * @brief Advertising policy module
+ * 
+ * This is a module for choosing the advertising parameters. The GAENS
+ * advertising interval and the WENS advertising duration are taken from the
+ * ENS Settings characteristic, and are stretched by a profile chosen from the
+ * time of day and the battery level, trading discoverability for battery.
+ * Changes are applied to the advertising sets while they are advertising.
+ * 
+ * WENS connectable advertising can run all the time, or only on demand: for a
+ * while after boot, for a while after a WEN Status command and during sync
+ * windows at given times of day. Only GAENS is advertised outside of the
+ * windows. The sync windows are closed until the clock has been set. The mode,
+ * the sync windows and the counters are available through WEN Status
+ * commands.
+ */
+
+#ifndef ADV_POLICY_H
+#define ADV_POLICY_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief How long WENS advertises after boot (in seconds).
+ */
+#define ADV_POLICY_BOOT_WINDOW 300
+
+/**
+ * @brief How long WENS advertises after a WEN Status command (in seconds), so
+ * the phone can connect again to follow up on the command.
+ */
+#define ADV_POLICY_COMMAND_WINDOW 120
+
+/**
+ * @brief Maximum number of sync windows.
+ */
+#define ADV_POLICY_MAX_SYNC_WINDOWS 8
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This enum contains the advertising profiles. */
+typedef enum
+{
+    ADV_POLICY_PROFILE_NORMAL,
+    ADV_POLICY_PROFILE_NIGHT,      // At night, when few contacts are expected
+    ADV_POLICY_PROFILE_LOW_BATTERY // When the battery is running low
+} adv_policy_profile_t;
+
+/* This enum contains the modes of WENS connectable advertising. */
+typedef enum
+{
+    ADV_POLICY_WENS_CONTINUOUS, // Advertise all the time, see ENS Settings
+    ADV_POLICY_WENS_ON_DEMAND   // Advertise only in windows
+} adv_policy_wens_mode_t;
+
+/* This struct describes a sync window. The times are in seconds since
+midnight UTC, and a window may go past midnight. */
+typedef struct
+{
+    uint32_t start;
+    uint32_t duration;
+} adv_policy_window_t;
+
+/* This struct holds the counters of the advertising policy. The saved time is
+the time WENS would have advertised in continuous mode. The saved radio time
+is estimated from the advertising events that were not sent. */
+typedef struct
+{
+    uint32_t wens_windows;        // Number of WENS windows opened
+    uint32_t wens_time;           // Time WENS has advertised (in seconds)
+    uint32_t connected_time;      // Time a phone was connected (in seconds)
+    uint32_t saved_time;          // Time WENS did not advertise (in seconds)
+    uint32_t saved_events;        // WENS advertising events not sent
+    uint32_t saved_radio_time_ms; // Radio time of the events not sent
+} adv_policy_counters_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for initializing the advertising policy. The policy is
+ * applied once, and then again periodically. Must be called after
+ * @c advertise_init.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int adv_policy_init(void);
+
+/**
+ * @brief Function for applying the policy again, for example after the ENS
+ * Settings have been changed. The policy is applied from the system work
+ * queue, so this can be called from any context.
+ */
+void adv_policy_update(void);
+
+/**
+ * @brief Function for setting the mode of WENS connectable advertising.
+ * 
+ * @param mode The mode.
+ */
+void adv_policy_set_wens_mode(adv_policy_wens_mode_t mode);
+
+/**
+ * @brief Function for setting the sync windows used in on-demand mode. The
+ * windows are only used once the clock has been set. Until then, WENS only
+ * advertises in the windows after boot and after a WEN Status command.
+ * 
+ * @param windows The windows.
+ * @param count The number of windows, at most
+ * @c ADV_POLICY_MAX_SYNC_WINDOWS.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int adv_policy_set_sync_windows(const adv_policy_window_t *windows,
+                                size_t count);
+
+/**
+ * @brief Function for opening a WENS window, or making the open window longer.
+ * 
+ * @param duration How long to advertise (in seconds).
+ */
+void adv_policy_open_window(uint32_t duration);
+
+/**
+ * @brief Function for getting the counters of the advertising policy.
+ * 
+ * @param counters Pointer to store the counters in.
+ */
+void adv_policy_get_counters(adv_policy_counters_t *counters);
+
+/**
+ * @brief Function for getting the profile in use.
+ * 
+ * @return adv_policy_profile_t The profile.
+ */
+adv_policy_profile_t adv_policy_get_profile(void);
+
+#endif // ADV_POLICY_H
@@ -3,6 +3,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "advertise.h"
+#include "radio.h"
 #include "uuid.h"
 #include <stddef.h>
 
@@ -12,8 +13,12 @@
 #include <bluetooth/uuid.h>
 
 #include <logging/log.h>
+#include <net/buf.h>
 #include <stddef.h>
+#include <string.h>
+#include <sys/byteorder.h>
 #include <sys/util.h>
+#include <zephyr.h>
 #include <zephyr/types.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -26,14 +31,35 @@ LOG_MODULE_REGISTER(advertise);
 #define UUID16_LENGTH             2
 #define GAENS_SERVICE_DATA_LENGTH 22
 
-#define GAENS_ADV_PARAMETERS BT_LE_ADV_PARAM(0, 0x140, 0x1B0, NULL) // 200-270ms
-#define WENS_ADV_PARAMETERS  BT_LE_ADV_PARAM(1, 0x640, 0x6E0, NULL) // 1.0-1.1s
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private variables
 ////////////////////////////////////////////////////////////////////////////////
 
-static bool advertise_active = false;
+static volatile bool gaens_active = false;
+static volatile bool wens_active = false;
+
+static uint8_t gaens_events = 0; // Events GAENS was started for, 0 for no limit
+static advertise_sent_cb_t gaens_sent_cb = NULL;
+
+// Advertising parameters, changed at runtime by the advertising policy
+static struct bt_le_adv_param gaens_param =
+    BT_LE_ADV_PARAM_INIT(0, 0x140, 0x1B0, NULL); // 200-270ms
+static struct bt_le_adv_param wens_param = BT_LE_ADV_PARAM_INIT(
+    BT_LE_ADV_OPT_CONNECTABLE, 0x640, 0x6E0, NULL); // 1.0-1.1s
+
+static uint16_t wens_timeout = 0; // In units of 10 ms, 0 for no timeout
+
+// Parameters for directed advertising to a bonded phone. Legacy high duty
+// cycle PDUs are used, for which the interval is ignored.
+static bt_addr_le_t direct_peer;
+static struct bt_le_adv_param direct_param =
+    BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONNECTABLE, 0, 0, &direct_peer);
+static volatile bool wens_directed = false; // The set has direct_param
+static bool wens_resume = false; // Undirected WENS was stopped for direct_param
+
+static int64_t wens_started = 0; // Uptime when WENS was last started
+static int64_t wens_time = 0;    // Total time WENS has advertised (in ms)
 
 static uint8_t gaens_service_data[UUID16_LENGTH + GAENS_SERVICE_DATA_LENGTH] =
     {};
@@ -48,30 +74,113 @@ static const struct bt_data ad_gaens[] = {
     BT_DATA_BYTES(BT_DATA_UUID16_ALL, BT_UUID_16_ENCODE(BT_UUID_GAENS_VAL)),
     BT_DATA(BT_DATA_SVC_DATA16, gaens_service_data, GAENS_SERVICE_DATA_LENGTH)};
 
-static struct bt_le_ext_adv *adv_set;
+// The advertising sets live for as long as the Bluetooth stack
+static struct bt_le_ext_adv *gaens_set = NULL;
+static struct bt_le_ext_adv *wens_set = NULL;
+
+// GAENS uses the default identity with a new NRPA at each rotation, while WENS
+// has an identity of its own that bonded phones can recognize
+static uint8_t wens_id = BT_ID_DEFAULT;
+static bt_addr_t gaens_addr;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-static int bt_ext_advertising_start(struct bt_le_adv_param *param,
-                                    const struct bt_data *ad, size_t ad_len);
+static int _create_set(struct bt_le_adv_param *param,
+                       const struct bt_le_ext_adv_cb *cb,
+                       struct bt_le_ext_adv **adv);
+
+static int _start_set(struct bt_le_ext_adv *adv, const struct bt_data *ad,
+                      size_t ad_len, uint16_t timeout, uint8_t events);
+
+static int _new_gaens_addr(void);
+
+static int _set_random_addr(struct bt_le_ext_adv *adv, const bt_addr_t *addr);
+
+static int _set_enable(struct bt_le_ext_adv *adv, bool enable,
+                       uint8_t events);
+
+static int _set_params(struct bt_le_ext_adv *adv,
+                       const struct bt_le_adv_param *param);
+
+static int _wens_identity(uint8_t *id);
+
+static void _gaens_sent(struct bt_le_ext_adv *adv,
+                        struct bt_le_ext_adv_sent_info *info);
+
+static void _wens_sent(struct bt_le_ext_adv *adv,
+                       struct bt_le_ext_adv_sent_info *info);
+
+static void _wens_connected(struct bt_le_ext_adv *adv,
+                            struct bt_le_ext_adv_connected_info *info);
+
+static void _wens_stopped(void);
+
+static int _wens_undirect(void);
+
+static void _undirect_handler(struct k_work *unused);
+K_WORK_DEFINE(_undirect_work, _undirect_handler);
+
+static void _report(struct bt_le_adv_param *param, radio_activity_t activity,
+                    bool active);
+
+static const struct bt_le_ext_adv_cb gaens_callbacks = {
+    .sent = _gaens_sent,
+};
+
+static const struct bt_le_ext_adv_cb wens_callbacks = {
+    .sent = _wens_sent,
+    .connected = _wens_connected,
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 // Public functions
 ////////////////////////////////////////////////////////////////////////////////
 
-int advertise_change_gaens_service_data(uint8_t *rpi, uint8_t rpi_length,
-                                        uint8_t *aem, uint8_t aem_length)
+int advertise_init(void)
 {
-    uint8_t data[rpi_length + aem_length];
+    int err;
+
+    if (gaens_set && wens_set)
+    {
+        return 0;
+    }
+
+    err = _wens_identity(&wens_id);
+    if (err)
+    {
+        LOG_ERR("Failed to get WENS identity (err %d)", err);
+        return -1;
+    }
 
-    if (advertise_active)
+    wens_param.id = wens_id;
+
+    err = _create_set(&gaens_param, &gaens_callbacks, &gaens_set);
+    if (err)
     {
-        LOG_ERR("Cannot change GAENS service data while advertising is active");
+        LOG_ERR("Failed to create GAENS advertising set (err %d)", err);
         return -1;
     }
 
+    err = _create_set(&wens_param, &wens_callbacks, &wens_set);
+    if (err)
+    {
+        LOG_ERR("Failed to create WENS advertising set (err %d)", err);
+        return -1;
+    }
+
+    LOG_INF("Advertising sets created");
+
+    return 0;
+}
+
+int advertise_gaens_rotate(uint8_t *rpi, uint8_t rpi_length, uint8_t *aem,
+                           uint8_t aem_length)
+{
+    uint8_t data[rpi_length + aem_length];
+    int err;
+
     // Copy RPI in to data
     memcpy(data, rpi, rpi_length);
 
@@ -85,66 +194,374 @@ int advertise_change_gaens_service_data(uint8_t *rpi, uint8_t rpi_length,
     // Replace old GAENS service data with new data
     memcpy(&gaens_service_data[UUID16_LENGTH], data, GAENS_SERVICE_DATA_LENGTH);
 
-    return 0;
+    // The data and a new address are applied by the next start if not
+    // advertising
+    if (!gaens_active)
+    {
+        return 0;
+    }
+
+    // The address and the data are two HCI commands, so the set is disabled in
+    // the controller while both are changed. No advertising event is sent with
+    // the new address and the old RPI, or the other way around. The set is
+    // enabled again after a few HCI round trips, well within one advertising
+    // interval, and the host still sees it as advertising.
+    err = _set_enable(gaens_set, false, 0);
+    if (err)
+    {
+        LOG_ERR("Failed to pause GAENS advertising (err %d)", err);
+        return -1;
+    }
+
+    err = _new_gaens_addr();
+    if (err)
+    {
+        LOG_ERR("Failed to change GAENS advertising address (err %d)", err);
+    }
+    else
+    {
+        err = bt_le_ext_adv_set_data(gaens_set, ad_gaens, ARRAY_SIZE(ad_gaens),
+                                     NULL, 0);
+        if (err)
+        {
+            LOG_ERR("Failed to update GAENS advertising data (err %d)", err);
+        }
+    }
+
+    // Resume even if the update failed, as the old address and data still
+    // belong together
+    if (_set_enable(gaens_set, true, gaens_events))
+    {
+        LOG_ERR("Failed to resume GAENS advertising");
+        gaens_active = false;
+        return -1;
+    }
+
+    return err ? -1 : 0;
 }
 
-int advertise_start()
+int advertise_gaens_start(void) { return advertise_gaens_start_events(0); }
+
+int advertise_gaens_start_events(uint8_t events)
 {
     int err;
 
-    err = bt_ext_advertising_start(GAENS_ADV_PARAMETERS, ad_gaens,
-                                   ARRAY_SIZE(ad_gaens));
+    if (gaens_active)
+    {
+        return 0;
+    }
+
+    // The set keeps its address while stopped, so a new one is needed to not
+    // link the new RPI to the old one
+    err = _new_gaens_addr();
     if (err)
     {
-        LOG_INF("GAENS advertising failed to start (err %d)", err);
+        LOG_ERR("Failed to change GAENS advertising address (err %d)", err);
         return -1;
     }
 
-    err = bt_le_adv_start(WENS_ADV_PARAMETERS, ad_wens, ARRAY_SIZE(ad_wens),
-                          NULL, 0);
+    err = _start_set(gaens_set, ad_gaens, ARRAY_SIZE(ad_gaens), 0, events);
     if (err)
     {
-        LOG_INF("WENS advertising failed to start (err %d)", err);
+        LOG_ERR("GAENS advertising failed to start (err %d)", err);
         return -1;
     }
 
-    advertise_active = true;
+    gaens_events = events;
+    gaens_active = true;
+    _report(&gaens_param, RADIO_GAENS_ADV, true);
 
-    LOG_INF("Advertising started successfully");
+    LOG_INF("GAENS advertising started");
 
     return 0;
 }
 
-int advertise_stop()
+int advertise_gaens_stop(void)
 {
     int err;
 
-    // Stop advertising
-    err = bt_le_ext_adv_stop(adv_set);
+    if (!gaens_active)
+    {
+        return 0;
+    }
+
+    err = bt_le_ext_adv_stop(gaens_set);
     if (err)
     {
         LOG_ERR("Failed to stop GAENS advertising (err %d)", err);
         return -1;
     }
 
-    // Delete extended advertising set to free connection object
-    err = bt_le_ext_adv_delete(adv_set);
+    gaens_active = false;
+    _report(&gaens_param, RADIO_GAENS_ADV, false);
+
+    LOG_INF("GAENS advertising stopped");
+
+    return 0;
+}
+
+int advertise_wens_start(void)
+{
+    int err;
+
+    if (wens_active)
+    {
+        return 0;
+    }
+
+    err = _wens_undirect();
     if (err)
     {
-        LOG_ERR("Failed to delete GAENS advertising set (err %d)", err);
+        LOG_ERR("Failed to restore WENS advertising parameters (err %d)", err);
         return -1;
     }
 
-    err = bt_le_adv_stop();
+    err = _start_set(wens_set, ad_wens, ARRAY_SIZE(ad_wens), wens_timeout, 0);
+    if (err)
+    {
+        LOG_ERR("WENS advertising failed to start (err %d)", err);
+        return -1;
+    }
+
+    wens_active = true;
+    wens_started = k_uptime_get();
+    _report(&wens_param, RADIO_WENS_ADV, true);
+
+    LOG_INF("WENS advertising started");
+
+    return 0;
+}
+
+int advertise_wens_stop(void)
+{
+    int err;
+
+    if (!wens_active)
+    {
+        return 0;
+    }
+
+    err = bt_le_ext_adv_stop(wens_set);
     if (err)
     {
         LOG_ERR("Failed to stop WENS advertising (err %d)", err);
         return -1;
     }
 
-    advertise_active = false;
+    _wens_stopped();
+
+    LOG_INF("WENS advertising stopped");
+
+    return 0;
+}
+
+int advertise_gaens_set_interval(uint32_t min, uint32_t max)
+{
+    int err;
+
+    if (min > max)
+    {
+        LOG_ERR("Invalid GAENS advertising interval");
+        return -1;
+    }
+
+    if (gaens_param.interval_min == min && gaens_param.interval_max == max)
+    {
+        return 0;
+    }
+
+    gaens_param.interval_min = min;
+    gaens_param.interval_max = max;
+
+    // The new interval is used when the set is created
+    if (!gaens_set)
+    {
+        return 0;
+    }
+
+    if (!gaens_active)
+    {
+        err = bt_le_ext_adv_update_param(gaens_set, &gaens_param);
+        if (err)
+        {
+            LOG_ERR("Failed to update GAENS advertising parameters (err %d)",
+                    err);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // The controller only takes new parameters for a disabled set, so the set
+    // is disabled in the controller for the parameter command only, as when
+    // the RPI is rotated. The host keeps the set, its address and its data.
+    err = _set_enable(gaens_set, false, 0);
+    if (err)
+    {
+        LOG_ERR("Failed to pause GAENS advertising (err %d)", err);
+        return -1;
+    }
+
+    err = _set_params(gaens_set, &gaens_param);
+    if (err)
+    {
+        LOG_ERR("Failed to update GAENS advertising parameters (err %d)", err);
+    }
+
+    if (_set_enable(gaens_set, true, gaens_events))
+    {
+        LOG_ERR("Failed to resume GAENS advertising");
+        gaens_active = false;
+        _report(&gaens_param, RADIO_GAENS_ADV, false);
+        return -1;
+    }
+
+    _report(&gaens_param, RADIO_GAENS_ADV, true);
+
+    if (!err)
+    {
+        LOG_INF("GAENS advertising interval changed to %u-%u", min, max);
+    }
+
+    return err ? -1 : 0;
+}
+
+int advertise_wens_set_interval(uint32_t min, uint32_t max)
+{
+    bool active = wens_active;
+    int err;
+
+    if (min > max)
+    {
+        LOG_ERR("Invalid WENS advertising interval");
+        return -1;
+    }
+
+    if (wens_param.interval_min == min && wens_param.interval_max == max)
+    {
+        return 0;
+    }
+
+    wens_param.interval_min = min;
+    wens_param.interval_max = max;
+
+    // The new interval is used when the set is created
+    if (!wens_set)
+    {
+        return 0;
+    }
+
+    if (active && advertise_wens_stop() < 0)
+    {
+        return -1;
+    }
+
+    // A set with the directed parameters gets the new interval when it is
+    // started undirected again
+    err = wens_directed ? 0 : bt_le_ext_adv_update_param(wens_set, &wens_param);
+    if (err)
+    {
+        LOG_ERR("Failed to update WENS advertising parameters (err %d)", err);
+    }
+
+    if (active && advertise_wens_start() < 0)
+    {
+        return -1;
+    }
+
+    LOG_INF("WENS advertising interval changed to %u-%u", min, max);
+
+    return err ? -1 : 0;
+}
+
+void advertise_gaens_set_sent_cb(advertise_sent_cb_t cb) { gaens_sent_cb = cb; }
+
+bool advertise_gaens_active(void) { return gaens_active; }
+
+void advertise_wens_set_timeout(uint16_t timeout) { wens_timeout = timeout; }
+
+bool advertise_wens_active(void) { return wens_active; }
+
+int advertise_wens_direct(const bt_addr_le_t *peer)
+{
+    struct bt_le_ext_adv_start_param param = {
+        .timeout = BT_GAP_ADV_HIGH_DUTY_CYCLE_MAX_TIMEOUT};
+    int err;
+
+    if (!wens_set)
+    {
+        return -1;
+    }
+
+    wens_resume = wens_active && !wens_directed;
+
+    if (advertise_wens_stop() < 0)
+    {
+        return -1;
+    }
+
+    bt_addr_le_copy(&direct_peer, peer);
+    direct_param.id = wens_id;
+
+    err = bt_le_ext_adv_update_param(wens_set, &direct_param);
+    if (err)
+    {
+        LOG_ERR("Failed to set directed advertising parameters (err %d)", err);
+        return -1;
+    }
+
+    wens_directed = true;
+
+    // Directed advertising carries no data
+    err = bt_le_ext_adv_start(wens_set, &param);
+    if (err)
+    {
+        LOG_ERR("Directed advertising failed to start (err %d)", err);
+        return -1;
+    }
+
+    wens_active = true;
+    wens_started = k_uptime_get();
+
+    LOG_INF("Directed advertising started");
+
+    return 0;
+}
+
+bool advertise_wens_directed(void) { return wens_active && wens_directed; }
+
+int64_t advertise_wens_get_time(void)
+{
+    unsigned int key = irq_lock();
+    int64_t time = wens_time;
+
+    if (wens_active)
+    {
+        time += k_uptime_get() - wens_started;
+    }
+
+    irq_unlock(key);
+
+    return time;
+}
+
+int advertise_start()
+{
+    if (advertise_gaens_start() < 0 || advertise_wens_start() < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int advertise_stop()
+{
+    if (advertise_gaens_stop() < 0 || advertise_wens_stop() < 0)
+    {
+        return -1;
+    }
 
-    LOG_INF("Advertising stopped");
     return 0;
 }
 
@@ -153,43 +570,356 @@ int advertise_stop()
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
- * @brief Function for starting an extended advertising set
+ * @brief Function for creating an extended advertising set. The set is kept
+ * for as long as the Bluetooth stack is enabled.
+ * 
+ * @param param Advertising parameters.
+ * @param cb Advertising set callbacks, or NULL.
+ * @param adv Pointer to store the advertising set in.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _create_set(struct bt_le_adv_param *param,
+                       const struct bt_le_ext_adv_cb *cb,
+                       struct bt_le_ext_adv **adv)
+{
+    if (*adv)
+    {
+        return 0;
+    }
+
+    return bt_le_ext_adv_create(param, cb, adv);
+}
+
+/**
+ * @brief Function for starting an extended advertising set.
  * 
- * @param param Advertising parameters
- * @param ad Advertising data
- * @param ad_len The length of the advertising data
+ * @param adv The advertising set.
+ * @param ad Advertising data.
+ * @param ad_len The length of the advertising data.
+ * @param timeout Time to advertise for in units of 10 ms, 0 for no timeout.
+ * @param events Number of advertising events to send, 0 for no limit.
  * 
- * @return int Returns 0 on success, negative otherwise
+ * @return int Returns 0 on success, negative otherwise.
  */
-static int bt_ext_advertising_start(struct bt_le_adv_param *param,
-                                    const struct bt_data *ad, size_t ad_len)
+static int _start_set(struct bt_le_ext_adv *adv, const struct bt_data *ad,
+                      size_t ad_len, uint16_t timeout, uint8_t events)
 {
+    struct bt_le_ext_adv_start_param param = {.timeout = timeout,
+                                              .num_events = events};
     int err;
-    struct bt_le_ext_adv_start_param ext_adv_start_param = {0};
 
-    err = bt_le_ext_adv_create(param, NULL, &adv_set);
+    if (!adv)
+    {
+        return -EINVAL;
+    }
+
+    err = bt_le_ext_adv_set_data(adv, ad, ad_len, NULL, 0);
     if (err)
     {
-        LOG_ERR("Could not create %d advertising set (err %d)", param->sid,
-                err);
         return err;
     }
 
-    err = bt_le_ext_adv_set_data(adv_set, ad, ad_len, NULL, 0);
+    return bt_le_ext_adv_start(adv, &param);
+}
+
+/**
+ * @brief Function for giving the GAENS advertising set a new non-resolvable
+ * private address. The set must be disabled in the controller.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _new_gaens_addr(void)
+{
+    int err;
+
+    err = bt_rand(gaens_addr.val, sizeof(gaens_addr.val));
     if (err)
     {
-        LOG_ERR("Could not set data for %d advertising set (err %d)",
-                param->sid, err);
         return err;
     }
 
-    err = bt_le_ext_adv_start(adv_set, &ext_adv_start_param);
+    BT_ADDR_SET_NRPA(&gaens_addr);
+
+    return _set_random_addr(gaens_set, &gaens_addr);
+}
+
+/**
+ * @brief Function for setting the random address of an advertising set over
+ * HCI, as the host only sets it when the set is created or its parameters are
+ * changed. The set must be disabled in the controller.
+ * 
+ * @param adv The advertising set.
+ * @param addr The random address.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _set_random_addr(struct bt_le_ext_adv *adv, const bt_addr_t *addr)
+{
+    struct bt_hci_cp_le_set_adv_set_random_addr *cp;
+    struct net_buf *buf;
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_LE_SET_ADV_SET_RANDOM_ADDR, sizeof(*cp));
+    if (!buf)
+    {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle = bt_le_ext_adv_get_index(adv);
+    bt_addr_copy(&cp->bdaddr, addr);
+
+    return bt_hci_cmd_send_sync(BT_HCI_OP_LE_SET_ADV_SET_RANDOM_ADDR, buf, NULL);
+}
+
+/**
+ * @brief Function for enabling or disabling an advertising set in the
+ * controller only. The host still sees the set as advertising, so this must
+ * only be used to bracket changes to a set that is advertising.
+ * 
+ * @param adv The advertising set.
+ * @param enable True to enable the set, false to disable it.
+ * @param events Number of advertising events to send once enabled, 0 for no
+ * limit.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _set_enable(struct bt_le_ext_adv *adv, bool enable,
+                       uint8_t events)
+{
+    struct bt_hci_cp_le_set_ext_adv_enable *cp;
+    struct bt_hci_ext_adv_set *set;
+    struct net_buf *buf;
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_LE_SET_EXT_ADV_ENABLE,
+                            sizeof(*cp) + sizeof(*set));
+    if (!buf)
+    {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    cp->enable = enable ? BT_HCI_LE_ADV_ENABLE : BT_HCI_LE_ADV_DISABLE;
+    cp->set_num = 1;
+
+    set = net_buf_add(buf, sizeof(*set));
+    set->handle = bt_le_ext_adv_get_index(adv);
+    set->duration = 0;
+    set->max_ext_adv_evts = events;
+
+    return bt_hci_cmd_send_sync(BT_HCI_OP_LE_SET_EXT_ADV_ENABLE, buf, NULL);
+}
+
+/**
+ * @brief Function for setting the parameters of a non-connectable legacy
+ * advertising set over HCI, with the values the host uses for such a set. The
+ * host refuses to update the parameters of a set that is advertising, and the
+ * set must be disabled in the controller.
+ * 
+ * @param adv The advertising set.
+ * @param param The advertising parameters.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _set_params(struct bt_le_ext_adv *adv,
+                       const struct bt_le_adv_param *param)
+{
+    struct bt_hci_cp_le_set_ext_adv_param *cp;
+    struct net_buf *buf;
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_LE_SET_EXT_ADV_PARAM, sizeof(*cp));
+    if (!buf)
+    {
+        return -ENOBUFS;
+    }
+
+    cp = net_buf_add(buf, sizeof(*cp));
+    memset(cp, 0, sizeof(*cp));
+    cp->handle = bt_le_ext_adv_get_index(adv);
+    cp->props = sys_cpu_to_le16(BT_HCI_LE_ADV_PROP_LEGACY);
+    sys_put_le24(param->interval_min, cp->prim_min_interval);
+    sys_put_le24(param->interval_max, cp->prim_max_interval);
+    cp->prim_channel_map = 0x07; // All three primary advertising channels
+    cp->own_addr_type = BT_HCI_OWN_ADDR_RANDOM;
+    cp->filter_policy = BT_LE_ADV_FP_NO_WHITELIST;
+    cp->tx_power = BT_HCI_LE_ADV_TX_POWER_NO_PREF;
+    cp->prim_adv_phy = BT_HCI_LE_PHY_1M;
+    cp->sec_adv_phy = BT_HCI_LE_PHY_1M;
+    cp->sid = param->sid;
+
+    return bt_hci_cmd_send_sync(BT_HCI_OP_LE_SET_EXT_ADV_PARAM, buf, NULL);
+}
+
+/**
+ * @brief Function for getting the identity used for WENS advertising. The
+ * identity is created the first time, and is reused if it has been loaded
+ * from settings.
+ * 
+ * @param id Pointer to store the identity in.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _wens_identity(uint8_t *id)
+{
+    size_t count;
+    int err;
+
+    bt_id_get(NULL, &count);
+
+    if (count > 1)
+    {
+        *id = 1;
+        return 0;
+    }
+
+    err = bt_id_create(NULL, NULL);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    *id = err;
+
+    return 0;
+}
+
+/**
+ * @brief Callback for when the GAENS advertising set has stopped by itself,
+ * because it has sent the advertising events it was started for.
+ * 
+ * @param adv The advertising set.
+ * @param info Information about the advertising that was done.
+ */
+static void _gaens_sent(struct bt_le_ext_adv *adv,
+                        struct bt_le_ext_adv_sent_info *info)
+{
+    gaens_active = false;
+    _report(&gaens_param, RADIO_GAENS_ADV, false);
+
+    if (gaens_sent_cb)
+    {
+        gaens_sent_cb(info->num_sent);
+    }
+}
+
+/**
+ * @brief Callback for when the WENS advertising set has stopped by itself,
+ * because its timeout has expired. Directed advertising that timed out goes
+ * back to undirected advertising.
+ * 
+ * @param adv The advertising set.
+ * @param info Information about the advertising that was done.
+ */
+static void _wens_sent(struct bt_le_ext_adv *adv,
+                       struct bt_le_ext_adv_sent_info *info)
+{
+    _wens_stopped();
+
+    if (wens_directed)
+    {
+        LOG_INF("Directed advertising timed out");
+        k_work_submit(&_undirect_work);
+    }
+}
+
+/**
+ * @brief Callback for when a phone has connected to the WENS advertising set.
+ * The controller stops the set when a connection is made.
+ * 
+ * @param adv The advertising set.
+ * @param info Information about the connection.
+ */
+static void _wens_connected(struct bt_le_ext_adv *adv,
+                            struct bt_le_ext_adv_connected_info *info)
+{
+    _wens_stopped();
+}
+
+/**
+ * @brief Function for marking WENS advertising as stopped, and adding the
+ * time it advertised to the total.
+ */
+static void _wens_stopped(void)
+{
+    unsigned int key = irq_lock();
+
+    if (wens_active)
+    {
+        wens_time += k_uptime_get() - wens_started;
+        wens_active = false;
+    }
+
+    irq_unlock(key);
+
+    _report(&wens_param, RADIO_WENS_ADV, false);
+}
+
+/**
+ * @brief Function for giving the WENS advertising set its undirected
+ * parameters. They are applied every time the set is started, as directed
+ * advertising or a timeout may have left the set with other parameters. The
+ * set must be stopped.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _wens_undirect(void)
+{
+    int err;
+
+    err = bt_le_ext_adv_update_param(wens_set, &wens_param);
     if (err)
     {
-        LOG_ERR("Advertising for set %d failed to start (err %d)", param->sid,
-                err);
         return err;
     }
 
-    return err;
-}
\ No newline at end of file
+    wens_directed = false;
+
+    return 0;
+}
+
+/**
+ * @brief Work handler returning the WENS advertising set to undirected
+ * advertising after directed advertising timed out. Undirected advertising
+ * is started again if it was stopped for the directed advertising.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _undirect_handler(struct k_work *unused)
+{
+    int err;
+
+    // Started again in the meantime
+    if (wens_active || !wens_directed)
+    {
+        return;
+    }
+
+    if (wens_resume)
+    {
+        advertise_wens_start();
+        return;
+    }
+
+    err = _wens_undirect();
+    if (err)
+    {
+        LOG_ERR("Failed to restore WENS advertising parameters (err %d)", err);
+    }
+}
+
+/**
+ * @brief Function for telling the radio coordinator about an advertising
+ * stream.
+ * 
+ * @param param The advertising parameters of the stream.
+ * @param activity The radio activity of the stream.
+ * @param active True if the stream is advertising.
+ */
+static void _report(struct bt_le_adv_param *param, radio_activity_t activity,
+                    bool active)
+{
+    // The interval is in units of 0.625 ms
+    uint32_t period = (param->interval_min + param->interval_max) * 625 / 2;
+
+    radio_update(activity, active, period, RADIO_ADV_EVENT_TIME);
+}
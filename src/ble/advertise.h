@@ -2,7 +2,12 @@
  * @file
  * @brief Advertise library
  * 
- * This is a library for controlling the BLE advertising.
+ * This is a library for controlling the BLE advertising. GAENS and WENS are
+ * advertised from two extended advertising sets, which are created once and
+ * are started, stopped and updated independently. GAENS is advertised from a
+ * non-resolvable private address that changes with the RPI, and WENS from a
+ * stable identity of its own. After a bonded phone disconnects, the WENS set
+ * can briefly advertise directly to it, so it reconnects at once.
  */
 
 #ifndef ADVERTISE_H
@@ -13,12 +18,35 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include <bluetooth/bluetooth.h>
 
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Callback for when an advertising set started for a number of
+ * advertising events has sent them, and stopped by itself.
+ *
+ * @param num_sent The number of advertising events sent.
+ */
+typedef void (*advertise_sent_cb_t)(uint8_t num_sent);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
- * @brief Function for changing the GAENS service data to advertise.
+ * @brief Function for creating the advertising sets. Must be called after the
+ * Bluetooth stack is enabled, and before advertising is started.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_init(void);
+
+/**
+ * @brief Function for rotating the GAENS identity. The service data is changed
+ * to the new RPI and AEM, and the advertising set gets a new non-resolvable
+ * private address. Both are applied in the same controller update, so the new
+ * RPI is never advertised from the old address or the other way around.
  * 
  * @param rpi A pointer to the Rolling Proximity Identifier.
  * @param rpi_length The length of the RPI.
@@ -27,18 +55,138 @@
  * 
  * @return int Returns 0 on success, negative otherwise.
  */
-int advertise_change_gaens_service_data(uint8_t *rpi, uint8_t rpi_length,
-                                        uint8_t *aem, uint8_t aem_length);
+int advertise_gaens_rotate(uint8_t *rpi, uint8_t rpi_length, uint8_t *aem,
+                           uint8_t aem_length);
+
+/**
+ * @brief Function for starting to advertise GAENS.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_gaens_start(void);
+
+/**
+ * @brief Function for advertising GAENS for a number of advertising events,
+ * after which the set stops by itself. The limit is kept when the GAENS
+ * identity is rotated, and the count starts over.
+ * 
+ * @param events The number of advertising events, 0 for no limit.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_gaens_start_events(uint8_t events);
+
+/**
+ * @brief Function for setting the callback for when the GAENS advertising set
+ * has sent the advertising events it was started for.
+ * 
+ * @param cb The callback, or NULL.
+ */
+void advertise_gaens_set_sent_cb(advertise_sent_cb_t cb);
+
+/**
+ * @brief Function for checking if GAENS is being advertised.
+ * 
+ * @return bool True if GAENS is being advertised.
+ */
+bool advertise_gaens_active(void);
+
+/**
+ * @brief Function for stopping to advertise GAENS.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_gaens_stop(void);
+
+/**
+ * @brief Function for starting to advertise WENS.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_wens_start(void);
+
+/**
+ * @brief Function for stopping to advertise WENS.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_wens_stop(void);
+
+/**
+ * @brief Function for changing the GAENS advertising interval. If GAENS is
+ * advertising, the set is restarted with the new interval and the same
+ * address.
+ * 
+ * @param min Minimum advertising interval in units of 0.625 ms.
+ * @param max Maximum advertising interval in units of 0.625 ms.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_gaens_set_interval(uint32_t min, uint32_t max);
+
+/**
+ * @brief Function for changing the WENS advertising interval. If WENS is
+ * advertising, the set is restarted with the new interval.
+ * 
+ * @param min Minimum advertising interval in units of 0.625 ms.
+ * @param max Maximum advertising interval in units of 0.625 ms.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_wens_set_interval(uint32_t min, uint32_t max);
+
+/**
+ * @brief Function for setting how long WENS advertises for each time it is
+ * started. Used from the next start.
+ * 
+ * @param timeout Time in units of 10 ms, 0 to advertise until stopped.
+ */
+void advertise_wens_set_timeout(uint16_t timeout);
+
+/**
+ * @brief Function for checking if WENS is advertising. WENS stops by itself
+ * when its timeout expires or a phone connects.
+ * 
+ * @return bool True if WENS is advertising.
+ */
+bool advertise_wens_active(void);
+
+/**
+ * @brief Function for advertising WENS directly to a bonded phone with high
+ * duty cycle. Undirected WENS advertising is stopped while the directed
+ * advertising runs. The directed advertising stops after 1.28 s if the phone
+ * has not connected, and the set goes back to undirected advertising, which
+ * is started again if it was running.
+ * 
+ * @param peer The identity address of the phone.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int advertise_wens_direct(const bt_addr_le_t *peer);
+
+/**
+ * @brief Function for checking if WENS is advertising directly to a phone.
+ * 
+ * @return bool True if directed advertising is running.
+ */
+bool advertise_wens_directed(void);
+
+/**
+ * @brief Function for getting the total time WENS has advertised since boot.
+ * 
+ * @return int64_t The time in milliseconds.
+ */
+int64_t advertise_wens_get_time(void);
 
 /**
- * @brief Function for starting to advertise.
+ * @brief Function for starting to advertise both GAENS and WENS.
  * 
  * @return int Returns 0 on success, negative otherwise.
  */
 int advertise_start();
 
 /**
- * @brief Function for stopping to advertise.
+ * @brief Function for stopping to advertise both GAENS and WENS.
  * 
  * @return int Returns 0 on success, negative otherwise.
  */
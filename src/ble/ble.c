@@ -4,11 +4,14 @@
 
 #include "ble.h"
 #include "../gaens/gaens.h"
+#include "adv_policy.h"
 #include "advertise.h"
 #include "connection.h"
 #include "scan.h"
 #include "services/bs/bas.h"
 #include "services/dis/dis.h"
+#include "services/wens/bulk.h"
+#include "services/wens/indication.h"
 #include "services/wens/wens.h"
 #include <stddef.h>
 
@@ -18,6 +21,7 @@
 #include <bluetooth/hci.h>
 
 #include <logging/log.h>
+#include <settings/settings.h>
 #include <sys/util.h>
 #include <zephyr/types.h>
 
@@ -37,6 +41,7 @@ int ble_init(void)
     int err;
 
     connection_init();
+    indication_init();
 
     err = gaens_init();
     if (err)
@@ -52,12 +57,40 @@ int ble_init(void)
         return 1;
     }
 
+    err = bulk_init();
+    if (err)
+    {
+        LOG_ERR("Failed to initialize the bulk channel");
+    }
+
+    // Bonds and the WENS identity are restored before advertising starts
+    if (IS_ENABLED(CONFIG_SETTINGS))
+    {
+        err = settings_load();
+        if (err)
+        {
+            LOG_ERR("Failed to load settings (err %d)", err);
+        }
+    }
+
+    err = advertise_init();
+    if (err)
+    {
+        LOG_ERR("Failed to initialize advertising");
+    }
+
     err = advertise_start();
     if (err)
     {
         LOG_ERR("Failed to start advertising");
     }
 
+    err = adv_policy_init();
+    if (err)
+    {
+        LOG_ERR("Failed to initialize advertising policy");
+    }
+
     err = scan_start();
     if (err)
     {
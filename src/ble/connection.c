@@ -8,7 +8,10 @@
  * This file contains the USB device core layer APIs and structures.
  */
 #include "connection.h"
+#include "adv_policy.h"
 #include "advertise.h"
+#include "link.h"
+#include "radio.h"
 #include "scan.h"
 #include "services/wens/wens.h"
 #include <stddef.h>
@@ -20,6 +23,7 @@
 
 #include <logging/log.h>
 #include <sys/util.h>
+#include <zephyr.h>
 #include <zephyr/types.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -29,12 +33,46 @@
 #define LOG_MODULE_NAME connection
 LOG_MODULE_REGISTER(connection);
 
+#define BULK_IDLE_TIMEOUT 2000 // Time without traffic that ends a transfer (ms)
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the state of a connection. */
+typedef struct
+{
+    struct bt_conn *conn;
+    uint16_t interval;         // Connection interval in units of 1.25 ms
+    volatile bool bulk_active; // True while data is moved over the connection
+    bool reconnected;          // True until the first byte after a reconnect
+    struct k_timer bulk_timer; // Ends the bulk transfer once the link is idle
+    struct k_work share_work;  // Shares the radio again
+} peer_t;
+
+/* This struct is used to look for an address among the bonds. */
+typedef struct
+{
+    const bt_addr_le_t *addr;
+    bool found;
+} bond_search_t;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private variables
 ////////////////////////////////////////////////////////////////////////////////
 
-/* BLE connection */
-static struct bt_conn *conn;
+/* BLE connections, indexed by bt_conn_index() */
+static peer_t peers[CONFIG_BT_MAX_CONN];
+
+/* The bonded phone that disconnected last, and when it did */
+static bt_addr_le_t last_bonded;
+static bool reconnect_pending = false;
+static bool reconnect_directed = false;
+static int64_t disconnected_at;
+
+static connection_reconnect_stats_t reconnect_stats = {
+    .best_first_byte_time = UINT32_MAX,
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private function declarations
@@ -42,21 +80,117 @@ static struct bt_conn *conn;
 
 static void _connected(struct bt_conn *connected, uint8_t err);
 static void _disconnected(struct bt_conn *disconn, uint8_t reason);
+static void _le_param_updated(struct bt_conn *updated, uint16_t interval,
+                              uint16_t latency, uint16_t timeout);
 
-////////////////////////////////////////////////////////////////////////////////
-// Type declarations
-///////////////////////////////////////////////////////////////////////////////
+static void _share_handler(struct k_work *work);
+
+static void _bulk_timer_handler(struct k_timer *timer);
+
+static void _share_radio(void);
+
+static void _bond_cb(const struct bt_bond_info *info, void *user_data);
 
 static struct bt_conn_cb conn_callbacks = {
     .connected = _connected,
     .disconnected = _disconnected,
+    .le_param_updated = _le_param_updated,
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 // Public functions
 ////////////////////////////////////////////////////////////////////////////////
 
-void connection_init() { bt_conn_cb_register(&conn_callbacks); }
+void connection_init()
+{
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+    {
+        k_timer_init(&peers[i].bulk_timer, _bulk_timer_handler, NULL);
+        k_work_init(&peers[i].share_work, _share_handler);
+    }
+
+    bt_conn_cb_register(&conn_callbacks);
+    link_init();
+}
+
+bool connection_is_connected(void) { return connection_count() > 0; }
+
+size_t connection_count(void)
+{
+    size_t count = 0;
+
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+    {
+        if (peers[i].conn)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+bool connection_is_bonded(struct bt_conn *conn, bt_addr_le_t *addr)
+{
+    struct bt_conn_info info;
+    bond_search_t search = {.found = false};
+
+    if (bt_conn_get_info(conn, &info) != 0)
+    {
+        return false;
+    }
+
+    bt_addr_le_copy(addr, info.le.dst);
+
+    search.addr = addr;
+    bt_foreach_bond(info.id, _bond_cb, &search);
+
+    return search.found;
+}
+
+void connection_foreach(void (*func)(struct bt_conn *conn, void *data),
+                        void *data)
+{
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+    {
+        if (peers[i].conn)
+        {
+            func(peers[i].conn, data);
+        }
+    }
+}
+
+void connection_get_reconnect_stats(connection_reconnect_stats_t *stats)
+{
+    *stats = reconnect_stats;
+}
+
+void connection_activity(struct bt_conn *conn, size_t bytes)
+{
+    peer_t *peer = &peers[bt_conn_index(conn)];
+
+    link_traffic(conn, bytes);
+
+    if (peer->reconnected)
+    {
+        peer->reconnected = false;
+        reconnect_stats.first_byte_time = k_uptime_get() - disconnected_at;
+        reconnect_stats.best_first_byte_time =
+            MIN(reconnect_stats.best_first_byte_time,
+                reconnect_stats.first_byte_time);
+
+        LOG_INF("First byte %u ms after the disconnection",
+                reconnect_stats.first_byte_time);
+    }
+
+    k_timer_start(&peer->bulk_timer, K_MSEC(BULK_IDLE_TIMEOUT), K_NO_WAIT);
+
+    if (!peer->bulk_active)
+    {
+        peer->bulk_active = true;
+        k_work_submit(&peer->share_work);
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private functions
@@ -64,36 +198,229 @@ void connection_init() { bt_conn_cb_register(&conn_callbacks); }
 
 static void _connected(struct bt_conn *connected, uint8_t err)
 {
+    peer_t *peer;
+    struct bt_conn_info info;
+
+    if (err == BT_HCI_ERR_ADV_TIMEOUT)
+    {
+        // The advertise library has gone back to undirected advertising. Fall
+        // back to the advertising policy
+        adv_policy_update();
+        return;
+    }
+
     if (err)
     {
         LOG_ERR("Connection failed (err %u)", err);
+        return;
     }
-    else
+
+    peer = &peers[bt_conn_index(connected)];
+
+    if (!peer->conn)
     {
-        LOG_INF("Connected");
+        peer->conn = bt_conn_ref(connected);
+    }
+
+    LOG_INF("Connected (%u of %u)", connection_count(), CONFIG_BT_MAX_CONN);
+
+    // Connectable advertising stops with the connection. It is started again
+    // by the policy if a window is open and another peer can connect. Scanning
+    // and GAENS advertising go on
+    advertise_wens_stop();
+    adv_policy_update();
 
-        // Stop advertising and scanning
-        advertise_stop();
-        scan_stop();
+    if (bt_conn_get_info(connected, &info) == 0)
+    {
+        _le_param_updated(connected, info.le.interval, info.le.latency,
+                          info.le.timeout);
 
-        if (!conn)
+        // Time the reconnect of the bonded phone that disconnected last
+        if (reconnect_pending && !bt_addr_le_cmp(info.le.dst, &last_bonded))
         {
-            conn = bt_conn_ref(connected);
+            reconnect_pending = false;
+            peer->reconnected = true;
+
+            reconnect_stats.count++;
+            reconnect_stats.directed += reconnect_directed;
+            reconnect_stats.connect_time = k_uptime_get() - disconnected_at;
+
+            LOG_INF("Reconnected %u ms after the disconnection (%s)",
+                    reconnect_stats.connect_time,
+                    reconnect_directed ? "directed" : "undirected");
         }
     }
+
+    peer->bulk_active = false;
+    k_work_submit(&peer->share_work);
 }
 
 static void _disconnected(struct bt_conn *disconn, uint8_t reason)
 {
-    if (conn)
+    peer_t *peer = &peers[bt_conn_index(disconn)];
+    scan_stats_t stats;
+    bt_addr_le_t addr;
+
+    k_timer_stop(&peer->bulk_timer);
+    peer->bulk_active = false;
+    peer->reconnected = false;
+    peer->interval = 0;
+
+    // A bonded phone that lost the link is asked to come back at once. A
+    // disconnection made by this device is meant to last
+    reconnect_pending = reason != BT_HCI_ERR_LOCALHOST_TERM_CONN &&
+                        connection_is_bonded(disconn, &addr);
+
+    if (reconnect_pending)
+    {
+        bt_addr_le_copy(&last_bonded, &addr);
+        disconnected_at = k_uptime_get();
+        reconnect_directed = advertise_wens_direct(&last_bonded) == 0;
+    }
+
+    if (peer->conn)
     {
-        bt_conn_unref(conn);
-        conn = NULL;
+        bt_conn_unref(peer->conn);
+        peer->conn = NULL;
     }
 
     LOG_INF("Disconnected (reason %u)", reason);
 
-    // Start advertising and scanning again
-    advertise_start();
-    scan_start();
-}
\ No newline at end of file
+    wens_disconnected(disconn);
+    _share_radio();
+
+    // Start connectable advertising again if a window is open. With directed
+    // advertising running, this is done once it times out
+    if (!advertise_wens_directed())
+    {
+        adv_policy_update();
+    }
+
+    scan_get_stats(&stats);
+    LOG_INF("Connections have cost %d ms of scanning in %u s",
+            stats.lost_scan_time, stats.connected_time);
+}
+
+/**
+ * @brief Work handler tuning a connection for a bulk transfer or for an idle
+ * link, and sharing the radio again.
+ * 
+ * @param work The share work of the connection.
+ */
+static void _share_handler(struct k_work *work)
+{
+    peer_t *peer = CONTAINER_OF(work, peer_t, share_work);
+    bool bulk = peer->bulk_active;
+
+    if (!peer->conn)
+    {
+        return;
+    }
+
+    link_set_bulk(peer->conn, bulk);
+    _share_radio();
+
+    LOG_INF("Connection %u tuned for %s", bt_conn_index(peer->conn),
+            bulk ? "bulk transfer" : "idle link");
+}
+
+/**
+ * @brief Function for sharing the radio between the connections, scanning
+ * and advertising. While any connection moves data, scanning gets short
+ * windows between the connection events. Otherwise, the connections have
+ * long intervals with latency, and scanning gets its normal windows. The
+ * connection with the shortest interval sets the gaps scanning fits in.
+ */
+static void _share_radio(void)
+{
+    bool connected = false;
+    bool bulk = false;
+    uint16_t interval = UINT16_MAX;
+
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+    {
+        if (!peers[i].conn)
+        {
+            continue;
+        }
+
+        connected = true;
+        bulk |= peers[i].bulk_active;
+
+        if (peers[i].interval > 0)
+        {
+            interval = MIN(interval, peers[i].interval);
+        }
+    }
+
+    if (connected && interval != UINT16_MAX)
+    {
+        // The latency is left out, as the phone may send data in any event
+        radio_update(RADIO_CONNECTION, true, interval * 1250,
+                     RADIO_CONN_EVENT_TIME);
+    }
+    else
+    {
+        radio_update(RADIO_CONNECTION, false, 0, 0);
+    }
+
+    radio_set_connection_busy(bulk);
+
+    if (!connected)
+    {
+        scan_set_profile(SCAN_PROFILE_NORMAL);
+    }
+    else
+    {
+        scan_set_profile(bulk ? SCAN_PROFILE_BULK : SCAN_PROFILE_CONNECTED);
+    }
+}
+
+/**
+ * @brief Bond iteration callback looking for an address.
+ * 
+ * @param info The bond.
+ * @param user_data The search, see @c bond_search_t.
+ */
+static void _bond_cb(const struct bt_bond_info *info, void *user_data)
+{
+    bond_search_t *search = user_data;
+
+    if (!bt_addr_le_cmp(&info->addr, search->addr))
+    {
+        search->found = true;
+    }
+}
+
+/**
+ * @brief Callback for when the connection parameters have changed.
+ * 
+ * @param updated The connection.
+ * @param interval The connection interval in units of 1.25 ms.
+ * @param latency The number of connection events that may be skipped.
+ * @param timeout The supervision timeout in units of 10 ms.
+ */
+static void _le_param_updated(struct bt_conn *updated, uint16_t interval,
+                              uint16_t latency, uint16_t timeout)
+{
+    peers[bt_conn_index(updated)].interval = interval;
+
+    _share_radio();
+
+    LOG_INF("Connection %u interval %u, latency %u", bt_conn_index(updated),
+            interval, latency);
+}
+
+/**
+ * @brief Timer handler ending the bulk transfer of a connection once there
+ * has been no traffic for a while.
+ * 
+ * @param timer The bulk timer of the connection.
+ */
+static void _bulk_timer_handler(struct k_timer *timer)
+{
+    peer_t *peer = CONTAINER_OF(timer, peer_t, bulk_timer);
+
+    peer->bulk_active = false;
+    k_work_submit(&peer->share_work);
+}
@@ -8,6 +8,32 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the reconnect latencies of bonded phones, measured from
+the disconnection. */
+typedef struct
+{
+    uint32_t count;                // Reconnects measured
+    uint32_t directed;             // Reconnects through directed advertising
+    uint32_t connect_time;         // Time to the last reconnect (in ms)
+    uint32_t first_byte_time;      // Time to the first byte after it (in ms)
+    uint32_t best_first_byte_time; // Shortest time to the first byte (in ms)
+} connection_reconnect_stats_t;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -17,4 +43,56 @@
  */
 void connection_init();
 
+/**
+ * @brief Function for checking if a phone is connected
+ * 
+ * @return bool True if at least one phone is connected
+ */
+bool connection_is_connected(void);
+
+/**
+ * @brief Function for counting the connected peers
+ * 
+ * @return size_t The number of connections, at most CONFIG_BT_MAX_CONN
+ */
+size_t connection_count(void);
+
+/**
+ * @brief Function for checking if the peer of a connection is bonded
+ * 
+ * @param conn The connection
+ * @param addr Pointer to store the identity address of the peer in
+ * 
+ * @return bool True if the peer is bonded
+ */
+bool connection_is_bonded(struct bt_conn *conn, bt_addr_le_t *addr);
+
+/**
+ * @brief Function for calling a function for each connected peer
+ * 
+ * @param func The function, given the connection and @c data
+ * @param data User data passed to @c func
+ */
+void connection_foreach(void (*func)(struct bt_conn *conn, void *data),
+                        void *data);
+
+/**
+ * @brief Function for telling the connection module that data is being moved
+ * over a connection. The radio is shared in favour of the connection until
+ * there has been no traffic on it for a while. Each connection is tuned on
+ * its own, so transfers to different peers do not hold each other back.
+ * 
+ * @param conn The connection.
+ * @param bytes The number of bytes moved.
+ */
+void connection_activity(struct bt_conn *conn, size_t bytes);
+
+/**
+ * @brief Function for getting the reconnect latencies of bonded phones. Each
+ * reconnect is also logged.
+ * 
+ * @param stats Pointer to store the latencies in
+ */
+void connection_get_reconnect_stats(connection_reconnect_stats_t *stats);
+
 #endif // CONNECTION_H
\ No newline at end of file
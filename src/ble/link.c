@@ -0,0 +1,344 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "link.h"
+#include <string.h>
+
+/* Zephyr includes */
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME link
+LOG_MODULE_REGISTER(link);
+
+// Connection parameters while data is moved: 7.5-15 ms interval, no latency
+#define BULK_CONN_PARAMETERS BT_LE_CONN_PARAM(6, 12, 0, 400)
+
+// Connection parameters while the link is idle: 100-200 ms interval, and up
+// to 4 connection events may be skipped, which frees the radio for scanning
+// and advertising
+#define IDLE_CONN_PARAMETERS BT_LE_CONN_PARAM(80, 160, 4, 400)
+
+#define DEFAULT_DATA_LENGTH 27 // Link layer payload before any update (bytes)
+#define DEFAULT_MTU         23 // ATT MTU before any exchange (bytes)
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the state of the link of a connection. */
+typedef struct
+{
+    link_stats_t stats;
+    bool mtu_exchanged;
+    struct bt_gatt_exchange_params exchange_params;
+    bool bulk_active;
+    int64_t bulk_start;
+    int64_t last_traffic;
+    uint32_t bulk_bytes;
+} link_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+/* Links, indexed by bt_conn_index() */
+static link_t links[CONFIG_BT_MAX_CONN];
+
+K_MUTEX_DEFINE(_link_mutex);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _connected(struct bt_conn *conn, uint8_t err);
+static void _disconnected(struct bt_conn *conn, uint8_t reason);
+static void _le_param_updated(struct bt_conn *conn, uint16_t interval,
+                              uint16_t latency, uint16_t timeout);
+static void _le_phy_updated(struct bt_conn *conn,
+                            struct bt_conn_le_phy_info *param);
+static void _le_data_len_updated(struct bt_conn *conn,
+                                 struct bt_conn_le_data_len_info *info);
+
+static void _mtu_exchanged(struct bt_conn *conn, uint8_t err,
+                           struct bt_gatt_exchange_params *params);
+
+static void _negotiate(struct bt_conn *conn, link_t *link);
+
+static void _bulk_ended(link_t *link);
+
+static struct bt_conn_cb link_callbacks = {
+    .connected = _connected,
+    .disconnected = _disconnected,
+    .le_param_updated = _le_param_updated,
+    .le_phy_updated = _le_phy_updated,
+    .le_data_len_updated = _le_data_len_updated,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+void link_init(void) { bt_conn_cb_register(&link_callbacks); }
+
+void link_set_bulk(struct bt_conn *conn, bool bulk)
+{
+    link_t *link = &links[bt_conn_index(conn)];
+    int err;
+
+    if (bulk)
+    {
+        _negotiate(conn, link);
+    }
+    else
+    {
+        _bulk_ended(link);
+    }
+
+    err = bt_conn_le_param_update(conn, bulk ? BULK_CONN_PARAMETERS
+                                             : IDLE_CONN_PARAMETERS);
+    if (err)
+    {
+        LOG_WRN("Failed to update connection parameters (err %d)", err);
+    }
+}
+
+void link_traffic(struct bt_conn *conn, size_t bytes)
+{
+    link_t *link = &links[bt_conn_index(conn)];
+    int64_t now = k_uptime_get();
+
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+
+    // The first traffic after an idle period starts a transfer
+    if (!link->bulk_active)
+    {
+        link->bulk_active = true;
+        link->bulk_start = now;
+        link->bulk_bytes = 0;
+    }
+
+    link->bulk_bytes += bytes;
+    link->last_traffic = now;
+
+    k_mutex_unlock(&_link_mutex);
+}
+
+void link_get_stats(struct bt_conn *conn, link_stats_t *stats)
+{
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+    *stats = links[bt_conn_index(conn)].stats;
+    k_mutex_unlock(&_link_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Callback for when a connection is made. The link parameters of the
+ * new connection are read.
+ * 
+ * @param conn The connection.
+ * @param err Zero on success, an HCI error code otherwise.
+ */
+static void _connected(struct bt_conn *conn, uint8_t err)
+{
+    link_t *link = &links[bt_conn_index(conn)];
+    struct bt_conn_info info;
+
+    if (err || bt_conn_get_info(conn, &info) != 0)
+    {
+        return;
+    }
+
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+    memset(link, 0, sizeof(*link));
+    link->stats.phy = info.le.phy ? info.le.phy->tx_phy : BT_GAP_LE_PHY_1M;
+    link->stats.data_length = info.le.data_len ? info.le.data_len->tx_max_len
+                                               : DEFAULT_DATA_LENGTH;
+    link->stats.mtu = DEFAULT_MTU;
+    link->stats.interval = info.le.interval;
+    k_mutex_unlock(&_link_mutex);
+}
+
+/**
+ * @brief Callback for when a connection is lost. A bulk transfer in progress
+ * is ended.
+ * 
+ * @param conn The connection.
+ * @param reason The HCI reason for the disconnection.
+ */
+static void _disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    _bulk_ended(&links[bt_conn_index(conn)]);
+}
+
+/**
+ * @brief Callback for when the connection parameters have changed.
+ * 
+ * @param conn The connection.
+ * @param interval The connection interval in units of 1.25 ms.
+ * @param latency The number of connection events that may be skipped.
+ * @param timeout The supervision timeout in units of 10 ms.
+ */
+static void _le_param_updated(struct bt_conn *conn, uint16_t interval,
+                              uint16_t latency, uint16_t timeout)
+{
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+    links[bt_conn_index(conn)].stats.interval = interval;
+    k_mutex_unlock(&_link_mutex);
+}
+
+/**
+ * @brief Callback for when the PHY of the connection has changed.
+ * 
+ * @param conn The connection.
+ * @param param The PHYs now in use.
+ */
+static void _le_phy_updated(struct bt_conn *conn,
+                            struct bt_conn_le_phy_info *param)
+{
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+    links[bt_conn_index(conn)].stats.phy = param->tx_phy;
+    k_mutex_unlock(&_link_mutex);
+
+    LOG_INF("PHY updated (tx %u, rx %u)", param->tx_phy, param->rx_phy);
+}
+
+/**
+ * @brief Callback for when the data length of the connection has changed.
+ * 
+ * @param conn The connection.
+ * @param info The data lengths now in use.
+ */
+static void _le_data_len_updated(struct bt_conn *conn,
+                                 struct bt_conn_le_data_len_info *info)
+{
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+    links[bt_conn_index(conn)].stats.data_length = info->tx_max_len;
+    k_mutex_unlock(&_link_mutex);
+
+    LOG_INF("Data length updated (tx %u, rx %u)", info->tx_max_len,
+            info->rx_max_len);
+}
+
+/**
+ * @brief Callback for when the ATT MTU exchange is done.
+ * 
+ * @param conn The connection.
+ * @param err Zero on success, an ATT error code otherwise.
+ * @param params The parameters of the exchange.
+ */
+static void _mtu_exchanged(struct bt_conn *conn, uint8_t err,
+                           struct bt_gatt_exchange_params *params)
+{
+    uint16_t mtu = bt_gatt_get_mtu(conn);
+
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+    links[bt_conn_index(conn)].stats.mtu = mtu;
+    k_mutex_unlock(&_link_mutex);
+
+    if (err)
+    {
+        LOG_WRN("MTU exchange failed (err %u)", err);
+        return;
+    }
+
+    LOG_INF("MTU exchanged (%u bytes)", mtu);
+}
+
+/**
+ * @brief Function for asking the phone for the fastest link it accepts. The
+ * phone may turn any of the requests down, so the parameters in use are taken
+ * from the update callbacks. Requests that are already granted are skipped.
+ * 
+ * @param conn The connection.
+ * @param link The link of the connection.
+ */
+static void _negotiate(struct bt_conn *conn, link_t *link)
+{
+    int err;
+
+    if (link->stats.phy != BT_GAP_LE_PHY_2M)
+    {
+        err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+        if (err)
+        {
+            LOG_WRN("Failed to request the 2M PHY (err %d)", err);
+        }
+    }
+
+    if (link->stats.data_length < BT_GAP_DATA_LEN_MAX)
+    {
+        err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+        if (err)
+        {
+            LOG_WRN("Failed to request a longer data length (err %d)", err);
+        }
+    }
+
+    // The MTU can only be exchanged once per connection
+    if (!link->mtu_exchanged)
+    {
+        link->exchange_params.func = _mtu_exchanged;
+
+        err = bt_gatt_exchange_mtu(conn, &link->exchange_params);
+        if (err)
+        {
+            LOG_WRN("Failed to exchange MTU (err %d)", err);
+        }
+        else
+        {
+            link->mtu_exchanged = true;
+        }
+    }
+}
+
+/**
+ * @brief Function for working out the throughput of a bulk transfer that has
+ * ended, if one is in progress. The transfer is counted up to the last
+ * traffic, so the idle time that ended it is left out.
+ * 
+ * @param link The link of the connection.
+ */
+static void _bulk_ended(link_t *link)
+{
+    link_stats_t *stats = &link->stats;
+    uint32_t time = 0;
+
+    k_mutex_lock(&_link_mutex, K_FOREVER);
+
+    if (link->bulk_active)
+    {
+        link->bulk_active = false;
+        time = link->last_traffic - link->bulk_start;
+    }
+
+    if (time > 0)
+    {
+        stats->bytes = link->bulk_bytes;
+        stats->time = time;
+        stats->throughput = (uint64_t)link->bulk_bytes * MSEC_PER_SEC / time;
+        stats->peak = MAX(stats->peak, stats->throughput);
+    }
+
+    k_mutex_unlock(&_link_mutex);
+
+    if (time > 0)
+    {
+        LOG_INF("Bulk transfer of %u bytes in %u ms: %u bytes/s", stats->bytes,
+                stats->time, stats->throughput);
+        LOG_INF("PHY %u, data length %u, MTU %u, interval %u", stats->phy,
+                stats->data_length, stats->mtu, stats->interval);
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * @brief Link tuning module
+ * 
+ * This is a module for tuning connections for throughput. Each connection is
+ * tuned on its own. When a bulk transfer starts, the fastest parameters the
+ * phone accepts are negotiated: the 2M PHY, the longest data length, a larger
+ * ATT MTU and a short connection interval. When the transfer is over, the
+ * connection interval is relaxed again. The PHY and the data length are kept,
+ * as they also make each packet cheaper.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the link parameters in use and the throughput of the
+last bulk transfer. */
+typedef struct
+{
+    uint8_t phy;          // PHY used to send (BT_GAP_LE_PHY_*)
+    uint16_t data_length; // Longest link layer payload sent (in bytes)
+    uint16_t mtu;         // ATT MTU (in bytes)
+    uint16_t interval;    // Connection interval in units of 1.25 ms
+    uint32_t bytes;       // Bytes moved in the last bulk transfer
+    uint32_t time;        // Length of the last bulk transfer (in ms)
+    uint32_t throughput;  // Throughput of the last bulk transfer (in bytes/s)
+    uint32_t peak;        // Highest throughput of a bulk transfer (in bytes/s)
+} link_stats_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for initializing the link tuning module.
+ */
+void link_init(void);
+
+/**
+ * @brief Function for starting or ending a bulk transfer on a connection.
+ * 
+ * @param conn The connection.
+ * @param bulk True when a bulk transfer starts, false when it ends.
+ */
+void link_set_bulk(struct bt_conn *conn, bool bulk);
+
+/**
+ * @brief Function for counting the bytes moved over a connection.
+ * 
+ * @param conn The connection.
+ * @param bytes The number of bytes.
+ */
+void link_traffic(struct bt_conn *conn, size_t bytes);
+
+/**
+ * @brief Function for getting the link parameters and throughput of a
+ * connection.
+ * 
+ * @param conn The connection.
+ * @param stats Pointer to store the statistics in.
+ */
+void link_get_stats(struct bt_conn *conn, link_stats_t *stats);
+
+#endif // LINK_H
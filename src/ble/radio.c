@@ -0,0 +1,268 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "radio.h"
+#include "scan.h"
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <sys/atomic.h>
+#include <sys/util.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME radio
+LOG_MODULE_REGISTER(radio);
+
+#define UNIT_US 625 // Scan parameters are in units of 0.625 ms
+
+#define GUARD_TIME        1250   // Time kept free around other events (in us)
+#define SCAN_WINDOW_MIN   0x0004 // 2.5 ms, the shortest scan window allowed
+#define SCAN_INTERVAL_MAX 0x4000 // 10.24 s, the longest scan interval allowed
+
+#define DEFERRED_WORK_MAX 8
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static radio_slot_t slots[RADIO_ACTIVITY_COUNT];
+static uint32_t gap = UINT32_MAX;
+
+// Estimates in thousandths of an event, estimated up to last_account
+static uint64_t est_collisions = 0;
+static uint64_t est_preemptions = 0;
+static atomic_t deferred = ATOMIC_INIT(0);
+static int64_t last_account = 0;
+
+// Set from the connection callbacks and read when work is submitted
+static atomic_t connection_busy = ATOMIC_INIT(0);
+
+K_MUTEX_DEFINE(_radio_mutex);
+K_MSGQ_DEFINE(_deferred_queue, sizeof(struct k_work *), DEFERRED_WORK_MAX, 4);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _place_handler(struct k_work *unused);
+K_WORK_DEFINE(_place_work, _place_handler);
+
+static void _account(void);
+
+static uint32_t _gap(void);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+void radio_update(radio_activity_t activity, bool active, uint32_t period,
+                  uint32_t duration)
+{
+    bool replace = false;
+
+    k_mutex_lock(&_radio_mutex, K_FOREVER);
+
+    // Count the time up to now with the old timeline
+    _account();
+
+    slots[activity].active = active;
+    slots[activity].period = period;
+    slots[activity].duration = duration;
+
+    if (activity != RADIO_SCAN && _gap() != gap)
+    {
+        gap = _gap();
+        replace = true;
+    }
+
+    k_mutex_unlock(&_radio_mutex);
+
+    LOG_DBG("Activity %d %s, period %u us, duration %u us", activity,
+            active ? "on" : "off", period, duration);
+
+    if (replace)
+    {
+        k_work_submit(&_place_work);
+    }
+}
+
+void radio_place_scan(uint16_t *interval, uint16_t *window)
+{
+    uint32_t fit;
+
+    k_mutex_lock(&_radio_mutex, K_FOREVER);
+    fit = gap / UNIT_US;
+    k_mutex_unlock(&_radio_mutex);
+
+    if (*window <= fit)
+    {
+        return;
+    }
+
+    fit = MAX(fit, SCAN_WINDOW_MIN);
+
+    // Keep the share of time spent scanning
+    *interval = MAX(fit, (uint32_t)*interval * fit / *window);
+    *interval = MIN(*interval, SCAN_INTERVAL_MAX);
+    *window = fit;
+}
+
+void radio_set_connection_busy(bool busy)
+{
+    struct k_work *work;
+
+    atomic_set(&connection_busy, busy);
+
+    if (busy)
+    {
+        return;
+    }
+
+    while (k_msgq_get(&_deferred_queue, &work, K_NO_WAIT) == 0)
+    {
+        k_work_submit(work);
+    }
+}
+
+void radio_submit_low_priority(struct k_work *work)
+{
+    // Submit the work at once if it can not be held back
+    if (!atomic_get(&connection_busy) ||
+        k_msgq_put(&_deferred_queue, &work, K_NO_WAIT) != 0)
+    {
+        k_work_submit(work);
+        return;
+    }
+
+    atomic_inc(&deferred);
+
+    // The connection may have become idle while the work was queued
+    if (!atomic_get(&connection_busy))
+    {
+        radio_set_connection_busy(false);
+    }
+}
+
+void radio_get_schedule(radio_schedule_t *schedule)
+{
+    uint32_t busy = 0;
+
+    k_mutex_lock(&_radio_mutex, K_FOREVER);
+
+    for (int i = 0; i < RADIO_ACTIVITY_COUNT; i++)
+    {
+        schedule->slots[i] = slots[i];
+
+        if (slots[i].active && slots[i].period > 0)
+        {
+            busy += (uint64_t)slots[i].duration * 1000 / slots[i].period;
+        }
+    }
+
+    schedule->busy = MIN(busy, 1000);
+    schedule->gap = gap;
+
+    k_mutex_unlock(&_radio_mutex);
+}
+
+void radio_get_estimates(radio_estimates_t *estimates)
+{
+    k_mutex_lock(&_radio_mutex, K_FOREVER);
+
+    _account();
+
+    estimates->est_collisions = est_collisions / 1000;
+    estimates->est_preemptions = est_preemptions / 1000;
+    estimates->deferred = atomic_get(&deferred);
+
+    k_mutex_unlock(&_radio_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Work handler placing the scan windows again after the gaps between
+ * the other events have changed.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _place_handler(struct k_work *unused) { scan_refresh(); }
+
+/**
+ * @brief Function for adding the events estimated to fall in scan windows
+ * since the last call to the estimates. An event of period T and length D
+ * overlaps a scan window of length W with a probability of (W + D) / T, as
+ * the activities are not aligned. Must be called with the mutex held.
+ */
+static void _account(void)
+{
+    const radio_slot_t *scan = &slots[RADIO_SCAN];
+    int64_t now = k_uptime_get();
+    uint64_t elapsed = (now - last_account) * 1000; // In us
+    uint64_t windows;
+
+    last_account = now;
+
+    if (!scan->active || scan->period == 0)
+    {
+        return;
+    }
+
+    // Scan windows in the elapsed time, in thousandths
+    windows = elapsed * 1000 / scan->period;
+
+    for (int i = 0; i < RADIO_SCAN; i++)
+    {
+        const radio_slot_t *slot = &slots[i];
+        uint64_t overlaps;
+
+        if (!slot->active || slot->period == 0)
+        {
+            continue;
+        }
+
+        overlaps = windows * (scan->duration + slot->duration) / slot->period;
+
+        if (i == RADIO_CONNECTION)
+        {
+            est_preemptions += overlaps;
+        }
+        else
+        {
+            est_collisions += overlaps;
+        }
+    }
+}
+
+/**
+ * @brief Function for finding the shortest gap between the events of an
+ * activity that scanning yields to. Must be called with the mutex held.
+ *
+ * @return uint32_t The gap (in us), UINT32_MAX if there are no such events.
+ */
+static uint32_t _gap(void)
+{
+    uint32_t shortest = UINT32_MAX;
+
+    for (int i = 0; i < RADIO_SCAN; i++)
+    {
+        const radio_slot_t *slot = &slots[i];
+
+        if (!slot->active ||
+            slot->period <= slot->duration + 2 * GUARD_TIME)
+        {
+            continue;
+        }
+
+        shortest =
+            MIN(shortest, slot->period - slot->duration - 2 * GUARD_TIME);
+    }
+
+    return shortest;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file
+ * @brief Radio coordinator module
+ *
+ * This is a module for sharing the radio between scanning, the two
+ * advertising streams and connections. The other modules tell the
+ * coordinator about their periodic radio activities, and the coordinator
+ * keeps a model of the radio timeline from them. The controller schedules
+ * the events itself, so the coordinator works through the parameters: scan
+ * windows are sized to fit in the gaps between advertising and connection
+ * events, and low priority work is held back while a connection is busy.
+ *
+ * The collision and preemption counters are estimated from the model, as the
+ * controller does not report them. The timeline and the counters are read
+ * through the WEN Status characteristic.
+ */
+
+#ifndef RADIO_H
+#define RADIO_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Radio time of an advertising event with legacy PDUs (in us). Three
+ * PDUs, the receive windows after them and the radio ramp up.
+ */
+#define RADIO_ADV_EVENT_TIME 1200
+
+/**
+ * @brief Radio time of a connection event with a few packets (in us).
+ */
+#define RADIO_CONN_EVENT_TIME 2500
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This enum contains the radio activities, from the highest priority to the
+lowest. */
+typedef enum
+{
+    RADIO_GAENS_ADV,
+    RADIO_WENS_ADV,
+    RADIO_CONNECTION,
+    RADIO_SCAN,
+    RADIO_ACTIVITY_COUNT
+} radio_activity_t;
+
+/* This struct describes a periodic radio activity. */
+typedef struct
+{
+    bool active;
+    uint32_t period;   // Time between the events (in us)
+    uint32_t duration; // Length of an event (in us)
+} radio_slot_t;
+
+/* This struct is a view of the radio timeline. */
+typedef struct
+{
+    radio_slot_t slots[RADIO_ACTIVITY_COUNT];
+    uint32_t busy; // Radio time in use (per mille)
+    uint32_t gap;  // Shortest gap between events that scanning yields to (us)
+} radio_schedule_t;
+
+/* This struct holds the radio counters. The collisions and preemptions are
+estimated from the timeline, not counted, see radio_get_estimates. */
+typedef struct
+{
+    uint32_t est_collisions;  // Advertising events estimated in a scan window
+    uint32_t est_preemptions; // Connection events estimated in a scan window
+    uint32_t deferred;        // Low priority work held back by a busy link
+} radio_estimates_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for telling the coordinator that a radio activity has
+ * changed. Scanning is placed again if the gaps it fits in have changed.
+ *
+ * @param activity The activity.
+ * @param active True if the activity is running.
+ * @param period Time between the events (in us).
+ * @param duration Length of an event (in us).
+ */
+void radio_update(radio_activity_t activity, bool active, uint32_t period,
+                  uint32_t duration);
+
+/**
+ * @brief Function for sizing scan windows to fit between the events of the
+ * other activities. A window that does not fit is shortened, and the interval
+ * is shortened with it, so the share of time spent scanning stays the same.
+ * The windows are not aligned to the other events, as the controller picks
+ * the phase of each activity, so a window still overlaps an event now and
+ * then.
+ *
+ * @param interval Scan interval in units of 0.625 ms, updated in place.
+ * @param window Scan window in units of 0.625 ms, updated in place.
+ */
+void radio_place_scan(uint16_t *interval, uint16_t *window);
+
+/**
+ * @brief Function for telling the coordinator if the connection is busy
+ * moving data. Low priority work held back is submitted once the connection
+ * is no longer busy.
+ *
+ * @param busy True if the connection is busy.
+ */
+void radio_set_connection_busy(bool busy);
+
+/**
+ * @brief Function for submitting low priority work, such as long flash
+ * operations, to the system work queue. The work is held back while the
+ * connection is busy.
+ *
+ * @param work The work.
+ */
+void radio_submit_low_priority(struct k_work *work);
+
+/**
+ * @brief Function for getting a view of the radio timeline.
+ *
+ * @param schedule Pointer to store the view in.
+ */
+void radio_get_schedule(radio_schedule_t *schedule);
+
+/**
+ * @brief Function for getting the radio counters. The collisions and
+ * preemptions are estimates: the controller does not report them, so they
+ * are the expected overlaps of unaligned scan windows with the events of the
+ * timeline. Only the deferred work is counted.
+ *
+ * @param estimates Pointer to store the counters in.
+ */
+void radio_get_estimates(radio_estimates_t *estimates);
+
+#endif // RADIO_H
@@ -5,6 +5,8 @@
 #include "scan.h"
 #include "../gaens/crypto.h"
 #include "../records/storage.h"
+#include "radio.h"
+#include "services/wens/wens.h"
 #include "uuid.h"
 #include <stddef.h>
 #include <unistd.h>
@@ -18,6 +20,7 @@
 #include <sys/util.h>
 
 #include <logging/log.h>
+#include <zephyr.h>
 #include <zephyr/types.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -33,6 +36,15 @@ LOG_MODULE_REGISTER(scan);
 
 static bool scan_active = false;
 
+static scan_profile_t current_profile = SCAN_PROFILE_NORMAL;
+
+// Statistics, counted up to last_account (in ms of uptime)
+static scan_stats_t stats;
+static int64_t scan_ms = 0;
+static int64_t connected_ms = 0;
+static int64_t lost_ms = 0;
+static int64_t last_account = 0;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -45,6 +57,19 @@ static struct bt_le_scan_param scan_param = {
     .window = 0x01E0,   // 300 milliseconds
 };
 
+/* The scan interval and window of each profile. While data is moved over a
+connection, short windows are placed between the frequent connection events
+instead of one long window, so scanning is never starved. */
+static const struct
+{
+    uint16_t interval;
+    uint16_t window;
+} profiles[] = {
+    [SCAN_PROFILE_NORMAL] = {.interval = 0x3E80, .window = 0x01E0},
+    [SCAN_PROFILE_CONNECTED] = {.interval = 0x3E80, .window = 0x01E0},
+    [SCAN_PROFILE_BULK] = {.interval = 0x0800, .window = 0x0050}, // 50/1280 ms
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -54,6 +79,10 @@ static void _scan_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t adv_type,
 
 static bool _data_cb(struct bt_data *data, void *rssi_buf);
 
+static void _account(void);
+
+static void _apply_profile(void);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Public functions
 ////////////////////////////////////////////////////////////////////////////////
@@ -74,6 +103,32 @@ void scan_set_parameters(struct bt_le_scan_param parameters)
     LOG_INF("Scan parameters changed\n");
 }
 
+void scan_set_profile(scan_profile_t profile)
+{
+    if (profile == current_profile)
+    {
+        return;
+    }
+
+    // Count the time up to now with the old profile
+    _account();
+    current_profile = profile;
+
+    _apply_profile();
+}
+
+void scan_refresh(void) { _apply_profile(); }
+
+void scan_get_stats(scan_stats_t *s)
+{
+    _account();
+
+    *s = stats;
+    s->scan_time = scan_ms;
+    s->connected_time = connected_ms / MSEC_PER_SEC;
+    s->lost_scan_time = lost_ms;
+}
+
 int scan_start()
 {
     int err;
@@ -85,8 +140,12 @@ int scan_start()
         return -1;
     }
 
+    _account();
     scan_active = true;
 
+    radio_update(RADIO_SCAN, true, scan_param.interval * 625,
+                 scan_param.window * 625);
+
     LOG_INF("Scanning started\n");
     return 0;
 }
@@ -102,8 +161,11 @@ int scan_stop()
         return -1;
     }
 
+    _account();
     scan_active = false;
 
+    radio_update(RADIO_SCAN, false, 0, 0);
+
     LOG_INF("Scanning stopped\n");
     return 0;
 }
@@ -144,6 +206,7 @@ static bool _data_cb(struct bt_data *data, void *rssi_buf)
     struct bt_uuid *uuid;
     int8_t *rssi = rssi_buf;
     uint32_t en_interval_number;
+    int err;
 
     switch (data->type)
     {
@@ -183,7 +246,17 @@ static bool _data_cb(struct bt_data *data, void *rssi_buf)
 
         crypto_en_interval_number(&en_interval_number);
 
-        storage_write_entry(en_interval_number, &data->data[2], *rssi);
+        err = storage_write_entry(en_interval_number, &data->data[2], *rssi);
+        if (err == 0)
+        {
+            wens_ens_log_added();
+        }
+
+        stats.detections++;
+        if (current_profile != SCAN_PROFILE_NORMAL)
+        {
+            stats.detections_connected++;
+        }
 
         return false;
     default:
@@ -191,4 +264,58 @@ static bool _data_cb(struct bt_data *data, void *rssi_buf)
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Function for applying the scan interval and window of the current
+ * profile, with the windows placed between the other radio events.
+ */
+static void _apply_profile(void)
+{
+    struct bt_le_scan_param parameters = scan_param;
+
+    parameters.interval = profiles[current_profile].interval;
+    parameters.window = profiles[current_profile].window;
+
+    radio_place_scan(&parameters.interval, &parameters.window);
+
+    if (parameters.interval == scan_param.interval &&
+        parameters.window == scan_param.window)
+    {
+        return;
+    }
+
+    scan_set_parameters(parameters);
+}
+
+/**
+ * @brief Function for adding the time since the last call to the statistics.
+ * The scan time is estimated from the scan window and interval.
+ */
+static void _account(void)
+{
+    unsigned int key = irq_lock();
+    int64_t now = k_uptime_get();
+    int64_t elapsed = now - last_account;
+    int64_t scanned = 0;
+    int64_t normal;
+
+    last_account = now;
+
+    if (scan_active)
+    {
+        scanned = elapsed * scan_param.window / scan_param.interval;
+        scan_ms += scanned;
+    }
+
+    if (current_profile != SCAN_PROFILE_NORMAL)
+    {
+        normal = elapsed * profiles[SCAN_PROFILE_NORMAL].window /
+                 profiles[SCAN_PROFILE_NORMAL].interval;
+
+        connected_ms += elapsed;
+        lost_ms += normal - scanned;
+    }
+
+    irq_unlock(key);
+}
@@ -16,6 +16,31 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This enum contains the scan profiles. The profiles share the radio with a
+connection in different ways, but all of them leave time to scan. */
+typedef enum
+{
+    SCAN_PROFILE_NORMAL,    // No phone is connected
+    SCAN_PROFILE_CONNECTED, // A phone is connected, but the link is idle
+    SCAN_PROFILE_BULK       // A phone is connected and data is being moved
+} scan_profile_t;
+
+/* This struct holds the scan statistics. The lost scan time is the scan time
+the normal profile would have given while a phone was connected, minus the
+scan time given by the profiles in use. */
+typedef struct
+{
+    uint32_t detections;           // GAENS advertisements logged
+    uint32_t detections_connected; // Of those, logged while connected
+    uint32_t scan_time;            // Time scanned (in ms)
+    uint32_t connected_time;       // Time a phone was connected (in seconds)
+    int32_t lost_scan_time;        // Scan time lost to connections (in ms)
+} scan_stats_t;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,6 +52,26 @@
  */
 void scan_set_parameters(struct bt_le_scan_param parameters);
 
+/**
+ * @brief Function for changing the scan profile
+ * 
+ * @param profile The scan profile
+ */
+void scan_set_profile(scan_profile_t profile);
+
+/**
+ * @brief Function for placing the scan windows of the current profile again,
+ * after the other radio activities have changed
+ */
+void scan_refresh(void);
+
+/**
+ * @brief Function for getting the scan statistics
+ * 
+ * @param stats Pointer to store the statistics in
+ */
+void scan_get_stats(scan_stats_t *stats);
+
 /**
  * @brief Function for starting to scan
  * 
@@ -0,0 +1,267 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "bulk.h"
+#include "../../connection.h"
+#include "../../../records/storage.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <bluetooth/l2cap.h>
+#include <logging/log.h>
+#include <net/buf.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME bulk
+LOG_MODULE_REGISTER(bulk);
+
+#define SDU_SIZE (BULK_SDU_RECORDS * SIZE_OF_ONE_ENTRY)
+
+#define RX_MTU 23 // Nothing is received, so the smallest MTU allowed
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the bulk channel of a connection. */
+typedef struct
+{
+    struct bt_l2cap_le_chan chan;
+    volatile bool open;
+    struct k_sem credits;  // SDUs that can be handed to the stack
+    bulk_sent_func_t func; // Callback for the SDUs in flight
+    void *user_data;
+} channel_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+/* Channels, indexed by bt_conn_index() */
+static channel_t channels[CONFIG_BT_MAX_CONN];
+
+NET_BUF_POOL_FIXED_DEFINE(_sdu_pool, CONFIG_BT_MAX_CONN * BULK_SDUS_IN_FLIGHT,
+                          BT_L2CAP_SDU_CHAN_SEND_RESERVE + SDU_SIZE, NULL);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static int _accept(struct bt_conn *conn, struct bt_l2cap_chan **chan);
+
+static void _connected(struct bt_l2cap_chan *chan);
+
+static void _disconnected(struct bt_l2cap_chan *chan);
+
+static int _recv(struct bt_l2cap_chan *chan, struct net_buf *buf);
+
+static void _sent(struct bt_l2cap_chan *chan);
+
+static const struct bt_l2cap_chan_ops channel_ops = {
+    .connected = _connected,
+    .disconnected = _disconnected,
+    .recv = _recv,
+    .sent = _sent,
+};
+
+// The channel carries the ENS log, so it is only opened on an encrypted link
+static struct bt_l2cap_server server = {
+    .psm = BULK_PSM,
+    .sec_level = BT_SECURITY_L2,
+    .accept = _accept,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int bulk_init(void)
+{
+    int err = bt_l2cap_server_register(&server);
+
+    if (err)
+    {
+        LOG_ERR("Failed to register the bulk channel (err %d)", err);
+    }
+
+    return err;
+}
+
+bool bulk_is_open(struct bt_conn *conn)
+{
+    return channels[bt_conn_index(conn)].open;
+}
+
+bool bulk_is_idle(struct bt_conn *conn)
+{
+    channel_t *channel = &channels[bt_conn_index(conn)];
+
+    return !channel->open ||
+           k_sem_count_get(&channel->credits) == BULK_SDUS_IN_FLIGHT;
+}
+
+int bulk_send(struct bt_conn *conn, uint32_t index, uint32_t end,
+              bulk_sent_func_t func, void *user_data)
+{
+    channel_t *channel = &channels[bt_conn_index(conn)];
+    struct net_buf *buf;
+    uint8_t *data;
+    uint32_t count;
+    int err;
+
+    if (!channel->open)
+    {
+        return -ENOTCONN;
+    }
+
+    // An SDU holds whole records, as many as the peer takes
+    count = MIN(end - index, MIN(BULK_SDU_RECORDS,
+                                 channel->chan.tx.mtu / SIZE_OF_ONE_ENTRY));
+    if (count == 0)
+    {
+        return -EINVAL;
+    }
+
+    if (k_sem_take(&channel->credits, K_NO_WAIT) != 0)
+    {
+        return -EBUSY;
+    }
+
+    // There is a buffer for every credit
+    buf = net_buf_alloc(&_sdu_pool, K_NO_WAIT);
+    if (!buf)
+    {
+        k_sem_give(&channel->credits);
+        return -ENOMEM;
+    }
+
+    net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+    data = net_buf_add(buf, count * SIZE_OF_ONE_ENTRY);
+
+    err = storage_read_entries(index, data, count);
+    if (err < 0)
+    {
+        LOG_ERR("Failed to read ENS log records");
+        net_buf_unref(buf);
+        k_sem_give(&channel->credits);
+        return -EIO;
+    }
+
+    channel->func = func;
+    channel->user_data = user_data;
+
+    connection_activity(conn, buf->len);
+
+    err = bt_l2cap_chan_send(&channel->chan.chan, buf);
+    if (err < 0)
+    {
+        net_buf_unref(buf);
+        k_sem_give(&channel->credits);
+        return err;
+    }
+
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Callback for a peer opening the bulk channel. Each connection can
+ * have one channel open.
+ *
+ * @param conn The connection.
+ * @param chan Pointer to store the channel in.
+ *
+ * @return int 0 on success, -ENOMEM if the connection has a channel open.
+ */
+static int _accept(struct bt_conn *conn, struct bt_l2cap_chan **chan)
+{
+    channel_t *channel = &channels[bt_conn_index(conn)];
+
+    if (channel->open)
+    {
+        return -ENOMEM;
+    }
+
+    memset(&channel->chan, 0, sizeof(channel->chan));
+    channel->chan.chan.ops = &channel_ops;
+    channel->chan.rx.mtu = RX_MTU;
+
+    *chan = &channel->chan.chan;
+
+    return 0;
+}
+
+/**
+ * @brief Callback for when the bulk channel is open. SDUs in flight when a
+ * previous channel was closed are never sent, so the credits start over.
+ *
+ * @param chan The channel.
+ */
+static void _connected(struct bt_l2cap_chan *chan)
+{
+    channel_t *channel = CONTAINER_OF(chan, channel_t, chan.chan);
+
+    k_sem_init(&channel->credits, BULK_SDUS_IN_FLIGHT, BULK_SDUS_IN_FLIGHT);
+    channel->func = NULL;
+    channel->open = true;
+
+    LOG_INF("Bulk channel open, MTU %u", channel->chan.tx.mtu);
+}
+
+/**
+ * @brief Callback for when the bulk channel is closed.
+ *
+ * @param chan The channel.
+ */
+static void _disconnected(struct bt_l2cap_chan *chan)
+{
+    channel_t *channel = CONTAINER_OF(chan, channel_t, chan.chan);
+
+    channel->open = false;
+
+    LOG_INF("Bulk channel closed");
+}
+
+/**
+ * @brief Callback for data from the peer. Nothing is expected on the bulk
+ * channel, so it is dropped.
+ *
+ * @param chan The channel.
+ * @param buf The data.
+ *
+ * @return int 0, as the data is consumed.
+ */
+static int _recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+    LOG_WRN("Dropped %u bytes on the bulk channel", buf->len);
+
+    return 0;
+}
+
+/**
+ * @brief Callback for when an SDU has been sent. Its credit is given back,
+ * and the sender is told.
+ *
+ * @param chan The channel.
+ */
+static void _sent(struct bt_l2cap_chan *chan)
+{
+    channel_t *channel = CONTAINER_OF(chan, channel_t, chan.chan);
+
+    k_sem_give(&channel->credits);
+
+    if (channel->func)
+    {
+        channel->func(chan->conn, channel->user_data);
+    }
+}
@@ -0,0 +1,102 @@
+/**
+ * @file
+ * @brief Bulk channel module
+ *
+ * This is a module for the L2CAP connection-oriented channel a phone or
+ * gateway can open to export the ENS log in bulk. The records are sent as
+ * raw ENS log entries, as many whole records in an SDU as the peer takes,
+ * without the per-notification ATT overhead. The channel uses LE credit
+ * based flow control, so the peer paces the transfer.
+ *
+ * The peer gets the PSM of the channel from the WEN Status characteristic,
+ * opens the channel and asks for the records on the RACP, see racp.h.
+ */
+
+#ifndef BULK_H
+#define BULK_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief LE PSM of the bulk channel, from the dynamic range.
+ */
+#define BULK_PSM 0x0080
+
+/**
+ * @brief Most records in an SDU.
+ */
+#define BULK_SDU_RECORDS 30
+
+/**
+ * @brief SDUs handed to the stack at a time, on each connection.
+ */
+#define BULK_SDUS_IN_FLIGHT 3
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* Callback for when an SDU has been sent. */
+typedef void (*bulk_sent_func_t)(struct bt_conn *conn, void *user_data);
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for registering the bulk channel, so peers can open it.
+ * Must be called after Bluetooth is enabled.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int bulk_init(void);
+
+/**
+ * @brief Function for checking if a peer has the bulk channel open.
+ *
+ * @param conn The connection to the peer.
+ *
+ * @return bool True if the channel is open.
+ */
+bool bulk_is_open(struct bt_conn *conn);
+
+/**
+ * @brief Function for checking if every SDU handed to the stack on a
+ * connection has been sent. A channel that is closed has nothing in flight.
+ *
+ * @param conn The connection to the peer.
+ *
+ * @return bool True if nothing is in flight.
+ */
+bool bulk_is_idle(struct bt_conn *conn);
+
+/**
+ * @brief Function for sending the next records of a range in one SDU. The
+ * records are read from the storage straight in to the SDU.
+ *
+ * @param conn The connection to the peer.
+ * @param index Index of the first record to send.
+ * @param end Index of the record after the last in the range.
+ * @param func Callback for when the SDU has been sent.
+ * @param user_data Data for @c func.
+ *
+ * @return int The number of records sent, -EBUSY if every SDU is in flight
+ * and the caller should try again once one is sent, -ENOTCONN if the channel
+ * is not open, or another negative value on error.
+ */
+int bulk_send(struct bt_conn *conn, uint32_t index, uint32_t end,
+              bulk_sent_func_t func, void *user_data);
+
+#endif // BULK_H
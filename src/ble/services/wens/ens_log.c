@@ -0,0 +1,261 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ens_log.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <sys/util.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME ens_log
+LOG_MODULE_REGISTER(ens_log);
+
+#define ATT_NOTIFY_HEADER_LENGTH 3 // Opcode and handle
+
+#define READER_STACK_SIZE 1024
+#define READER_PRIORITY   K_PRIO_PREEMPT(6) // Ahead of the RACP thread
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+K_MSGQ_DEFINE(_read_queue, sizeof(ens_log_encoder_t *), CONFIG_BT_MAX_CONN, 4);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _reader_thread(void *p1, void *p2, void *p3);
+K_THREAD_DEFINE(ens_log_reader, READER_STACK_SIZE, _reader_thread, NULL, NULL,
+                NULL, READER_PRIORITY, 0, 0);
+
+static void _read_ahead(ens_log_encoder_t *enc);
+
+static int _next_chunk(ens_log_encoder_t *enc);
+
+static int _encode_segment(ens_log_encoder_t *enc);
+
+static uint8_t *_record(ens_log_encoder_t *enc, uint16_t pos);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+void ens_log_encoder_init(ens_log_encoder_t *enc)
+{
+    memset(enc, 0, sizeof(*enc));
+    k_sem_init(&enc->read, 0, 1);
+}
+
+void ens_log_encoder_start(ens_log_encoder_t *enc, uint16_t mtu,
+                           uint32_t index, uint32_t end)
+{
+    ens_log_encoder_stop(enc);
+
+    enc->offset = 0;
+    ens_log_encoder_set_mtu(enc, mtu);
+
+    enc->pos = 0;
+    enc->filled = 0;
+    enc->next = index;
+    enc->end = end;
+
+    _read_ahead(enc);
+}
+
+void ens_log_encoder_set_mtu(ens_log_encoder_t *enc, uint16_t mtu)
+{
+    if (enc->offset > 0)
+    {
+        return;
+    }
+
+    enc->payload = MIN(mtu - ATT_NOTIFY_HEADER_LENGTH,
+                       ENS_LOG_MAX_NOTIFICATION);
+}
+
+void ens_log_encoder_stop(ens_log_encoder_t *enc)
+{
+    if (enc->reading)
+    {
+        k_sem_take(&enc->read, K_FOREVER);
+        enc->reading = false;
+    }
+
+    enc->next = enc->end;
+}
+
+int ens_log_encode(ens_log_encoder_t *enc)
+{
+    size_t count;
+    int err;
+
+    if (enc->payload <= ENS_LOG_HEADER_LENGTH)
+    {
+        return -EINVAL;
+    }
+
+    if (enc->pos == enc->filled)
+    {
+        err = _next_chunk(enc);
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    count = (enc->payload - ENS_LOG_HEADER_LENGTH) / SIZE_OF_ONE_ENTRY;
+
+    // The MTU does not fit a whole record
+    if (count == 0 || enc->offset > 0)
+    {
+        return _encode_segment(enc);
+    }
+
+    count = MIN(count, enc->filled - enc->pos);
+
+    // The records are sent in place, after the byte before the first
+    enc->buf = _record(enc, enc->pos) - ENS_LOG_HEADER_LENGTH;
+    enc->buf[0] = ENS_LOG_SEGMENTATION_COMPLETE;
+    enc->len = ENS_LOG_HEADER_LENGTH + count * SIZE_OF_ONE_ENTRY;
+    enc->pos += count;
+
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief The reader thread, reading chunks of records for the encoders.
+ *
+ * @param p1 Not in use.
+ * @param p2 Not in use.
+ * @param p3 Not in use.
+ */
+static void _reader_thread(void *p1, void *p2, void *p3)
+{
+    ens_log_encoder_t *enc;
+
+    while (1)
+    {
+        k_msgq_get(&_read_queue, &enc, K_FOREVER);
+
+        enc->err = storage_read_entries(
+            enc->next - enc->count,
+            &enc->chunks[!enc->active][ENS_LOG_HEADER_LENGTH], enc->count);
+
+        k_sem_give(&enc->read);
+    }
+}
+
+/**
+ * @brief Function for starting to read the next chunk of the range in to the
+ * chunk that is not being encoded. Nothing is read if the range is done.
+ *
+ * @param enc The encoder.
+ */
+static void _read_ahead(ens_log_encoder_t *enc)
+{
+    if (enc->next >= enc->end)
+    {
+        return;
+    }
+
+    enc->count = MIN(ENS_LOG_CHUNK_RECORDS, enc->end - enc->next);
+    enc->next += enc->count;
+    enc->reading = true;
+
+    // The queue has room for every encoder, each reads one chunk at a time
+    k_msgq_put(&_read_queue, &enc, K_FOREVER);
+}
+
+/**
+ * @brief Function for moving on to the chunk read in the background, and
+ * starting to read the one after it.
+ *
+ * @param enc The encoder.
+ *
+ * @return int 0 on success, -ENODATA if the range is done or -EIO if the
+ * chunk could not be read.
+ */
+static int _next_chunk(ens_log_encoder_t *enc)
+{
+    if (!enc->reading)
+    {
+        return -ENODATA;
+    }
+
+    k_sem_take(&enc->read, K_FOREVER);
+    enc->reading = false;
+
+    if (enc->err < 0)
+    {
+        LOG_ERR("Failed to read ENS log records");
+        enc->next = enc->end;
+        return -EIO;
+    }
+
+    enc->active = !enc->active;
+    enc->pos = 0;
+    enc->filled = enc->count;
+
+    _read_ahead(enc);
+
+    return 0;
+}
+
+/**
+ * @brief Function for encoding the next segment of a record that does not fit
+ * in one notification.
+ *
+ * @param enc The encoder.
+ *
+ * @return int 1 if this is the last segment, 0 if more segments follow.
+ */
+static int _encode_segment(ens_log_encoder_t *enc)
+{
+    uint16_t room = enc->payload - ENS_LOG_HEADER_LENGTH;
+    uint16_t len = MIN(room, SIZE_OF_ONE_ENTRY - enc->offset);
+
+    // The segment is sent in place, after the last byte sent
+    enc->buf = _record(enc, enc->pos) + enc->offset - ENS_LOG_HEADER_LENGTH;
+    enc->buf[0] = enc->offset == 0 ? ENS_LOG_SEGMENTATION_FIRST
+                                   : ENS_LOG_SEGMENTATION_CONTINUATION;
+
+    enc->len = ENS_LOG_HEADER_LENGTH + len;
+    enc->offset += len;
+
+    if (enc->offset < SIZE_OF_ONE_ENTRY)
+    {
+        return 0;
+    }
+
+    enc->buf[0] = ENS_LOG_SEGMENTATION_LAST;
+    enc->offset = 0;
+    enc->pos++;
+
+    return 1;
+}
+
+/**
+ * @brief Function for getting a record in the active chunk.
+ *
+ * @param enc The encoder.
+ * @param pos Position of the record in the chunk.
+ *
+ * @return uint8_t* The record.
+ */
+static uint8_t *_record(ens_log_encoder_t *enc, uint16_t pos)
+{
+    return &enc->chunks[enc->active][ENS_LOG_HEADER_LENGTH +
+                                     pos * SIZE_OF_ONE_ENTRY];
+}
@@ -0,0 +1,150 @@
+/**
+ * @file
+ * @brief ENS log encoder
+ *
+ * This is an encoder for the notifications on the ENS Log characteristic.
+ * Each notification starts with a byte holding the segmentation field, and
+ * carries as many whole ENS log records as the ATT MTU allows. When the MTU
+ * is too small for a single record, the record is split over several
+ * notifications marked first, continuation and last.
+ *
+ * The records are read from the external memory in chunks of
+ * @c ENS_LOG_CHUNK_RECORDS by a reader thread. Each encoder has two chunk
+ * buffers, so the next chunk is read while the notifications of the current
+ * one are handed to the Bluetooth stack, and the radio is not left waiting on
+ * the SPI bus.
+ *
+ * The records are read one byte into the chunk buffer, and each notification
+ * is handed to the stack from the chunk in place. Its segmentation field is
+ * written over the byte before its first record byte, which is either the
+ * spare byte at the start of the chunk or a byte that has been sent already.
+ * So records are not copied between the external memory and the stack.
+ */
+
+#ifndef ENS_LOG_H
+#define ENS_LOG_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "../../../records/storage.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Largest notification, the ATT payload with the largest MTU (see
+ * CONFIG_BT_L2CAP_TX_MTU).
+ */
+#define ENS_LOG_MAX_NOTIFICATION 244
+
+#define ENS_LOG_HEADER_LENGTH 1
+
+/**
+ * @brief Records read from the external memory at a time. Two notifications
+ * with the largest MTU.
+ */
+#define ENS_LOG_CHUNK_RECORDS 14
+
+#define ENS_LOG_CHUNK_SIZE \
+    (ENS_LOG_HEADER_LENGTH + ENS_LOG_CHUNK_RECORDS * SIZE_OF_ONE_ENTRY)
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This enum contains the different values the segmentation field in the
+ENS Log characteristic can take. This is defined in Table 4.7 in the WENS
+documentation. */
+typedef enum
+{
+    ENS_LOG_SEGMENTATION_COMPLETE,
+    ENS_LOG_SEGMENTATION_FIRST,
+    ENS_LOG_SEGMENTATION_CONTINUATION,
+    ENS_LOG_SEGMENTATION_LAST
+} ens_log_segmentation_t;
+
+/* This struct holds the state of an encoder. */
+typedef struct
+{
+    uint16_t payload; // Largest notification on the connection (in bytes)
+    uint8_t *buf;     // The notification, in the active chunk
+    uint16_t len;     // Length of the notification
+    uint16_t offset;  // Bytes of the record sent, 0 if not segmenting
+
+    uint8_t chunks[2][ENS_LOG_CHUNK_SIZE]; // Spare byte and chunk of records
+    uint8_t active;  // The chunk being encoded, the other is being read
+    uint16_t pos;    // Next record in the active chunk
+    uint16_t filled; // Records in the active chunk
+    uint32_t next;   // Index of the next record to read
+    uint32_t end;    // Index of the record after the last to read
+
+    bool reading;      // The other chunk is being read
+    uint16_t count;    // Records being read
+    int err;           // Result of the read
+    struct k_sem read; // Given when the read is done
+} ens_log_encoder_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for initializing an encoder. Must be called once before the
+ * encoder is used.
+ *
+ * @param enc The encoder.
+ */
+void ens_log_encoder_init(ens_log_encoder_t *enc);
+
+/**
+ * @brief Function for starting to encode a range of records. The first chunk
+ * is read in the background.
+ *
+ * @param enc The encoder.
+ * @param mtu The ATT MTU of the connection.
+ * @param index Index of the first record to send.
+ * @param end Index of the record after the last to send.
+ */
+void ens_log_encoder_start(ens_log_encoder_t *enc, uint16_t mtu,
+                           uint32_t index, uint32_t end);
+
+/**
+ * @brief Function for updating the ATT MTU of an encoder. The MTU is used
+ * from the next record, so a record being segmented is finished first.
+ *
+ * @param enc The encoder.
+ * @param mtu The ATT MTU of the connection.
+ */
+void ens_log_encoder_set_mtu(ens_log_encoder_t *enc, uint16_t mtu);
+
+/**
+ * @brief Function for stopping an encoder, waiting for a read in the
+ * background to finish. Must be called before a range is given up.
+ *
+ * @param enc The encoder.
+ */
+void ens_log_encoder_stop(ens_log_encoder_t *enc);
+
+/**
+ * @brief Function for encoding the next notification. The notification is
+ * left in @c enc->buf and @c enc->len, and points into the chunk, so it must
+ * be handed to the stack before the next call. Waits for the chunk holding
+ * the next record if it is still being read.
+ *
+ * @param enc The encoder.
+ *
+ * @return int The number of records the notification completes, which is 0
+ * for the first and continuation segments of a record, -ENODATA once the
+ * range is sent, or another negative value on error.
+ */
+int ens_log_encode(ens_log_encoder_t *enc);
+
+#endif // ENS_LOG_H
@@ -0,0 +1,410 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "indication.h"
+#include "../../connection.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <sys/slist.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME indication
+LOG_MODULE_REGISTER(indication);
+
+#define RETRY_DELAY 10  // Time to wait for a free buffer (in ms)
+#define RETRY_MAX   100 // Retries before an indication is dropped
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds an indication that is queued or in flight. */
+typedef struct
+{
+    sys_snode_t node;
+    struct bt_gatt_indicate_params params;
+    struct bt_conn *conn;
+    uint8_t data[INDICATION_MAX_LENGTH];
+    int64_t sent_at; // When the indication was handed to the stack
+} indication_t;
+
+/* This struct holds the arguments of an indication to all peers. */
+typedef struct
+{
+    const struct bt_gatt_attr *attr;
+    const void *data;
+    uint16_t len;
+    int err; // The first error
+} broadcast_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+K_MEM_SLAB_DEFINE(_indication_slab, sizeof(indication_t), INDICATION_POOL_SIZE,
+                  4);
+
+/* Queues, indexed by bt_conn_index(). The head is in flight if busy is set. */
+static sys_slist_t queues[CONFIG_BT_MAX_CONN];
+static bool busy[CONFIG_BT_MAX_CONN];
+
+/* The head of a queue waits for the retry work if retrying is set. */
+static bool retrying[CONFIG_BT_MAX_CONN];
+static uint8_t retries[CONFIG_BT_MAX_CONN];
+static struct k_delayed_work _retry_work;
+
+static indication_stats_t stats;
+static uint64_t total_latency = 0;
+
+K_MUTEX_DEFINE(_indication_mutex);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static int _queue(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                  const void *data, uint16_t len);
+
+static void _broadcast_cb(struct bt_conn *conn, void *user_data);
+
+static void _send_next(uint8_t index);
+
+static void _retry_handler(struct k_work *unused);
+
+static void _free(indication_t *ind);
+
+static void _indicate_cb(struct bt_conn *conn,
+                         struct bt_gatt_indicate_params *params, uint8_t err);
+
+static void _indicate_destroy_cb(struct bt_gatt_indicate_params *params);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+void indication_init(void)
+{
+    k_delayed_work_init(&_retry_work, _retry_handler);
+}
+
+int indication_send(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                    const void *data, uint16_t len)
+{
+    broadcast_t broadcast = {.attr = attr, .data = data, .len = len, .err = 0};
+
+    if (len > INDICATION_MAX_LENGTH)
+    {
+        return -EINVAL;
+    }
+
+    if (conn)
+    {
+        return _queue(conn, attr, data, len);
+    }
+
+    connection_foreach(_broadcast_cb, &broadcast);
+
+    return broadcast.err;
+}
+
+void indication_disconnected(struct bt_conn *conn)
+{
+    uint8_t index = bt_conn_index(conn);
+    sys_slist_t dropped;
+    sys_snode_t *node;
+
+    sys_slist_init(&dropped);
+
+    k_mutex_lock(&_indication_mutex, K_FOREVER);
+
+    // The indication in flight is given back by the stack, one waiting for a
+    // retry is dropped with the rest
+    node = busy[index] && !retrying[index] ? sys_slist_get(&queues[index])
+                                           : NULL;
+
+    if (retrying[index])
+    {
+        busy[index] = false;
+        retrying[index] = false;
+    }
+
+    retries[index] = 0;
+
+    while (!sys_slist_is_empty(&queues[index]))
+    {
+        sys_slist_append(&dropped, sys_slist_get(&queues[index]));
+        stats.failed++;
+    }
+
+    if (node)
+    {
+        sys_slist_append(&queues[index], node);
+    }
+
+    k_mutex_unlock(&_indication_mutex);
+
+    while ((node = sys_slist_get(&dropped)) != NULL)
+    {
+        _free(CONTAINER_OF(node, indication_t, node));
+    }
+}
+
+void indication_get_stats(indication_stats_t *out)
+{
+    k_mutex_lock(&_indication_mutex, K_FOREVER);
+
+    *out = stats;
+    out->mean_latency =
+        stats.confirmed > 0 ? total_latency / stats.confirmed : 0;
+
+    k_mutex_unlock(&_indication_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for queueing an indication to a connection, and sending it
+ * at once if nothing is in flight.
+ *
+ * @param conn The connection.
+ * @param attr The characteristic value attribute.
+ * @param data The value to indicate.
+ * @param len Length of the value.
+ *
+ * @return int 0 on success, -ENOMEM if the pool is used up.
+ */
+static int _queue(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                  const void *data, uint16_t len)
+{
+    uint8_t index = bt_conn_index(conn);
+    indication_t *ind;
+    bool idle;
+
+    if (k_mem_slab_alloc(&_indication_slab, (void **)&ind, K_NO_WAIT) != 0)
+    {
+        return -ENOMEM;
+    }
+
+    memcpy(ind->data, data, len);
+
+    memset(&ind->params, 0, sizeof(ind->params));
+    ind->params.attr = attr;
+    ind->params.func = _indicate_cb;
+    ind->params.destroy = _indicate_destroy_cb;
+    ind->params.data = ind->data;
+    ind->params.len = len;
+    ind->conn = bt_conn_ref(conn);
+
+    k_mutex_lock(&_indication_mutex, K_FOREVER);
+
+    sys_slist_append(&queues[index], &ind->node);
+
+    stats.depth++;
+    stats.max_depth = MAX(stats.max_depth, stats.depth);
+
+    idle = !busy[index];
+    busy[index] = true;
+
+    k_mutex_unlock(&_indication_mutex);
+
+    if (idle)
+    {
+        _send_next(index);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Callback queueing an indication to a connected peer if it has
+ * subscribed to the characteristic.
+ *
+ * @param conn The connection.
+ * @param user_data The indication, see @c broadcast_t.
+ */
+static void _broadcast_cb(struct bt_conn *conn, void *user_data)
+{
+    broadcast_t *broadcast = user_data;
+    int err;
+
+    if (!bt_gatt_is_subscribed(conn, broadcast->attr, BT_GATT_CCC_INDICATE))
+    {
+        return;
+    }
+
+    err = _queue(conn, broadcast->attr, broadcast->data, broadcast->len);
+    if (err && broadcast->err == 0)
+    {
+        broadcast->err = err;
+    }
+}
+
+/**
+ * @brief Function for sending the indication at the head of a queue. An
+ * indication the stack has no buffer for is kept at the head, and sent again
+ * from the retry work. Other indications the stack does not accept are
+ * dropped, and the next is tried. Must only be called by the owner of the
+ * busy flag of the queue.
+ *
+ * @param index The index of the connection.
+ */
+static void _send_next(uint8_t index)
+{
+    while (1)
+    {
+        sys_snode_t *node;
+        indication_t *ind;
+        int err;
+
+        k_mutex_lock(&_indication_mutex, K_FOREVER);
+
+        node = sys_slist_peek_head(&queues[index]);
+        if (!node)
+        {
+            busy[index] = false;
+            k_mutex_unlock(&_indication_mutex);
+            return;
+        }
+
+        k_mutex_unlock(&_indication_mutex);
+
+        ind = CONTAINER_OF(node, indication_t, node);
+        ind->sent_at = k_uptime_get();
+
+        err = bt_gatt_indicate(ind->conn, &ind->params);
+        if (err == 0)
+        {
+            retries[index] = 0;
+            return;
+        }
+
+        k_mutex_lock(&_indication_mutex, K_FOREVER);
+
+        if (err == -ENOMEM && retries[index] < RETRY_MAX)
+        {
+            // Keep the indication until the stack frees a buffer
+            retries[index]++;
+            retrying[index] = true;
+            k_mutex_unlock(&_indication_mutex);
+
+            k_delayed_work_submit(&_retry_work, K_MSEC(RETRY_DELAY));
+            return;
+        }
+
+        sys_slist_find_and_remove(&queues[index], node);
+        retries[index] = 0;
+        stats.failed++;
+
+        k_mutex_unlock(&_indication_mutex);
+
+        LOG_WRN("Failed to indicate (err %d)", err);
+
+        _free(ind);
+    }
+}
+
+/**
+ * @brief Work handler sending the indications kept at the head of their
+ * queues again.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _retry_handler(struct k_work *unused)
+{
+    for (uint8_t i = 0; i < CONFIG_BT_MAX_CONN; i++)
+    {
+        bool retry;
+
+        k_mutex_lock(&_indication_mutex, K_FOREVER);
+        retry = retrying[i];
+        retrying[i] = false;
+        k_mutex_unlock(&_indication_mutex);
+
+        // The busy flag was kept for the retry
+        if (retry)
+        {
+            _send_next(i);
+        }
+    }
+}
+
+/**
+ * @brief Function for giving an indication back to the pool.
+ *
+ * @param ind The indication, taken out of its queue.
+ */
+static void _free(indication_t *ind)
+{
+    k_mutex_lock(&_indication_mutex, K_FOREVER);
+    stats.depth--;
+    k_mutex_unlock(&_indication_mutex);
+
+    bt_conn_unref(ind->conn);
+    k_mem_slab_free(&_indication_slab, (void **)&ind);
+}
+
+/**
+ * @brief Callback for the confirmation of an indication, counting its
+ * round-trip time.
+ *
+ * @param conn Connection object.
+ * @param params The indication.
+ * @param err 0 if the indication was confirmed, an ATT error otherwise.
+ */
+static void _indicate_cb(struct bt_conn *conn,
+                         struct bt_gatt_indicate_params *params, uint8_t err)
+{
+    indication_t *ind = CONTAINER_OF(params, indication_t, params);
+    uint32_t latency = k_uptime_get() - ind->sent_at;
+
+    k_mutex_lock(&_indication_mutex, K_FOREVER);
+
+    if (err)
+    {
+        stats.failed++;
+    }
+    else
+    {
+        stats.confirmed++;
+        stats.last_latency = latency;
+        stats.max_latency = MAX(stats.max_latency, latency);
+        total_latency += latency;
+    }
+
+    k_mutex_unlock(&_indication_mutex);
+
+    if (err)
+    {
+        LOG_WRN("Indication failed (err 0x%02x)", err);
+    }
+}
+
+/**
+ * @brief Callback for when the stack is done with an indication. The slot is
+ * given back, and the next indication to the connection is sent.
+ *
+ * @param params The indication.
+ */
+static void _indicate_destroy_cb(struct bt_gatt_indicate_params *params)
+{
+    indication_t *ind = CONTAINER_OF(params, indication_t, params);
+    uint8_t index = bt_conn_index(ind->conn);
+
+    k_mutex_lock(&_indication_mutex, K_FOREVER);
+    sys_slist_find_and_remove(&queues[index], &ind->node);
+    k_mutex_unlock(&_indication_mutex);
+
+    _free(ind);
+    _send_next(index);
+}
@@ -0,0 +1,98 @@
+/**
+ * @file
+ * @brief Indication queue
+ *
+ * This is a module for sending the indications of the WENS. The stack uses
+ * the parameters and the data of an indication until it is confirmed, so
+ * both are copied in to a slot from a static pool. Only one indication can be
+ * in flight on an ATT bearer, so the indications to each connection are
+ * queued and sent one at a time. A caller is told to back off when the pool
+ * is used up. An indication the stack has no buffer for is kept at the head
+ * of its queue and sent again a little later.
+ */
+
+#ifndef INDICATION_H
+#define INDICATION_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Longest indication, the WEN Status characteristic.
+ */
+#define INDICATION_MAX_LENGTH 20
+
+/**
+ * @brief Indications queued or in flight at a time, on all connections.
+ */
+#define INDICATION_POOL_SIZE 8
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the counters of the indication queue. */
+typedef struct
+{
+    uint32_t depth;        // Indications queued or in flight now
+    uint32_t max_depth;    // Most indications queued or in flight at once
+    uint32_t confirmed;    // Indications confirmed by the peer
+    uint32_t failed;       // Indications that failed or were dropped
+    uint32_t last_latency; // Round-trip time of the last indication (in ms)
+    uint32_t mean_latency; // Mean round-trip time (in ms)
+    uint32_t max_latency;  // Longest round-trip time (in ms)
+} indication_stats_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for initializing the indication queues. Must be called
+ * before an indication is sent.
+ */
+void indication_init(void);
+
+/**
+ * @brief Function for queueing an indication. The data is copied, so it can
+ * be given back at once.
+ *
+ * @param conn The peer to indicate to, or NULL for all connected peers that
+ * have subscribed to the characteristic.
+ * @param attr The characteristic value attribute.
+ * @param data The value to indicate.
+ * @param len Length of the value, at most INDICATION_MAX_LENGTH.
+ *
+ * @return int 0 on success, -ENOMEM if the pool is used up and the caller
+ * should try again later, or another negative value on error.
+ */
+int indication_send(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                    const void *data, uint16_t len);
+
+/**
+ * @brief Function for dropping the indications queued on a connection that is
+ * gone. The stack gives back the one in flight itself.
+ *
+ * @param conn The connection.
+ */
+void indication_disconnected(struct bt_conn *conn);
+
+/**
+ * @brief Function for getting the counters of the indication queue.
+ *
+ * @param stats Pointer to store the counters in.
+ */
+void indication_get_stats(indication_stats_t *stats);
+
+#endif // INDICATION_H
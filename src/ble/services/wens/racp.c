@@ -0,0 +1,1155 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "racp.h"
+#include "../../../records/storage.h"
+#include "bulk.h"
+#include "ens_log.h"
+#include "watermark.h"
+#include "../../connection.h"
+#include "wens.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME racp
+LOG_MODULE_REGISTER(racp);
+
+#define RACP_STACK_SIZE 1536
+#define RACP_PRIORITY   K_PRIO_PREEMPT(7)
+
+#define NOTIFICATIONS_IN_FLIGHT 4 // Notifications handed to the stack at a time
+
+#define RETRY_DELAY 10  // Time to wait for a free buffer (in ms)
+#define RETRY_MAX   100 // Retries before a procedure is given up
+
+#define LIVE_PERIOD    1000 // Shortest time between live pushes (in ms)
+#define LIVE_BATCH_MAX 64   // Most records in a live push
+
+#define BENCHMARK_MIN_RECORDS 300 // Fewest records in a report that is timed
+
+#define SEQUENCE_NUMBER_LENGTH 3
+#define TIME_LENGTH            4
+#define COUNT_RESPONSE_LENGTH  6 // Opcode, operator and a 4 byte count
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the records a notification in flight completes. */
+typedef struct
+{
+    bool acked;     // The notification completes records
+    uint32_t first; // Sequence number of the first record of the report
+    uint32_t last;  // Sequence number of the last record it completes
+} sent_t;
+
+/* This struct holds a procedure running on a connection. */
+typedef struct
+{
+    struct bt_conn *conn;
+    uint8_t request[RACP_MAX_REQUEST_LENGTH];
+    size_t len;
+    bool pending;          // The request waits for the thread
+    bool running;          // Records are being reported
+    bool live;             // The report is a live push
+    bool bulk;             // The report is sent over the bulk channel
+    bool queued;           // The request waits for the live push to end
+    bool holding;          // The ENS log is held for the indices below
+    volatile bool abort;   // The peer has asked for the report to stop
+    volatile bool dropped; // The connection is gone
+    uint32_t start;        // Index of the first record of the report
+    uint32_t end;          // Index of the record after the last
+    uint32_t reported;     // Records reported so far
+    int64_t started_at;    // When the report started
+    ens_log_encoder_t enc; // Encoder of the ENS Log notifications
+    bool held;             // The encoded notification is not sent yet
+    int held_count;        // Records the held notification completes
+    struct k_sem credits;  // Notifications that can be handed to the stack
+    uint32_t stalls;       // Turns the stack has been out of buffers
+
+    // Notifications in flight, in the order they are sent
+    sent_t sent[NOTIFICATIONS_IN_FLIGHT];
+    uint8_t sent_head;
+    uint8_t sent_count;
+
+    struct bt_conn *live_conn; // Set while the peer takes live pushes
+    uint32_t live_seq;         // Sequence number of the next record to push
+    int64_t live_at;           // When the last live push started
+} procedure_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+/* Procedures, indexed by bt_conn_index() */
+static procedure_t procedures[CONFIG_BT_MAX_CONN];
+
+/* Throughput of the reports, indexed by bt_conn_index() */
+static racp_throughput_t throughputs[CONFIG_BT_MAX_CONN];
+
+static volatile bool live_refresh = false; // Subscriptions may have changed
+
+K_MUTEX_DEFINE(_racp_mutex);
+K_SEM_DEFINE(_racp_sem, 0, 1);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _racp_thread(void *p1, void *p2, void *p3);
+K_THREAD_DEFINE(racp_thread, RACP_STACK_SIZE, _racp_thread, NULL, NULL, NULL,
+                RACP_PRIORITY, 0, 0);
+
+static void _start(procedure_t *proc);
+
+static bool _report(procedure_t *proc);
+
+static bool _report_bulk(procedure_t *proc);
+
+static void _report_done(procedure_t *proc);
+
+static void _end_report(procedure_t *proc, uint8_t response);
+
+static bool _live_push(procedure_t *proc, int64_t *wait);
+
+static void _live_done(procedure_t *proc);
+
+static void _live_refresh_cb(struct bt_conn *conn, void *unused);
+
+static void _sent_cb(struct bt_conn *conn, void *user_data);
+
+static void _bulk_sent_cb(struct bt_conn *conn, void *user_data);
+
+static void _finish(procedure_t *proc, uint8_t opcode, uint8_t response);
+
+static racp_response_t _resolve(procedure_t *proc, uint32_t *start,
+                                uint32_t *end);
+
+static racp_response_t _find(uint8_t filter, const uint8_t *operand,
+                             size_t len, bool after, uint32_t *index);
+
+static int _respond(procedure_t *proc, const uint8_t *data, uint16_t len);
+
+static void _sent_push(procedure_t *proc);
+
+static bool _sent_pop(procedure_t *proc, sent_t *sent);
+
+static void _sent_undo(procedure_t *proc);
+
+static void _release(procedure_t *proc);
+
+static void _hold(procedure_t *proc);
+
+static void _unhold(procedure_t *proc);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int racp_request(struct bt_conn *conn, const uint8_t *data, size_t len)
+{
+    procedure_t *proc = &procedures[bt_conn_index(conn)];
+    int err = 0;
+
+    if (len > RACP_MAX_REQUEST_LENGTH)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    if (proc->running && !proc->live && len > 0 &&
+        data[0] == RACP_ABORT_OPERATION)
+    {
+        // The report is stopped by the thread, which answers the abort
+        proc->abort = true;
+    }
+    else if (proc->pending || proc->queued || (proc->running && !proc->live))
+    {
+        err = -EBUSY;
+    }
+    else
+    {
+        memcpy(proc->request, data, len);
+        proc->len = len;
+        proc->abort = false;
+
+        // A live push is short, so the request waits for it and takes over
+        // its reference to the connection
+        if (proc->running)
+        {
+            proc->queued = true;
+        }
+        else
+        {
+            proc->conn = bt_conn_ref(conn);
+            proc->dropped = false;
+            proc->pending = true;
+        }
+    }
+
+    k_mutex_unlock(&_racp_mutex);
+
+    if (err == 0)
+    {
+        k_sem_give(&_racp_sem);
+    }
+
+    return err;
+}
+
+void racp_disconnected(struct bt_conn *conn)
+{
+    procedure_t *proc = &procedures[bt_conn_index(conn)];
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    if (proc->pending || proc->running)
+    {
+        proc->dropped = true;
+    }
+
+    if (proc->live_conn)
+    {
+        bt_conn_unref(proc->live_conn);
+        proc->live_conn = NULL;
+    }
+
+    memset(&throughputs[bt_conn_index(conn)], 0, sizeof(racp_throughput_t));
+
+    k_mutex_unlock(&_racp_mutex);
+}
+
+void racp_live_update(void)
+{
+    live_refresh = true;
+    k_sem_give(&_racp_sem);
+}
+
+void racp_get_throughput(struct bt_conn *conn, racp_throughput_t *throughput)
+{
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+    *throughput = throughputs[bt_conn_index(conn)];
+    k_mutex_unlock(&_racp_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief The RACP thread. New requests are started, and the running reports
+ * take turns topping up their notifications in flight, so a long report on
+ * one connection does not hold back the others. Idle connections that are
+ * subscribed to the ENS Log get live pushes. The thread sleeps until a
+ * request comes in, a notification is sent or a live push is due.
+ *
+ * @param p1 Not in use.
+ * @param p2 Not in use.
+ * @param p3 Not in use.
+ */
+static void _racp_thread(void *p1, void *p2, void *p3)
+{
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+    {
+        ens_log_encoder_init(&procedures[i].enc);
+        k_sem_init(&procedures[i].credits, NOTIFICATIONS_IN_FLIGHT,
+                   NOTIFICATIONS_IN_FLIGHT);
+    }
+
+    while (1)
+    {
+        int64_t wait = -1; // Time until a live push is due (in ms)
+        bool busy = false;
+        bool progress = false;
+
+        if (live_refresh)
+        {
+            live_refresh = false;
+
+            k_mutex_lock(&_racp_mutex, K_FOREVER);
+            connection_foreach(_live_refresh_cb, NULL);
+            k_mutex_unlock(&_racp_mutex);
+        }
+
+        for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+        {
+            procedure_t *proc = &procedures[i];
+
+            if (proc->pending)
+            {
+                _start(proc);
+                progress = true;
+            }
+            else if (proc->running)
+            {
+                progress |= _report(proc);
+            }
+            else if (proc->live_conn)
+            {
+                progress |= _live_push(proc, &wait);
+            }
+
+            busy |= proc->running;
+        }
+
+        if (busy && !progress)
+        {
+            // Out of credits or buffers, wait for a notification to be sent
+            k_sem_take(&_racp_sem, K_MSEC(RETRY_DELAY));
+        }
+        else if (!busy)
+        {
+            k_sem_take(&_racp_sem, wait < 0 ? K_FOREVER : K_MSEC(wait));
+        }
+    }
+}
+
+/**
+ * @brief Function for carrying out a new request. Counting and deleting are
+ * done at once, while a report is left running.
+ *
+ * @param proc The procedure holding the request.
+ */
+static void _start(procedure_t *proc)
+{
+    uint8_t opcode = proc->len > 0 ? proc->request[0] : 0;
+    uint8_t response[RACP_MAX_RESPONSE_LENGTH];
+    racp_response_t result;
+    uint32_t start = 0;
+    uint32_t end = 0;
+
+    if (proc->dropped)
+    {
+        _release(proc);
+        return;
+    }
+
+    // The range is resolved to indices, which a delete must not move until
+    // the procedure is done
+    if (opcode != RACP_DELETE_STORED_RECORDS)
+    {
+        _hold(proc);
+    }
+
+    switch (opcode)
+    {
+    case RACP_REPORT_STORED_RECORDS:
+    case RACP_COMBINED_REPORT:
+    case RACP_REPORT_STORED_RECORDS_BULK:
+        result = _resolve(proc, &start, &end);
+        if (result == RACP_SUCCESS && start == end)
+        {
+            result = RACP_NO_RECORDS_FOUND;
+        }
+
+        if (result != RACP_SUCCESS)
+        {
+            break;
+        }
+
+        // The peer has to open the bulk channel before asking for a report
+        // over it
+        if (opcode == RACP_REPORT_STORED_RECORDS_BULK &&
+            !bulk_is_open(proc->conn))
+        {
+            result = RACP_PROCEDURE_NOT_COMPLETED;
+            break;
+        }
+
+        LOG_INF("Reporting records %u to %u", start, end - 1);
+
+        if (opcode != RACP_REPORT_STORED_RECORDS_BULK)
+        {
+            ens_log_encoder_start(&proc->enc, bt_gatt_get_mtu(proc->conn),
+                                  start, end);
+        }
+
+        k_mutex_lock(&_racp_mutex, K_FOREVER);
+        proc->bulk = opcode == RACP_REPORT_STORED_RECORDS_BULK;
+        proc->start = start;
+        proc->end = end;
+        proc->reported = 0;
+        proc->started_at = k_uptime_get();
+        proc->held = false;
+        proc->held_count = 0;
+        proc->stalls = 0;
+        proc->pending = false;
+        proc->running = true;
+        k_mutex_unlock(&_racp_mutex);
+        return;
+
+    case RACP_REPORT_NUMBER_OF_STORED_RECORDS:
+        result = _resolve(proc, &start, &end);
+        if (result != RACP_SUCCESS)
+        {
+            break;
+        }
+
+        response[0] = RACP_NUMBER_OF_STORED_RECORDS_RESPONSE;
+        response[1] = RACP_OPERATOR_NULL;
+        sys_put_le32(storage_count_entries(start, end), &response[2]);
+
+        _respond(proc, response, COUNT_RESPONSE_LENGTH);
+        _release(proc);
+        return;
+
+    case RACP_DELETE_STORED_RECORDS:
+        result = _resolve(proc, &start, &end);
+        if (result != RACP_SUCCESS)
+        {
+            break;
+        }
+
+        if (start == end)
+        {
+            result = proc->request[1] == RACP_OPERATOR_ALL
+                         ? RACP_SUCCESS
+                         : RACP_NO_RECORDS_FOUND;
+            break;
+        }
+
+        // The log is a ring, so records can only be deleted from the oldest
+        // without leaving a gap
+        if (start > 0)
+        {
+            result = RACP_OPERATOR_NOT_SUPPORTED;
+            break;
+        }
+
+        LOG_INF("Deleting records 0 to %u", end - 1);
+
+        // Refused if a report or a check started after the request was
+        // written
+        result = storage_delete_before(end) == 0
+                     ? RACP_SUCCESS
+                     : RACP_PROCEDURE_NOT_COMPLETED;
+        break;
+
+    case RACP_ABORT_OPERATION:
+        // Nothing is running, so there is nothing to abort
+        result = proc->len == 2 && proc->request[1] == RACP_OPERATOR_NULL
+                     ? RACP_SUCCESS
+                     : RACP_INVALID_OPERATOR;
+        break;
+
+    default:
+        result = RACP_OPCODE_NOT_SUPPORTED;
+        break;
+    }
+
+    _finish(proc, opcode, result);
+}
+
+/**
+ * @brief Function for reporting the next records of a running report. The
+ * next chunk of records is read in the background while notifications are
+ * handed to the stack, as long as the report has credits left. A credit is
+ * given back when a notification has been sent. The report is finished once
+ * the last record is handed over, or it fails or is aborted.
+ *
+ * @param proc The procedure.
+ *
+ * @return bool True if a notification was handed to the stack.
+ */
+static bool _report(procedure_t *proc)
+{
+    ens_log_encoder_t *enc = &proc->enc;
+    bool progress = false;
+    int err;
+
+    if (proc->dropped)
+    {
+        _release(proc);
+        return true;
+    }
+
+    if (proc->abort)
+    {
+        LOG_INF("Report aborted after %u records", proc->reported);
+        _finish(proc, RACP_ABORT_OPERATION, RACP_SUCCESS);
+        return true;
+    }
+
+    if (proc->bulk)
+    {
+        return _report_bulk(proc);
+    }
+
+    while (k_sem_take(&proc->credits, K_NO_WAIT) == 0)
+    {
+        if (!proc->held)
+        {
+            // The MTU may have grown since the last record
+            ens_log_encoder_set_mtu(enc, bt_gatt_get_mtu(proc->conn));
+
+            proc->held_count = ens_log_encode(enc);
+            if (proc->held_count == -ENODATA)
+            {
+                k_sem_give(&proc->credits);
+                break;
+            }
+            else if (proc->held_count < 0)
+            {
+                _end_report(proc, RACP_PROCEDURE_NOT_COMPLETED);
+                return true;
+            }
+
+            proc->held = true;
+        }
+
+        // The notification may be sent before the call returns
+        proc->reported += proc->held_count;
+        _sent_push(proc);
+
+        err = wens_ens_log_notify(proc->conn, enc->buf, enc->len, _sent_cb,
+                                  proc);
+        if (err)
+        {
+            _sent_undo(proc);
+            proc->reported -= proc->held_count;
+        }
+
+        if (err == -ENOMEM && ++proc->stalls < RETRY_MAX)
+        {
+            // Keep the notification until the stack frees a buffer
+            k_sem_give(&proc->credits);
+            return progress;
+        }
+        else if (err)
+        {
+            LOG_WRN("Failed to report records (err %d)", err);
+            _end_report(proc, RACP_PROCEDURE_NOT_COMPLETED);
+            return true;
+        }
+
+        proc->held = false;
+        proc->stalls = 0;
+        progress = true;
+    }
+
+    if (proc->held_count != -ENODATA)
+    {
+        return progress;
+    }
+
+    if (proc->live)
+    {
+        _live_done(proc);
+        return true;
+    }
+
+    _report_done(proc);
+    return true;
+}
+
+/**
+ * @brief Function for reporting the next records of a running report over the
+ * bulk channel. SDUs are handed to the stack as long as the channel has room,
+ * and the flash is read while the SDUs before are sent. The response is sent
+ * once the last SDU has been sent, as it could overtake the SDUs otherwise.
+ *
+ * @param proc The procedure.
+ *
+ * @return bool True if an SDU was handed to the stack.
+ */
+static bool _report_bulk(procedure_t *proc)
+{
+    bool progress = false;
+    int count;
+
+    while (proc->start + proc->reported < proc->end)
+    {
+        count = bulk_send(proc->conn, proc->start + proc->reported, proc->end,
+                          _bulk_sent_cb, NULL);
+        if (count == -EBUSY)
+        {
+            return progress;
+        }
+        else if (count < 0)
+        {
+            LOG_WRN("Failed to report records (err %d)", count);
+            _end_report(proc, RACP_PROCEDURE_NOT_COMPLETED);
+            return true;
+        }
+
+        proc->reported += count;
+        progress = true;
+    }
+
+    if (!bulk_is_idle(proc->conn))
+    {
+        return progress;
+    }
+
+    // The records in flight are lost if the channel was closed
+    if (!bulk_is_open(proc->conn))
+    {
+        LOG_WRN("Bulk channel closed during a report");
+        _end_report(proc, RACP_PROCEDURE_NOT_COMPLETED);
+        return true;
+    }
+
+    _report_done(proc);
+    return true;
+}
+
+/**
+ * @brief Function for ending a report that has reported every record. The
+ * throughput of a long report is kept, so the transports can be compared.
+ *
+ * @param proc The procedure.
+ */
+static void _report_done(procedure_t *proc)
+{
+    uint8_t opcode = proc->request[0];
+    uint8_t response[RACP_MAX_RESPONSE_LENGTH];
+    uint32_t time = MAX(k_uptime_get() - proc->started_at, 1);
+    uint32_t throughput = (uint64_t)proc->reported * SIZE_OF_ONE_ENTRY *
+                          MSEC_PER_SEC / time;
+    racp_throughput_t *last = &throughputs[bt_conn_index(proc->conn)];
+
+    LOG_INF("Reported %u records in %u ms over %s (%u bytes/s)",
+            proc->reported, time, proc->bulk ? "the bulk channel" : "GATT",
+            throughput);
+
+    if (proc->reported >= BENCHMARK_MIN_RECORDS)
+    {
+        k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+        if (proc->bulk)
+        {
+            last->bulk = throughput;
+        }
+        else
+        {
+            last->gatt = throughput;
+        }
+
+        k_mutex_unlock(&_racp_mutex);
+    }
+
+    if (opcode == RACP_COMBINED_REPORT)
+    {
+        response[0] = RACP_COMBINED_REPORT_RESPONSE;
+        response[1] = RACP_OPERATOR_NULL;
+        sys_put_le32(proc->reported, &response[2]);
+
+        _respond(proc, response, COUNT_RESPONSE_LENGTH);
+        _release(proc);
+        return;
+    }
+
+    _finish(proc, opcode, RACP_SUCCESS);
+}
+
+/**
+ * @brief Function for ending a report that has failed. A live push ends
+ * without a response, and the records not pushed are pushed with the next.
+ *
+ * @param proc The procedure.
+ * @param response The response code.
+ */
+static void _end_report(procedure_t *proc, uint8_t response)
+{
+    if (proc->live)
+    {
+        _live_done(proc);
+        return;
+    }
+
+    _finish(proc, proc->request[0], response);
+}
+
+/**
+ * @brief Function for starting a live push of the records stored since the
+ * last one. Pushes are at least @c LIVE_PERIOD apart, so records that come in
+ * between are coalesced in to one push, and a push holds at most
+ * @c LIVE_BATCH_MAX records, so a busy environment does not flood the link.
+ *
+ * @param proc The procedure of a subscribed connection with nothing running.
+ * @param wait Time until a push is due (in ms), lowered if this push is not
+ * due yet. Negative if no push is due.
+ *
+ * @return bool True if a push was started.
+ */
+static bool _live_push(procedure_t *proc, int64_t *wait)
+{
+    int64_t due = proc->live_at + LIVE_PERIOD - k_uptime_get();
+    uint32_t count;
+    uint32_t start;
+
+    if (due > 0)
+    {
+        *wait = *wait < 0 ? due : MIN(*wait, due);
+        return false;
+    }
+
+    _hold(proc);
+    count = storage_get_entry_count();
+
+    // Records erased since the last push are skipped
+    storage_find_sequence(proc->live_seq, &start);
+
+    if (start >= count)
+    {
+        _unhold(proc);
+        return false;
+    }
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    // The peer may have disconnected in the meantime
+    if (!proc->live_conn)
+    {
+        k_mutex_unlock(&_racp_mutex);
+        _unhold(proc);
+        return false;
+    }
+
+    proc->conn = bt_conn_ref(proc->live_conn);
+    proc->start = start;
+    proc->reported = 0;
+    proc->held = false;
+    proc->held_count = 0;
+    proc->stalls = 0;
+    proc->abort = false;
+    proc->dropped = false;
+    proc->live = true;
+    proc->bulk = false;
+    proc->running = true;
+    k_mutex_unlock(&_racp_mutex);
+
+    ens_log_encoder_start(&proc->enc, bt_gatt_get_mtu(proc->conn), start,
+                          MIN(count, start + LIVE_BATCH_MAX));
+    proc->live_at = k_uptime_get();
+
+    return true;
+}
+
+/**
+ * @brief Function for ending a live push. A request that came in during the
+ * push is started next, with the reference to the connection the push held.
+ *
+ * @param proc The procedure.
+ */
+static void _live_done(procedure_t *proc)
+{
+    ens_log_encoder_stop(&proc->enc);
+
+    proc->live_seq =
+        storage_get_sequence_number(proc->start + proc->reported);
+    _unhold(proc);
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    proc->live = false;
+    proc->running = false;
+
+    if (proc->queued)
+    {
+        proc->queued = false;
+        proc->pending = true;
+    }
+    else
+    {
+        bt_conn_unref(proc->conn);
+        proc->conn = NULL;
+    }
+
+    k_mutex_unlock(&_racp_mutex);
+}
+
+/**
+ * @brief Function for starting or stopping live pushes to a connected peer as
+ * it subscribes to or unsubscribes from the ENS Log. A new subscriber gets the
+ * records stored from now on. Must be called with the mutex held, so the
+ * connection can not be dropped in between.
+ *
+ * @param conn The connection.
+ * @param unused Not in use, but required.
+ */
+static void _live_refresh_cb(struct bt_conn *conn, void *unused)
+{
+    procedure_t *proc = &procedures[bt_conn_index(conn)];
+    bool subscribed = wens_ens_log_subscribed(conn);
+
+    if (subscribed && !proc->live_conn)
+    {
+        proc->live_conn = bt_conn_ref(conn);
+        proc->live_seq =
+            storage_get_sequence_number(storage_get_entry_count());
+        proc->live_at = k_uptime_get() - LIVE_PERIOD;
+
+        LOG_INF("Live push started");
+    }
+    else if (!subscribed && proc->live_conn)
+    {
+        bt_conn_unref(proc->live_conn);
+        proc->live_conn = NULL;
+
+        LOG_INF("Live push stopped");
+    }
+}
+
+/**
+ * @brief Callback giving back a credit once the link layer of the peer has
+ * acknowledged a notification, and moving the watermark of the peer past the
+ * records it completes.
+ *
+ * @param conn The connection the notification was sent on.
+ * @param user_data The procedure.
+ */
+static void _sent_cb(struct bt_conn *conn, void *user_data)
+{
+    procedure_t *proc = user_data;
+    sent_t sent;
+
+    if (_sent_pop(proc, &sent) && sent.acked)
+    {
+        watermark_ack(conn, sent.first, sent.last);
+    }
+
+    k_sem_give(&proc->credits);
+    k_sem_give(&_racp_sem);
+}
+
+/**
+ * @brief Callback waking the RACP thread once an SDU of a report over the bulk
+ * channel has been sent.
+ *
+ * @param conn The connection the SDU was sent on.
+ * @param user_data Not in use.
+ */
+static void _bulk_sent_cb(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&_racp_sem);
+}
+
+/**
+ * @brief Function for ending a procedure with a response code.
+ *
+ * @param proc The procedure.
+ * @param opcode The opcode of the request the response is for.
+ * @param response The response code.
+ */
+static void _finish(procedure_t *proc, uint8_t opcode, uint8_t response)
+{
+    uint8_t data[] = {RACP_RESPONSE_CODE, RACP_OPERATOR_NULL, opcode,
+                      response};
+
+    _respond(proc, data, sizeof(data));
+    _release(proc);
+}
+
+/**
+ * @brief Function for resolving the operator and operand of a request in to
+ * a range of record indices. Records are written in sequence number and time
+ * order, so the range is contiguous.
+ *
+ * @param request The request.
+ * @param len Length of the request.
+ * @param start Pointer to store the index of the first record in.
+ * @param end Pointer to store the index of the record after the last in.
+ *
+ * @return racp_response_t RACP_SUCCESS, or the response code to answer with.
+ */
+static racp_response_t _resolve(procedure_t *proc, uint32_t *start,
+                                uint32_t *end)
+{
+    const uint8_t *request = proc->request;
+    size_t len = proc->len;
+    uint32_t count = storage_get_entry_count();
+    const uint8_t *operand = &request[3];
+    size_t operand_len = len > 3 ? len - 3 : 0;
+    racp_response_t result = RACP_SUCCESS;
+    size_t half;
+
+    if (len < 2)
+    {
+        return RACP_INVALID_OPERATOR;
+    }
+
+    *start = 0;
+    *end = count;
+
+    switch (request[1])
+    {
+    case RACP_OPERATOR_ALL:
+        return len == 2 ? RACP_SUCCESS : RACP_INVALID_OPERAND;
+    case RACP_OPERATOR_FIRST:
+        *end = MIN(count, 1);
+        return len == 2 ? RACP_SUCCESS : RACP_INVALID_OPERAND;
+    case RACP_OPERATOR_LAST:
+        *start = count > 0 ? count - 1 : 0;
+        return len == 2 ? RACP_SUCCESS : RACP_INVALID_OPERAND;
+    case RACP_OPERATOR_SINCE_WATERMARK:
+        *start = MIN(watermark_next_index(proc->conn), count);
+        return len == 2 ? RACP_SUCCESS : RACP_INVALID_OPERAND;
+    case RACP_OPERATOR_LESS_OR_EQUAL:
+    case RACP_OPERATOR_GREATER_OR_EQUAL:
+    case RACP_OPERATOR_WITHIN_RANGE:
+        break;
+    case RACP_OPERATOR_NULL:
+        return RACP_INVALID_OPERATOR;
+    default:
+        return RACP_OPERATOR_NOT_SUPPORTED;
+    }
+
+    if (len < 3)
+    {
+        return RACP_INVALID_OPERAND;
+    }
+
+    switch (request[1])
+    {
+    case RACP_OPERATOR_LESS_OR_EQUAL:
+        result = _find(request[2], operand, operand_len, true, end);
+        break;
+    case RACP_OPERATOR_GREATER_OR_EQUAL:
+        result = _find(request[2], operand, operand_len, false, start);
+        break;
+    case RACP_OPERATOR_WITHIN_RANGE:
+        half = operand_len / 2;
+
+        if (operand_len % 2 != 0)
+        {
+            return RACP_INVALID_OPERAND;
+        }
+
+        result = _find(request[2], operand, half, false, start);
+        if (result == RACP_SUCCESS)
+        {
+            result = _find(request[2], &operand[half], half, true, end);
+        }
+
+        // A range that ends before it starts
+        if (result == RACP_SUCCESS && *end < *start)
+        {
+            result = RACP_INVALID_OPERAND;
+        }
+        break;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Function for finding the index of the first record with a sequence
+ * number or time equal to or later than a value, or after it.
+ *
+ * @param filter The filter type, see @c racp_filter_t.
+ * @param operand The value.
+ * @param len Length of the value.
+ * @param after True to find the first record after the value.
+ * @param index Pointer to store the index in.
+ *
+ * @return racp_response_t RACP_SUCCESS, or the response code to answer with.
+ */
+static racp_response_t _find(uint8_t filter, const uint8_t *operand,
+                             size_t len, bool after, uint32_t *index)
+{
+    uint32_t value;
+    int err;
+
+    switch (filter)
+    {
+    case RACP_FILTER_SEQUENCE_NUMBER:
+        if (len != SEQUENCE_NUMBER_LENGTH)
+        {
+            return RACP_INVALID_OPERAND;
+        }
+
+        value = sys_get_le24(operand);
+        err = storage_find_sequence(value + after, index);
+        break;
+    case RACP_FILTER_TIME:
+        if (len != TIME_LENGTH)
+        {
+            return RACP_INVALID_OPERAND;
+        }
+
+        value = sys_get_le32(operand);
+
+        // Nothing is later than the last possible time
+        if (after && value == UINT32_MAX)
+        {
+            *index = storage_get_entry_count();
+            return RACP_SUCCESS;
+        }
+
+        err = storage_find_entry(value + after, index);
+        break;
+    default:
+        return RACP_OPERAND_NOT_SUPPORTED;
+    }
+
+    return err == 0 ? RACP_SUCCESS : RACP_PROCEDURE_NOT_COMPLETED;
+}
+
+/**
+ * @brief Function for indicating a response on the RACP, waiting for room in
+ * the indication queue if needed.
+ *
+ * @param proc The procedure.
+ * @param data The response.
+ * @param len Length of the response.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _respond(procedure_t *proc, const uint8_t *data, uint16_t len)
+{
+    int err = wens_racp_indicate(proc->conn, data, len);
+
+    for (int retry = 0; err == -ENOMEM && retry < RETRY_MAX; retry++)
+    {
+        k_sleep(K_MSEC(RETRY_DELAY));
+        err = wens_racp_indicate(proc->conn, data, len);
+    }
+
+    if (err)
+    {
+        LOG_WRN("Failed to indicate RACP response (err %d)", err);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Function for noting the records a notification about to be sent
+ * completes. Must be called with a credit taken, so there is room.
+ *
+ * @param proc The procedure.
+ */
+static void _sent_push(procedure_t *proc)
+{
+    sent_t *sent;
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    sent = &proc->sent[(proc->sent_head + proc->sent_count) %
+                       NOTIFICATIONS_IN_FLIGHT];
+    sent->acked = proc->reported > 0;
+    sent->first = storage_get_sequence_number(proc->start);
+    sent->last = storage_get_sequence_number(proc->start + proc->reported - 1);
+    proc->sent_count++;
+
+    k_mutex_unlock(&_racp_mutex);
+}
+
+/**
+ * @brief Function for taking the first notification in flight, which has
+ * been sent.
+ *
+ * @param proc The procedure.
+ * @param sent Pointer to store the records the notification completes in.
+ *
+ * @return bool False if no notification was in flight.
+ */
+static bool _sent_pop(procedure_t *proc, sent_t *sent)
+{
+    bool found = false;
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    if (proc->sent_count > 0)
+    {
+        *sent = proc->sent[proc->sent_head];
+        proc->sent_head = (proc->sent_head + 1) % NOTIFICATIONS_IN_FLIGHT;
+        proc->sent_count--;
+        found = true;
+    }
+
+    k_mutex_unlock(&_racp_mutex);
+
+    return found;
+}
+
+/**
+ * @brief Function for taking back the last notification in flight, which the
+ * stack did not accept.
+ *
+ * @param proc The procedure.
+ */
+static void _sent_undo(procedure_t *proc)
+{
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+    proc->sent_count--;
+    k_mutex_unlock(&_racp_mutex);
+}
+
+/**
+ * @brief Function for ending a procedure, so the connection can start a new
+ * one. The watermark of the peer is stored, as it may have moved.
+ *
+ * @param proc The procedure.
+ */
+static void _release(procedure_t *proc)
+{
+    ens_log_encoder_stop(&proc->enc);
+    _unhold(proc);
+    watermark_store();
+
+    k_mutex_lock(&_racp_mutex, K_FOREVER);
+
+    // Notifications in flight on a connection that is gone are never
+    // acknowledged, so their credits are given back
+    if (proc->dropped)
+    {
+        k_sem_init(&proc->credits, NOTIFICATIONS_IN_FLIGHT,
+                   NOTIFICATIONS_IN_FLIGHT);
+        proc->sent_head = 0;
+        proc->sent_count = 0;
+    }
+
+    bt_conn_unref(proc->conn);
+    proc->conn = NULL;
+    proc->pending = false;
+    proc->running = false;
+    proc->live = false;
+    proc->queued = false;
+
+    k_mutex_unlock(&_racp_mutex);
+}
+
+/**
+ * @brief Function for holding the ENS log for a procedure, so no records are
+ * deleted while it keeps indices. Does nothing if the procedure holds it.
+ *
+ * @param proc The procedure.
+ */
+static void _hold(procedure_t *proc)
+{
+    if (!proc->holding)
+    {
+        storage_hold();
+        proc->holding = true;
+    }
+}
+
+/**
+ * @brief Function for releasing the hold of a procedure on the ENS log. Does
+ * nothing if the procedure does not hold it.
+ *
+ * @param proc The procedure.
+ */
+static void _unhold(procedure_t *proc)
+{
+    if (proc->holding)
+    {
+        proc->holding = false;
+        storage_release();
+    }
+}
@@ -0,0 +1,155 @@
+/**
+ * @file
+ * @brief RACP library
+ * 
+ * This is a library for the Record Access Control Point (RACP) of the WENS.
+ * It reports, counts and deletes the ENS log records a phone asks for. The
+ * records are picked by sequence number, by time or as the records since the
+ * sync watermark of the phone, and the ranges are resolved through the
+ * storage module without scanning the log. Records are deleted from the
+ * oldest, up to the end of the range asked for, and a range that starts after
+ * the oldest record is not supported.
+ * 
+ * The requests are carried out on a thread of their own, so the ATT write
+ * callback returns at once. Each connection can have one procedure running,
+ * and the procedures of different connections take turns.
+ * 
+ * The same thread pushes new records to the peers subscribed to the ENS Log,
+ * so a gateway or phone can stay in sync without bulk pulls. A request that
+ * comes in during a push waits for the push to end.
+ * 
+ * A report can be sent over the bulk channel instead of the ENS Log, see
+ * bulk.h. The throughput of the last long report over each is kept for every
+ * connection, so the peer can pick the faster one.
+ */
+
+#ifndef RACP_H
+#define RACP_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define RACP_MAX_REQUEST_LENGTH  11 // Range of two timestamps
+#define RACP_MAX_RESPONSE_LENGTH 6  // Number of records response
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This enum is constructed of the opcodes for the RACP characteristic 
+from Table 4.19 and 4.20. Reporting over the bulk channel is not part of the
+RACP specification. It takes the same operators as a report, and the peer must
+have opened the bulk channel first. */
+typedef enum
+{
+    RACP_REPORT_STORED_RECORDS = 0x01,
+    RACP_DELETE_STORED_RECORDS,
+    RACP_ABORT_OPERATION,
+    RACP_REPORT_NUMBER_OF_STORED_RECORDS,
+    RACP_NUMBER_OF_STORED_RECORDS_RESPONSE,
+    RACP_RESPONSE_CODE,
+    RACP_COMBINED_REPORT,
+    RACP_COMBINED_REPORT_RESPONSE,
+    RACP_REPORT_STORED_RECORDS_BULK
+} racp_opcode_t;
+
+/* This enum is constructed of the RACP operators. The records since the
+watermark are the records the peer has not received yet, see watermark.h. This
+operator is not part of the RACP specification, and takes no operand. */
+typedef enum
+{
+    RACP_OPERATOR_NULL,
+    RACP_OPERATOR_ALL,
+    RACP_OPERATOR_LESS_OR_EQUAL,
+    RACP_OPERATOR_GREATER_OR_EQUAL,
+    RACP_OPERATOR_WITHIN_RANGE,
+    RACP_OPERATOR_FIRST,
+    RACP_OPERATOR_LAST,
+    RACP_OPERATOR_SINCE_WATERMARK
+} racp_operator_t;
+
+/* This enum is constructed of the RACP filter types. The sequence number is
+3 bytes and the time is 4 bytes, both little endian. */
+typedef enum
+{
+    RACP_FILTER_SEQUENCE_NUMBER = 0x01,
+    RACP_FILTER_TIME
+} racp_filter_t;
+
+/* This enum is constructed of the RACP response codes. */
+typedef enum
+{
+    RACP_SUCCESS = 0x01,
+    RACP_OPCODE_NOT_SUPPORTED,
+    RACP_INVALID_OPERATOR,
+    RACP_OPERATOR_NOT_SUPPORTED,
+    RACP_INVALID_OPERAND,
+    RACP_NO_RECORDS_FOUND,
+    RACP_ABORT_UNSUCCESSFUL,
+    RACP_PROCEDURE_NOT_COMPLETED,
+    RACP_OPERAND_NOT_SUPPORTED
+} racp_response_t;
+
+/* This struct holds the throughput of the last long report over each
+transport on a connection, 0 if there has been none. */
+typedef struct
+{
+    uint32_t gatt; // Over ENS Log notifications (in bytes/s)
+    uint32_t bulk; // Over the bulk channel (in bytes/s)
+} racp_throughput_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for handing a request written to the RACP to the RACP
+ * thread. The result is indicated on the RACP once the request is carried
+ * out. An abort is accepted while a procedure is running.
+ * 
+ * @param conn The connection that wrote the request.
+ * @param data The request.
+ * @param len Length of the request.
+ * 
+ * @return int 0 on success, -EBUSY if a procedure is already running on the
+ * connection or -EINVAL if the request is too long.
+ */
+int racp_request(struct bt_conn *conn, const uint8_t *data, size_t len);
+
+/**
+ * @brief Function for telling the RACP library that a connection is gone. A
+ * procedure running on the connection is dropped without a response.
+ * 
+ * @param conn The connection.
+ */
+void racp_disconnected(struct bt_conn *conn);
+
+/**
+ * @brief Function for telling the RACP library that the ENS Log
+ * subscriptions may have changed, or that records have been stored. Peers
+ * subscribed to the ENS Log get the records stored since they subscribed
+ * pushed to them, batched and rate limited, while they have no procedure
+ * running.
+ */
+void racp_live_update(void);
+
+/**
+ * @brief Function for getting the throughput of the reports on a connection.
+ * 
+ * @param conn The connection.
+ * @param throughput Pointer to store the throughput in.
+ */
+void racp_get_throughput(struct bt_conn *conn, racp_throughput_t *throughput);
+
+#endif // RACP_H
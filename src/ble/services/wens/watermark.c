@@ -0,0 +1,285 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "watermark.h"
+#include "../../connection.h"
+#include "../../radio.h"
+#include "../../../records/storage.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <settings/settings.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME watermark
+LOG_MODULE_REGISTER(watermark);
+
+#define SETTINGS_KEY "wens/wm"
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the watermark of a bonded peer, as it is stored. */
+typedef struct
+{
+    bt_addr_le_t addr; // Identity address of the peer
+    uint32_t seq;      // Sequence number of the last record received
+    uint8_t used;
+} watermark_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static watermark_t watermarks[CONFIG_BT_MAX_PAIRED];
+static int64_t acked_at[CONFIG_BT_MAX_PAIRED]; // When each watermark moved
+static bool dirty = false; // Watermarks have moved since they were stored
+
+K_MUTEX_DEFINE(_watermark_mutex);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static int _settings_set(const char *name, size_t len,
+                         settings_read_cb read_cb, void *cb_arg);
+SETTINGS_STATIC_HANDLER_DEFINE(wens_watermark, SETTINGS_KEY, NULL,
+                               _settings_set, NULL, NULL);
+
+static void _store_handler(struct k_work *unused);
+K_WORK_DEFINE(_store_work, _store_handler);
+
+static watermark_t *_find(const bt_addr_le_t *addr);
+
+static watermark_t *_claim(const bt_addr_le_t *addr);
+
+static uint32_t _next_sequence_number(const watermark_t *watermark);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+uint32_t watermark_next_index(struct bt_conn *conn)
+{
+    watermark_t *watermark = NULL;
+    bt_addr_le_t addr;
+    uint32_t index = 0;
+    uint32_t next;
+
+    k_mutex_lock(&_watermark_mutex, K_FOREVER);
+
+    if (connection_is_bonded(conn, &addr))
+    {
+        watermark = _find(&addr);
+    }
+
+    next = _next_sequence_number(watermark);
+
+    k_mutex_unlock(&_watermark_mutex);
+
+    storage_find_sequence(next, &index);
+
+    return index;
+}
+
+void watermark_ack(struct bt_conn *conn, uint32_t first, uint32_t last)
+{
+    watermark_t *watermark;
+    bt_addr_le_t addr;
+    uint32_t next;
+
+    if (!connection_is_bonded(conn, &addr))
+    {
+        return;
+    }
+
+    k_mutex_lock(&_watermark_mutex, K_FOREVER);
+
+    watermark = _find(&addr);
+    next = _next_sequence_number(watermark);
+
+    // The run must not leave a gap after the watermark, and must move it on
+    if (storage_sequence_compare(first, next) > 0 ||
+        storage_sequence_compare(last, next) < 0)
+    {
+        k_mutex_unlock(&_watermark_mutex);
+        return;
+    }
+
+    if (!watermark)
+    {
+        watermark = _claim(&addr);
+    }
+
+    watermark->seq = last;
+    acked_at[watermark - watermarks] = k_uptime_get();
+    dirty = true;
+
+    k_mutex_unlock(&_watermark_mutex);
+}
+
+void watermark_store(void) { radio_submit_low_priority(&_store_work); }
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Settings callback loading the stored watermarks.
+ *
+ * @param name The name of the setting, relative to the handler.
+ * @param len Length of the stored value.
+ * @param read_cb Function for reading the value.
+ * @param cb_arg Argument for @c read_cb.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _settings_set(const char *name, size_t len,
+                         settings_read_cb read_cb, void *cb_arg)
+{
+    ssize_t read;
+
+    // A table of another size is from another configuration
+    if (len != sizeof(watermarks))
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&_watermark_mutex, K_FOREVER);
+    read = read_cb(cb_arg, watermarks, sizeof(watermarks));
+    k_mutex_unlock(&_watermark_mutex);
+
+    if (read < 0)
+    {
+        LOG_ERR("Failed to load the sync watermarks (err %d)", (int)read);
+        return read;
+    }
+
+    LOG_INF("Loaded the sync watermarks");
+
+    return 0;
+}
+
+/**
+ * @brief Work handler storing the watermarks if they have moved.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _store_handler(struct k_work *unused)
+{
+    watermark_t copy[CONFIG_BT_MAX_PAIRED];
+    bool store;
+    int err;
+
+    k_mutex_lock(&_watermark_mutex, K_FOREVER);
+    memcpy(copy, watermarks, sizeof(copy));
+    store = dirty;
+    dirty = false;
+    k_mutex_unlock(&_watermark_mutex);
+
+    if (!store || !IS_ENABLED(CONFIG_SETTINGS))
+    {
+        return;
+    }
+
+    err = settings_save_one(SETTINGS_KEY, copy, sizeof(copy));
+    if (err)
+    {
+        LOG_ERR("Failed to store the sync watermarks (err %d)", err);
+    }
+}
+
+/**
+ * @brief Function for finding the watermark of a peer. Must be called with
+ * the mutex held.
+ *
+ * @param addr The identity address of the peer.
+ *
+ * @return watermark_t* The watermark, NULL if the peer has none.
+ */
+static watermark_t *_find(const bt_addr_le_t *addr)
+{
+    for (int i = 0; i < CONFIG_BT_MAX_PAIRED; i++)
+    {
+        if (watermarks[i].used && !bt_addr_le_cmp(&watermarks[i].addr, addr))
+        {
+            return &watermarks[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Function for giving a peer a watermark. A free one is used if there
+ * is one, otherwise the one that moved the longest time ago, as there are as
+ * many watermarks as bonds. Must be called with the mutex held.
+ *
+ * @param addr The identity address of the peer.
+ *
+ * @return watermark_t* The watermark.
+ */
+static watermark_t *_claim(const bt_addr_le_t *addr)
+{
+    int oldest = 0;
+
+    for (int i = 0; i < CONFIG_BT_MAX_PAIRED; i++)
+    {
+        if (!watermarks[i].used)
+        {
+            oldest = i;
+            break;
+        }
+
+        if (acked_at[i] < acked_at[oldest])
+        {
+            oldest = i;
+        }
+    }
+
+    bt_addr_le_copy(&watermarks[oldest].addr, addr);
+    watermarks[oldest].used = true;
+
+    return &watermarks[oldest];
+}
+
+/**
+ * @brief Function for finding the sequence number of the first record a peer
+ * has not received. Records before the log were erased, and a watermark past
+ * the end of the log is left from before the log was reset, so the peer has
+ * not received any of the records in the log.
+ *
+ * @param watermark The watermark of the peer, or NULL if it has none.
+ *
+ * @return uint32_t The sequence number.
+ */
+static uint32_t _next_sequence_number(const watermark_t *watermark)
+{
+    uint32_t first = storage_get_sequence_number(0);
+    uint32_t end = storage_get_sequence_number(storage_get_entry_count());
+    uint32_t next;
+
+    if (!watermark)
+    {
+        return first;
+    }
+
+    next = (watermark->seq + 1) & STORAGE_SEQUENCE_NUMBER_MAX;
+
+    if (storage_sequence_compare(next, first) < 0 ||
+        storage_sequence_compare(next, end) > 0)
+    {
+        return first;
+    }
+
+    return next;
+}
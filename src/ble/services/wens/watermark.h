@@ -0,0 +1,60 @@
+/**
+ * @file
+ * @brief Sync watermark module
+ *
+ * This is a module for keeping track of how far each bonded phone has synced
+ * the ENS log. The watermark of a phone is the sequence number of the last
+ * record it has received without a gap since its previous sync. Records
+ * count as received once the link layer of the phone has acknowledged the
+ * notification holding them.
+ *
+ * The watermarks are kept in the settings storage, so a phone that
+ * disconnects in the middle of a report resumes where it stopped, and a
+ * routine sync only transfers what is new.
+ */
+
+#ifndef WATERMARK_H
+#define WATERMARK_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Function for getting the index of the first record a peer has not
+ * received. A peer without a watermark has received nothing.
+ *
+ * @param conn The connection to the peer.
+ *
+ * @return uint32_t The index of the record.
+ */
+uint32_t watermark_next_index(struct bt_conn *conn);
+
+/**
+ * @brief Function for telling the module that a peer has received a run of
+ * records. The watermark moves forward if the run starts at or before the
+ * first record the peer has not received, so it never skips a gap. Only
+ * bonded peers have a watermark.
+ *
+ * @param conn The connection to the peer.
+ * @param first Sequence number of the first record of the run.
+ * @param last Sequence number of the last record of the run.
+ */
+void watermark_ack(struct bt_conn *conn, uint32_t first, uint32_t last);
+
+/**
+ * @brief Function for storing the watermarks that have moved. The settings
+ * are written in the background, as low priority work.
+ */
+void watermark_store(void);
+
+#endif // WATERMARK_H
@@ -3,7 +3,16 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "wens.h"
+#include "bulk.h"
+#include "indication.h"
+#include "racp.h"
+#include "../../adv_policy.h"
+#include "../../connection.h"
+#include "../../radio.h"
 #include "../../uuid.h"
+#include "../../../gaens/exposure.h"
+#include "../../../gaens/rpi_filter.h"
+#include "../../../records/storage.h"
 #include <stdint.h>
 
 /* Zephyr includes */
@@ -12,6 +21,7 @@
 #include <bluetooth/uuid.h>
 
 #include <logging/log.h>
+#include <sys/byteorder.h>
 #include <zephyr.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -21,20 +31,21 @@
 #define LOG_MODULE_NAME wens
 LOG_MODULE_REGISTER(wens);
 
+#define MATCH_NOTIFICATIONS_IN_FLIGHT 4 // Notifications handed to the stack
+
+#define MATCH_RETRY_DELAY 10  // Time to wait for a notification to be sent (ms)
+#define MATCH_RETRY_MAX   100 // Retries before a notification is given up
+
+#define ENS_SETTINGS_LENGTH 14 // Length of the ENS Settings value (bytes)
+
+#define WEN_STATUS_MAX_SYNC_WINDOWS 4 // Sync windows that fit in a command
+#define SYNC_WINDOW_LENGTH          4 // Length of a sync window (bytes)
+#define SECONDS_PER_MINUTE          60
+
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-/* This enum contains the different values the segmentation field in the
-ens_log_t can take. This is defined in Table 4.7 in the WENS documentation. */
-typedef enum
-{
-    SEGMENTATION_COMPLETE,
-    SEGMENTATION_FIRST,
-    SEGMENTATION_CONTINUATION,
-    SEGMENTATION_LAST
-} segmentation_t;
-
 /* This struct is made up of the fields in the Temporary Key List 
 characteristic defined in Table 4.14 in the WENS documentation. */
 typedef struct
@@ -43,22 +54,20 @@ typedef struct
     uint8_t temporary_key[16];
 } temp_key_list_t;
 
-/* This enum is constructed of the opcodes for the RACP characteristic 
-from Table 4.19 and 4.20 */
-typedef enum
-{
-    REPORT_STORED_RECORDS,
-    DELETE_STORED_RECORDS,
-    ABORT_OPERATION,
-    REPORT_NUMBER_OF_STORED_RECORDS,
-    REPORT_NUMBER_OF_STORED_RECORDS_RESPONSE,
-    RACP_RESPONSE_CODE,
-    COMBINED_REPORT,
-    COMBINED_REPORT_RESPONSE
-} racp_opcode_t;
-
 /* This enum is constructed of the opcodes for the WEN Status characteristic 
-from Table 4.24 */
+from Table 4.24. BULK_CHANNEL and the ADV opcodes are not part of the WENS
+documentation, and their fields are little endian. BULK_CHANNEL is answered
+with the PSM of the bulk channel (2 bytes) and the throughput of the last long
+report over GATT and over the bulk channel (4 bytes each, in bytes/s),
+following the response code. ADV_MODE is followed by an
+adv_policy_wens_mode_t. ADV_SYNC_WINDOWS is followed by up to
+WEN_STATUS_MAX_SYNC_WINDOWS sync windows, each a start and a duration in
+minutes (2 bytes each). ADV_COUNTERS is answered with the number of WENS
+windows opened, the time WENS has advertised and the time it did not (in
+seconds), and the radio time saved (in ms), 4 bytes each. RADIO_STATUS is
+answered with the radio time in use (per mille, 2 bytes), the estimated
+collisions and preemptions and the deferred work (4 bytes each), and the
+shortest gap scanning yields to (in ms, 2 bytes). */
 typedef enum
 {
     // RFU = 0X00,
@@ -66,7 +75,12 @@ typedef enum
     RESUME_ENS,
     CLEAR_ALL_ENS_DATA,
     CLEAR_ENS_ADV_LIST,
-    // RFU = 0x05-0x1F
+    BULK_CHANNEL,
+    ADV_MODE,
+    ADV_SYNC_WINDOWS,
+    ADV_COUNTERS,
+    RADIO_STATUS,
+    // RFU = 0x0A-0x1F
     WEN_STATUS_RESPONSE_CODE = 0X20
     // RFU = 0x21-0xFF
 } wen_status_opcode_t;
@@ -82,37 +96,76 @@ typedef enum
     // RFU = 0X04-0XFF
 } response_code_t;
 
+/* This enum is constructed of the opcodes for the Diagnosis Keys
+characteristic. DATA is followed by one or more diagnosis keys. */
+typedef enum
+{
+    DIAGNOSIS_KEYS_BEGIN = 0x01,
+    DIAGNOSIS_KEYS_DATA,
+    DIAGNOSIS_KEYS_END
+} diagnosis_keys_opcode_t;
+
+/* This enum is constructed of the opcodes for the RPI Filter characteristic.
+BEGIN is followed by the filter header and DATA by a filter chunk. */
+typedef enum
+{
+    RPI_FILTER_BEGIN = 0x01,
+    RPI_FILTER_DATA,
+    RPI_FILTER_ABORT
+} rpi_filter_opcode_t;
+
+/* This enum contains the kinds of checks a peer can run. Only one check can
+run at a time, as they share the Exposure Match notifications. */
+typedef enum
+{
+    MATCH_EXPOSURE,
+    MATCH_RPI_FILTER
+} match_kind_t;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private variables
 ////////////////////////////////////////////////////////////////////////////////
 
-static ens_log_t records = {0};
-
 static wen_features_t wen_features = {
     .wen_features = {.multiple_bonds_supported = 0x1,
                      .self_pause_resume_supported = 0x1,
                      .self_generation_of_temp_keys = 0x1,
                      .rfu = 0x00},
-    .storage_capacity = 0x014D};
+    .storage_capacity = 0x0000}; // Filled in when read
 
 static ens_identifier_t ens_identifier = {.uuid = 0xFDF6, .version = "v1.2"};
 
-static ens_settings_t ens_settings = {.data_retention = 0x0E,
-                                      .temp_key_length = 0x10,
-                                      .max_key_duration = 0x540,
-                                      .ens_adv_length = 0x1D,
-                                      .max_adv_duration = 0x0A,
-                                      .scan_on_time = 0x04,
-                                      .scan_off_time = 0x3C,
-                                      .min_adv_interval = 0x0140,
-                                      .max_adv_interval = 0x01B0,
-                                      .self_pause_resume = 0x00};
+static ens_settings_t ens_settings = {
+    .data_retention = STORAGE_RETENTION_DEFAULT,
+    .temp_key_length = 0x10,
+    .max_key_duration = 0x540,
+    .ens_adv_length = 0x1D,
+    .max_adv_duration = 0x0A,
+    .scan_on_time = 0x04,
+    .scan_off_time = 0x3C,
+    .min_adv_interval = 0x0140,
+    .max_adv_interval = 0x01B0,
+    .self_pause_resume = 0x00};
 
 static temp_key_list_t temp_key_list = {.timestamp = 0x43421277,
                                         .temporary_key = {}};
 
 static wen_status_t wen_status = {.opcode = 0x00, .parameter = {}};
 
+/* The peer that started the exposure check or RPI filter check in progress.
+The Exposure Match notifications are sent to it alone. */
+static struct bt_conn *match_conn = NULL;
+static match_kind_t match_kind = MATCH_EXPOSURE;
+K_MUTEX_DEFINE(_match_mutex);
+
+/* The peer whose Clear All ENS Data request is run by _clear_work */
+static struct bt_conn *clear_conn = NULL;
+K_MUTEX_DEFINE(_clear_mutex);
+
+/* Exposure Match notifications that can be handed to the stack */
+K_SEM_DEFINE(_match_credits, MATCH_NOTIFICATIONS_IN_FLIGHT,
+             MATCH_NOTIFICATIONS_IN_FLIGHT);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -153,10 +206,47 @@ static ssize_t _write_wen_status(struct bt_conn *conn,
                                  const void *buf, uint16_t len, uint16_t offset,
                                  uint8_t flags);
 
-static void _indicate_cb(struct bt_conn *conn,
-                         struct bt_gatt_indicate_params *params, uint8_t err);
+static ssize_t _write_diagnosis_keys(struct bt_conn *conn,
+                                     const struct bt_gatt_attr *attr,
+                                     const void *buf, uint16_t len,
+                                     uint16_t offset, uint8_t flags);
+
+static ssize_t _write_rpi_filter(struct bt_conn *conn,
+                                 const struct bt_gatt_attr *attr,
+                                 const void *buf, uint16_t len, uint16_t offset,
+                                 uint8_t flags);
+
+static int _claim_match(struct bt_conn *conn, match_kind_t kind);
+
+static int _holds_match(struct bt_conn *conn, match_kind_t kind);
+
+static void _release_match(struct bt_conn *conn);
+
+static void _match_sent_cb(struct bt_conn *conn, void *user_data);
+
+static void _respond_bulk_channel(struct bt_conn *conn);
 
-static void _indicate_destroy_cb(struct bt_gatt_indicate_params *params);
+static void _clear_all_ens_data(struct bt_conn *conn);
+
+static void _clear_handler(struct k_work *unused);
+K_WORK_DEFINE(_clear_work, _clear_handler);
+
+static void _set_adv_mode(struct bt_conn *conn, const uint8_t *data,
+                          uint16_t len);
+
+static void _set_sync_windows(struct bt_conn *conn, const uint8_t *data,
+                              uint16_t len);
+
+static void _respond_adv_counters(struct bt_conn *conn);
+
+static void _respond_radio_status(struct bt_conn *conn);
+
+static void _respond_status(struct bt_conn *conn, uint8_t opcode,
+                            uint8_t result);
+
+static void _pack_ens_settings(const ens_settings_t *settings, uint8_t *buf);
+
+static void _unpack_ens_settings(const uint8_t *buf, ens_settings_t *settings);
 
 static void _notify_ccc_cfg_changed(const struct bt_gatt_attr *attr,
                                     uint16_t value);
@@ -171,7 +261,7 @@ static void _indicate_ccc_cfg_changed(const struct bt_gatt_attr *attr,
 BT_GATT_SERVICE_DEFINE(
     wens_svc, BT_GATT_PRIMARY_SERVICE(BT_UUID_WENS),
     BT_GATT_CHARACTERISTIC(BT_UUID_ENS_LOG, BT_GATT_CHRC_NOTIFY,
-                           BT_GATT_PERM_NONE, NULL, NULL, &records),
+                           BT_GATT_PERM_NONE, NULL, NULL, NULL),
     BT_GATT_CCC(_notify_ccc_cfg_changed,
                 BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
     BT_GATT_CHARACTERISTIC(BT_UUID_WEN_FEATURES,
@@ -209,7 +299,16 @@ BT_GATT_SERVICE_DEFINE(
                            BT_GATT_PERM_WRITE, NULL, _write_wen_status,
                            &wen_status),
     BT_GATT_CCC(_indicate_ccc_cfg_changed,
-                BT_GATT_PERM_READ | BT_GATT_PERM_WRITE));
+                BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DIAGNOSIS_KEYS, BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_WRITE, NULL, _write_diagnosis_keys,
+                           NULL),
+    BT_GATT_CHARACTERISTIC(BT_UUID_EXPOSURE_MATCH, BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_NONE, NULL, NULL, NULL),
+    BT_GATT_CCC(_notify_ccc_cfg_changed,
+                BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(BT_UUID_RPI_FILTER, BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_WRITE, NULL, _write_rpi_filter, NULL));
 
 ////////////////////////////////////////////////////////////////////////////////
 // Public functions
@@ -221,90 +320,160 @@ int wens_get_ens_settings(ens_settings_t *settings)
     return 0;
 }
 
-int wens_ens_log_notify(ens_log_t record)
+int wens_ens_log_notify(struct bt_conn *conn, const uint8_t *data,
+                        uint16_t len, bt_gatt_complete_func_t func,
+                        void *user_data)
 {
-    LOG_INF("Notifying ENS Record");
+    struct bt_gatt_notify_params params = {0};
+
+    if (!wens_ens_log_subscribed(conn))
+    {
+        return -EINVAL;
+    }
+
+    connection_activity(conn, len);
 
-    records = record;
+    // The stack copies the data, so the parameters can live on the stack
+    params.attr = &wens_svc.attrs[2];
+    params.data = data;
+    params.len = len;
+    params.func = func;
+    params.user_data = user_data;
 
-    return bt_gatt_notify(NULL, &wens_svc.attrs[2], &record, sizeof(record));
+    return bt_gatt_notify_cb(conn, &params);
 }
 
-int wens_features_indicate(wen_features_t features)
+bool wens_ens_log_subscribed(struct bt_conn *conn)
 {
-    LOG_INF("Indicating WEN Features Characteristic");
+    return bt_gatt_is_subscribed(conn, &wens_svc.attrs[2],
+                                 BT_GATT_CCC_NOTIFY);
+}
 
-    struct bt_gatt_indicate_params ind_params;
+void wens_ens_log_added(void) { racp_live_update(); }
 
-    ind_params.attr = &wens_svc.attrs[4];
-    ind_params.func = _indicate_cb;
-    ind_params.destroy = _indicate_destroy_cb;
-    ind_params.data = &features;
-    ind_params.len = sizeof(features);
+int wens_features_indicate(struct bt_conn *conn, wen_features_t features)
+{
+    LOG_INF("Indicating WEN Features Characteristic");
 
-    return bt_gatt_indicate(NULL, &ind_params);
+    return indication_send(conn, &wens_svc.attrs[5], &features,
+                           sizeof(features));
 }
 
-int wens_ens_identifier_indicate(ens_identifier_t identifier)
+int wens_ens_identifier_indicate(struct bt_conn *conn,
+                                 ens_identifier_t identifier)
 {
     LOG_INF("Indicating ENS Identifier Characteristic");
 
-    struct bt_gatt_indicate_params ind_params;
-
-    ind_params.attr = &wens_svc.attrs[6];
-    ind_params.func = _indicate_cb;
-    ind_params.destroy = _indicate_destroy_cb;
-    ind_params.data = &identifier;
-    ind_params.len = sizeof(identifier);
-
-    return bt_gatt_indicate(NULL, &ind_params);
+    return indication_send(conn, &wens_svc.attrs[8], &identifier,
+                           sizeof(identifier));
 }
 
-int wens_ens_settings_indicate(ens_settings_t settings)
+int wens_ens_settings_indicate(struct bt_conn *conn, ens_settings_t settings)
 {
     LOG_INF("Indicating ENS Settings Characteristic");
 
-    struct bt_gatt_indicate_params ind_params;
-
-    ind_params.attr = &wens_svc.attrs[8];
-    ind_params.func = _indicate_cb;
-    ind_params.destroy = _indicate_destroy_cb;
-    ind_params.data = &settings;
-    ind_params.len = sizeof(settings);
+    uint8_t value[ENS_SETTINGS_LENGTH];
 
     ens_settings = settings;
+    _pack_ens_settings(&settings, value);
 
-    return bt_gatt_indicate(NULL, &ind_params);
+    return indication_send(conn, &wens_svc.attrs[11], value, sizeof(value));
 }
 
-int wens_racp_indicate(uint8_t data)
+int wens_racp_indicate(struct bt_conn *conn, const uint8_t *data,
+                       uint16_t len)
 {
     LOG_INF("Indicating RACP Characteristic");
 
-    struct bt_gatt_indicate_params ind_params;
+    return indication_send(conn, &wens_svc.attrs[16], data, len);
+}
 
-    ind_params.attr = &wens_svc.attrs[11];
-    ind_params.func = _indicate_cb;
-    ind_params.destroy = _indicate_destroy_cb;
-    ind_params.data = &data;
-    ind_params.len = sizeof(data);
+int wens_status_indicate(struct bt_conn *conn, wen_status_t status)
+{
+    LOG_INF("Indicating ENS Status Characteristic");
 
-    return bt_gatt_indicate(NULL, &ind_params);
+    return indication_send(conn, &wens_svc.attrs[19], &status,
+                           sizeof(status));
 }
 
-int wens_status_indicate(wen_status_t status)
+int wens_exposure_match_notify(const uint8_t *data, uint16_t len)
 {
-    LOG_INF("Indicating ENS Status Characteristic");
+    struct bt_gatt_notify_params params = {0};
+    struct bt_conn *conn;
+    int err = -ENOMEM;
 
-    struct bt_gatt_indicate_params ind_params;
+    k_mutex_lock(&_match_mutex, K_FOREVER);
+    conn = match_conn ? bt_conn_ref(match_conn) : NULL;
+    k_mutex_unlock(&_match_mutex);
 
-    ind_params.attr = &wens_svc.attrs[13];
-    ind_params.func = _indicate_cb;
-    ind_params.destroy = _indicate_destroy_cb;
-    ind_params.data = &status;
-    ind_params.len = sizeof(status);
+    // The peer that started the check is gone
+    if (!conn)
+    {
+        return -ENOTCONN;
+    }
+
+    // The stack copies the data, so the parameters can live on the stack
+    params.attr = &wens_svc.attrs[24];
+    params.data = data;
+    params.len = len;
+    params.func = _match_sent_cb;
 
-    return bt_gatt_indicate(NULL, &ind_params);
+    for (int retry = 0; err == -ENOMEM && retry < MATCH_RETRY_MAX; retry++)
+    {
+        // Stop waiting once the peer has disconnected
+        if (match_conn != conn)
+        {
+            err = -ENOTCONN;
+            break;
+        }
+
+        if (k_sem_take(&_match_credits, K_MSEC(MATCH_RETRY_DELAY)) < 0)
+        {
+            continue;
+        }
+
+        connection_activity(conn, len);
+
+        err = bt_gatt_notify_cb(conn, &params);
+        if (err < 0)
+        {
+            k_sem_give(&_match_credits);
+        }
+
+        if (err == -ENOMEM)
+        {
+            k_sleep(K_MSEC(MATCH_RETRY_DELAY));
+        }
+    }
+
+    if (data[0] == EXPOSURE_MATCH_COMPLETE)
+    {
+        _release_match(conn);
+    }
+
+    bt_conn_unref(conn);
+
+    return err;
+}
+
+void wens_disconnected(struct bt_conn *conn)
+{
+    k_mutex_lock(&_match_mutex, K_FOREVER);
+
+    // Nobody is left to send the rest of the keys or the filter, or to
+    // receive the result
+    if (conn == match_conn)
+    {
+        exposure_abort();
+        rpi_filter_abort();
+    }
+
+    k_mutex_unlock(&_match_mutex);
+
+    _release_match(conn);
+
+    racp_disconnected(conn);
+    indication_disconnected(conn);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -329,6 +498,8 @@ static ssize_t _read_wen_features(struct bt_conn *conn,
 {
     LOG_INF("Reading WEN Features characteristic");
 
+    wen_features.storage_capacity = MIN(storage_get_free_count(), UINT16_MAX);
+
     return bt_gatt_attr_read(conn, attr, buf, len, offset, &wen_features,
                              sizeof(wen_features));
 }
@@ -371,10 +542,14 @@ static ssize_t _read_ens_settings(struct bt_conn *conn,
                                   const struct bt_gatt_attr *attr, void *buf,
                                   uint16_t len, uint16_t offset)
 {
+    uint8_t value[ENS_SETTINGS_LENGTH];
+
     LOG_INF("Reading ENS settings characteristic");
 
-    return bt_gatt_attr_read(conn, attr, buf, len, offset, &ens_settings,
-                             sizeof(ens_settings));
+    _pack_ens_settings(&ens_settings, value);
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, value,
+                             sizeof(value));
 }
 
 /**
@@ -397,14 +572,20 @@ static ssize_t _write_ens_settings(struct bt_conn *conn,
 {
     LOG_INF("Writing ENS settings characteristic");
 
-    if (len > sizeof(ens_settings))
+    if (offset != 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    if (len != ENS_SETTINGS_LENGTH)
     {
         return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
     }
 
-    memcpy(&ens_settings, buf, len);
+    _unpack_ens_settings(buf, &ens_settings);
 
-    // Update settings function call here
+    storage_set_retention(ens_settings.data_retention);
+    adv_policy_update();
 
     return len;
 }
@@ -478,8 +659,48 @@ static ssize_t _write_racp(struct bt_conn *conn,
                            const struct bt_gatt_attr *attr, const void *buf,
                            uint16_t len, uint16_t offset, uint8_t flags)
 {
+    int err = 0;
+
     LOG_INF("Writing RACP characteristic");
 
+    if (offset != 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    // Records are reported on the ENS Log and the result on the RACP
+    if (!bt_gatt_is_subscribed(conn, &wens_svc.attrs[2], BT_GATT_CCC_NOTIFY) ||
+        !bt_gatt_is_subscribed(conn, &wens_svc.attrs[16],
+                               BT_GATT_CCC_INDICATE))
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_CCC_IMPROPER_CONF);
+    }
+
+    // Deleting would move the indices of a report or a check in progress
+    if (len > 0 && *(const uint8_t *)buf == RACP_DELETE_STORED_RECORDS &&
+        storage_is_held())
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_PROCEDURE_IN_PROGRESS);
+    }
+
+    err = racp_request(conn, buf, len);
+    if (err == -EBUSY)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_PROCEDURE_IN_PROGRESS);
+    }
+    else if (err == -EINVAL)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+    else if (err == -ENOMEM)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+    else if (err < 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
     return len;
 }
 
@@ -510,30 +731,579 @@ static ssize_t _write_wen_status(struct bt_conn *conn,
 
     memcpy(&wen_status, buf, len);
 
+    if (len > 0 && wen_status.opcode == BULK_CHANNEL)
+    {
+        _respond_bulk_channel(conn);
+    }
+    else if (len > 0 && wen_status.opcode == CLEAR_ALL_ENS_DATA)
+    {
+        _clear_all_ens_data(conn);
+    }
+    else if (len > 0 && wen_status.opcode == ADV_MODE)
+    {
+        _set_adv_mode(conn, wen_status.parameter, len - 1);
+    }
+    else if (len > 0 && wen_status.opcode == ADV_SYNC_WINDOWS)
+    {
+        _set_sync_windows(conn, wen_status.parameter, len - 1);
+    }
+    else if (len > 0 && wen_status.opcode == ADV_COUNTERS)
+    {
+        _respond_adv_counters(conn);
+    }
+    else if (len > 0 && wen_status.opcode == RADIO_STATUS)
+    {
+        _respond_radio_status(conn);
+    }
+
+    // Keep advertising for a while, so the phone can connect again to follow
+    // up on the command
+    adv_policy_open_window(ADV_POLICY_COMMAND_WINDOW);
+
     return len;
 }
 
 /**
- * @brief Indication callback function.
+ * @brief Diagnosis keys write callback function. Keys that do not fit in the
+ * queue are rejected with Insufficient Resources, and should be written again
+ * once the device has caught up. So are keys from a peer while another peer
+ * is running a check, and a BEGIN while an RPI filter check is running.
  * 
- * @param conn Connection object.
- * @param params Indication params object.
- * @param err ATT error code.
+ * @param conn   The connection that is requesting to write.
+ * @param attr   The attribute that's being written.
+ * @param buf    Buffer with the data to write.
+ * @param len    Number of bytes in the buffer.
+ * @param offset Offset to start writing from.
+ * @param flags  Flags (BT_GATT_WRITE_*).
+ * 
+ * @return ssize_t Number of bytes written, or in case of an error
+ *                 BT_GATT_ERR() with a specific ATT error code.
+ */
+static ssize_t _write_diagnosis_keys(struct bt_conn *conn,
+                                     const struct bt_gatt_attr *attr,
+                                     const void *buf, uint16_t len,
+                                     uint16_t offset, uint8_t flags)
+{
+    const uint8_t *data = buf;
+    int claimed;
+    int err;
+
+    if (offset != 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    if (len < 1)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    if (data[0] != DIAGNOSIS_KEYS_BEGIN && data[0] != DIAGNOSIS_KEYS_DATA &&
+        data[0] != DIAGNOSIS_KEYS_END)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    connection_activity(conn, len);
+
+    if (data[0] == DIAGNOSIS_KEYS_BEGIN)
+    {
+        // The peer only becomes the receiver once its check has started
+        claimed = _claim_match(conn, MATCH_EXPOSURE);
+        err = claimed < 0 ? claimed : exposure_begin();
+
+        if (err < 0 && claimed > 0)
+        {
+            _release_match(conn);
+        }
+    }
+    else
+    {
+        err = _holds_match(conn, MATCH_EXPOSURE);
+        if (err == 0)
+        {
+            err = data[0] == DIAGNOSIS_KEYS_DATA
+                      ? exposure_add_keys(&data[1], len - 1)
+                      : exposure_end();
+
+            // The check can not go on, so it is dropped and the peer has to
+            // start again. Keys that did not fit are written again.
+            if (err < 0 && err != -ENOMEM)
+            {
+                exposure_abort();
+                _release_match(conn);
+            }
+        }
+    }
+
+    if (err == -ENOMEM || err == -EBUSY)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+    else if (err < 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    return len;
+}
+
+/**
+ * @brief RPI filter write callback function. A chunk that arrives while the
+ * previous partition is being checked is rejected with Insufficient
+ * Resources, and should be written again. So is a chunk from a peer while
+ * another peer is running a check, and a BEGIN while an exposure check is
+ * running.
+ * 
+ * @param conn   The connection that is requesting to write.
+ * @param attr   The attribute that's being written.
+ * @param buf    Buffer with the data to write.
+ * @param len    Number of bytes in the buffer.
+ * @param offset Offset to start writing from.
+ * @param flags  Flags (BT_GATT_WRITE_*).
+ * 
+ * @return ssize_t Number of bytes written, or in case of an error
+ *                 BT_GATT_ERR() with a specific ATT error code.
+ */
+static ssize_t _write_rpi_filter(struct bt_conn *conn,
+                                 const struct bt_gatt_attr *attr,
+                                 const void *buf, uint16_t len, uint16_t offset,
+                                 uint8_t flags)
+{
+    const uint8_t *data = buf;
+    int claimed;
+    int err = 0;
+
+    if (offset != 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    if (len < 1)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    connection_activity(conn, len);
+
+    switch (data[0])
+    {
+    case RPI_FILTER_BEGIN:
+        // The peer only becomes the receiver once its check has started
+        claimed = _claim_match(conn, MATCH_RPI_FILTER);
+        err = claimed < 0 ? claimed : rpi_filter_begin(&data[1], len - 1);
+
+        if (err < 0 && claimed > 0)
+        {
+            _release_match(conn);
+        }
+        break;
+    case RPI_FILTER_DATA:
+        err = _holds_match(conn, MATCH_RPI_FILTER);
+        if (err == 0)
+        {
+            err = rpi_filter_add(&data[1], len - 1);
+
+            // A chunk out of order can not be checked, so the check is
+            // dropped and the peer has to start again
+            if (err < 0 && err != -EBUSY)
+            {
+                rpi_filter_abort();
+                _release_match(conn);
+            }
+        }
+        break;
+    case RPI_FILTER_ABORT:
+        if (_holds_match(conn, MATCH_RPI_FILTER) == 0)
+        {
+            rpi_filter_abort();
+            _release_match(conn);
+        }
+        break;
+    default:
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    if (err == -EBUSY)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+    else if (err == -ENOTSUP)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_NOT_SUPPORTED);
+    }
+    else if (err < 0)
+    {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    return len;
+}
+
+/**
+ * @brief Function for making a peer the receiver of the Exposure Match
+ * notifications. Only one check can run at a time.
+ * 
+ * @param conn The peer starting a check.
+ * @param kind The kind of check.
+ * 
+ * @return int 1 if the peer has become the receiver, 0 if it already was for
+ * this kind of check, or -EBUSY if another check is running.
+ */
+static int _claim_match(struct bt_conn *conn, match_kind_t kind)
+{
+    int err = 0;
+
+    k_mutex_lock(&_match_mutex, K_FOREVER);
+
+    if (!match_conn)
+    {
+        match_conn = bt_conn_ref(conn);
+        match_kind = kind;
+        err = 1;
+
+        // Notifications lost with an earlier peer never give their credit
+        k_sem_init(&_match_credits, MATCH_NOTIFICATIONS_IN_FLIGHT,
+                   MATCH_NOTIFICATIONS_IN_FLIGHT);
+    }
+    else if (match_conn != conn || match_kind != kind)
+    {
+        err = -EBUSY;
+    }
+
+    k_mutex_unlock(&_match_mutex);
+
+    return err;
+}
+
+/**
+ * @brief Function for checking if a peer is the receiver of the Exposure
+ * Match notifications, so it can continue its check.
+ * 
+ * @param conn The peer continuing a check.
+ * @param kind The kind of check.
+ * 
+ * @return int 0 if it is, -EBUSY if another peer is running a check, or
+ * -EINVAL if the peer has not started this kind of check.
+ */
+static int _holds_match(struct bt_conn *conn, match_kind_t kind)
+{
+    int err;
+
+    k_mutex_lock(&_match_mutex, K_FOREVER);
+
+    if (match_conn == conn && match_kind == kind)
+    {
+        err = 0;
+    }
+    else
+    {
+        err = match_conn && match_conn != conn ? -EBUSY : -EINVAL;
+    }
+
+    k_mutex_unlock(&_match_mutex);
+
+    return err;
+}
+
+/**
+ * @brief Function for letting go of the receiver of the Exposure Match
+ * notifications, once its check is done or it has disconnected.
+ * 
+ * @param conn The peer.
+ */
+static void _release_match(struct bt_conn *conn)
+{
+    k_mutex_lock(&_match_mutex, K_FOREVER);
+
+    if (match_conn == conn)
+    {
+        bt_conn_unref(match_conn);
+        match_conn = NULL;
+    }
+
+    k_mutex_unlock(&_match_mutex);
+}
+
+/**
+ * @brief Callback handing back the credit of an Exposure Match notification
+ * once it has been sent.
+ * 
+ * @param conn The peer.
+ * @param user_data Not in use.
+ */
+static void _match_sent_cb(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&_match_credits);
+}
+
+/**
+ * @brief Function for answering a request for the bulk channel with its PSM
+ * and the throughput of the reports to the peer, so the peer can pick the
+ * faster transport.
+ * 
+ * @param conn The connection that wrote the request.
+ */
+static void _respond_bulk_channel(struct bt_conn *conn)
+{
+    wen_status_t response = {.opcode = WEN_STATUS_RESPONSE_CODE};
+    racp_throughput_t throughput;
+    int err;
+
+    racp_get_throughput(conn, &throughput);
+
+    response.parameter[0] = BULK_CHANNEL;
+    response.parameter[1] = SUCCESS;
+    sys_put_le16(BULK_PSM, &response.parameter[2]);
+    sys_put_le32(throughput.gatt, &response.parameter[4]);
+    sys_put_le32(throughput.bulk, &response.parameter[8]);
+
+    err = wens_status_indicate(conn, response);
+    if (err)
+    {
+        LOG_WRN("Failed to indicate bulk channel (err %d)", err);
+    }
+}
+
+/**
+ * @brief Function for clearing the ENS log on request of a peer. Clearing
+ * the log stores its new start in the settings, so it is done from the system
+ * work queue and not in the write callback. The peer gets the response once
+ * the log is cleared, and the log is erased in the background.
+ * 
+ * @param conn The connection that wrote the request.
+ */
+static void _clear_all_ens_data(struct bt_conn *conn)
+{
+    bool pending;
+
+    k_mutex_lock(&_clear_mutex, K_FOREVER);
+
+    pending = clear_conn != NULL;
+    if (!pending)
+    {
+        clear_conn = bt_conn_ref(conn);
+    }
+
+    k_mutex_unlock(&_clear_mutex);
+
+    // Another peer is clearing the log, queueing the response is all that is
+    // done here
+    if (pending)
+    {
+        _respond_status(conn, CLEAR_ALL_ENS_DATA, OPERATION_FAILED);
+        return;
+    }
+
+    k_work_submit(&_clear_work);
+}
+
+/**
+ * @brief Work handler clearing the ENS log, and responding to the peer that
+ * requested it. The log is not cleared while a report or a check is in
+ * progress, and the peer gets Operation Failed.
+ * 
+ * @param unused Not in use, but required.
+ */
+static void _clear_handler(struct k_work *unused)
+{
+    struct bt_conn *conn;
+    uint8_t result;
+
+    result = storage_delete_all() == 0 ? SUCCESS : OPERATION_FAILED;
+
+    k_mutex_lock(&_clear_mutex, K_FOREVER);
+    conn = clear_conn;
+    clear_conn = NULL;
+    k_mutex_unlock(&_clear_mutex);
+
+    _respond_status(conn, CLEAR_ALL_ENS_DATA, result);
+    bt_conn_unref(conn);
+}
+
+/**
+ * @brief Function for setting the mode of WENS connectable advertising on
+ * request of a peer.
+ * 
+ * @param conn The connection that wrote the request.
+ * @param data The operand of the request.
+ * @param len Length of the operand.
  */
-static void _indicate_cb(struct bt_conn *conn,
-                         struct bt_gatt_indicate_params *params, uint8_t err)
+static void _set_adv_mode(struct bt_conn *conn, const uint8_t *data,
+                          uint16_t len)
 {
-    LOG_INF("Indication %s\n", err != 0U ? "fail" : "success");
+    if (len != 1 || data[0] > ADV_POLICY_WENS_ON_DEMAND)
+    {
+        _respond_status(conn, ADV_MODE, INVALID_OPERAND);
+        return;
+    }
+
+    adv_policy_set_wens_mode(data[0]);
+    _respond_status(conn, ADV_MODE, SUCCESS);
 }
 
 /**
- * @brief Indication destroy callback function.
+ * @brief Function for setting the sync windows of on-demand advertising on
+ * request of a peer. No windows leaves only the windows opened on demand.
  * 
- * @param params Indication params object.
+ * @param conn The connection that wrote the request.
+ * @param data The operand of the request.
+ * @param len Length of the operand.
  */
-static void _indicate_destroy_cb(struct bt_gatt_indicate_params *params)
+static void _set_sync_windows(struct bt_conn *conn, const uint8_t *data,
+                              uint16_t len)
 {
-    LOG_INF("Indication complete\n");
+    adv_policy_window_t windows[WEN_STATUS_MAX_SYNC_WINDOWS];
+    size_t count = len / SYNC_WINDOW_LENGTH;
+
+    if (len % SYNC_WINDOW_LENGTH != 0 || count > ARRAY_SIZE(windows))
+    {
+        _respond_status(conn, ADV_SYNC_WINDOWS, INVALID_OPERAND);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *window = &data[i * SYNC_WINDOW_LENGTH];
+
+        windows[i].start = sys_get_le16(&window[0]) * SECONDS_PER_MINUTE;
+        windows[i].duration = sys_get_le16(&window[2]) * SECONDS_PER_MINUTE;
+    }
+
+    if (adv_policy_set_sync_windows(windows, count) < 0)
+    {
+        _respond_status(conn, ADV_SYNC_WINDOWS, INVALID_OPERAND);
+        return;
+    }
+
+    _respond_status(conn, ADV_SYNC_WINDOWS, SUCCESS);
+}
+
+/**
+ * @brief Function for answering a request for the counters of the
+ * advertising policy, so the phone can show what on-demand advertising saves.
+ * 
+ * @param conn The connection that wrote the request.
+ */
+static void _respond_adv_counters(struct bt_conn *conn)
+{
+    wen_status_t response = {.opcode = WEN_STATUS_RESPONSE_CODE};
+    adv_policy_counters_t counters;
+    int err;
+
+    adv_policy_get_counters(&counters);
+
+    response.parameter[0] = ADV_COUNTERS;
+    response.parameter[1] = SUCCESS;
+    sys_put_le32(counters.wens_windows, &response.parameter[2]);
+    sys_put_le32(counters.wens_time, &response.parameter[6]);
+    sys_put_le32(counters.saved_time, &response.parameter[10]);
+    sys_put_le32(counters.saved_radio_time_ms, &response.parameter[14]);
+
+    err = wens_status_indicate(conn, response);
+    if (err)
+    {
+        LOG_WRN("Failed to indicate advertising counters (err %d)", err);
+    }
+}
+
+/**
+ * @brief Function for answering a request for the radio timeline and the
+ * radio counters, so the sharing of the radio can be followed in the field.
+ * 
+ * @param conn The connection that wrote the request.
+ */
+static void _respond_radio_status(struct bt_conn *conn)
+{
+    wen_status_t response = {.opcode = WEN_STATUS_RESPONSE_CODE};
+    radio_schedule_t schedule;
+    radio_estimates_t estimates;
+    int err;
+
+    radio_get_schedule(&schedule);
+    radio_get_estimates(&estimates);
+
+    response.parameter[0] = RADIO_STATUS;
+    response.parameter[1] = SUCCESS;
+    sys_put_le16(schedule.busy, &response.parameter[2]);
+    sys_put_le32(estimates.est_collisions, &response.parameter[4]);
+    sys_put_le32(estimates.est_preemptions, &response.parameter[8]);
+    sys_put_le32(estimates.deferred, &response.parameter[12]);
+    sys_put_le16(MIN(schedule.gap / USEC_PER_MSEC, UINT16_MAX),
+                 &response.parameter[16]);
+
+    err = wens_status_indicate(conn, response);
+    if (err)
+    {
+        LOG_WRN("Failed to indicate radio status (err %d)", err);
+    }
+}
+
+/**
+ * @brief Function for indicating the response to a WEN Status command that is
+ * answered with the response code alone.
+ * 
+ * @param conn The connection that wrote the request.
+ * @param opcode The opcode of the request.
+ * @param result The response code value.
+ */
+static void _respond_status(struct bt_conn *conn, uint8_t opcode,
+                            uint8_t result)
+{
+    wen_status_t response = {.opcode = WEN_STATUS_RESPONSE_CODE};
+    int err;
+
+    response.parameter[0] = opcode;
+    response.parameter[1] = result;
+
+    err = wens_status_indicate(conn, response);
+    if (err)
+    {
+        LOG_WRN("Failed to indicate WEN status response %u (err %d)", opcode,
+                err);
+    }
+}
+
+/**
+ * @brief Function for packing the ENS Settings into the characteristic value,
+ * in the order of Table 4.13 with the 16 bit fields little endian.
+ * 
+ * @param settings The ENS Settings.
+ * @param buf Buffer of ENS_SETTINGS_LENGTH bytes to pack the value into.
+ */
+static void _pack_ens_settings(const ens_settings_t *settings, uint8_t *buf)
+{
+    buf[0] = settings->data_retention;
+    buf[1] = settings->temp_key_length;
+    sys_put_le16(settings->max_key_duration, &buf[2]);
+    buf[4] = settings->ens_adv_length;
+    buf[5] = settings->max_adv_duration;
+    buf[6] = settings->scan_on_time;
+    sys_put_le16(settings->scan_off_time, &buf[7]);
+    sys_put_le16(settings->min_adv_interval, &buf[9]);
+    sys_put_le16(settings->max_adv_interval, &buf[11]);
+    buf[13] = settings->self_pause_resume;
+}
+
+/**
+ * @brief Function for unpacking the ENS Settings from the characteristic
+ * value, see _pack_ens_settings.
+ * 
+ * @param buf The value of ENS_SETTINGS_LENGTH bytes.
+ * @param settings The ENS Settings to fill in.
+ */
+static void _unpack_ens_settings(const uint8_t *buf, ens_settings_t *settings)
+{
+    settings->data_retention = buf[0];
+    settings->temp_key_length = buf[1];
+    settings->max_key_duration = sys_get_le16(&buf[2]);
+    settings->ens_adv_length = buf[4];
+    settings->max_adv_duration = buf[5];
+    settings->scan_on_time = buf[6];
+    settings->scan_off_time = sys_get_le16(&buf[7]);
+    settings->min_adv_interval = sys_get_le16(&buf[9]);
+    settings->max_adv_interval = sys_get_le16(&buf[11]);
+    settings->self_pause_resume = buf[13];
 }
 
 /**
@@ -550,6 +1320,9 @@ static void _notify_ccc_cfg_changed(const struct bt_gatt_attr *attr,
     bool notif_enabled = (value == BT_GATT_CCC_NOTIFY);
 
     LOG_INF("WENS Notifications %s", notif_enabled ? "enabled" : "disabled");
+
+    // The value is shared by all peers, so each peer is checked on its own
+    racp_live_update();
 }
 
 /**
@@ -13,11 +13,40 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "stdint.h"
+#include <stdbool.h>
+
+/* Zephyr includes */
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
 ////////////////////////////////////////////////////////////////////////////////
 
+/* This enum is constructed of the types of notifications on the Exposure Match
+characteristic. A match is followed by the sequence number (3 bytes), the
+timestamp (4 bytes) and the RSSI of the matching ENS log entry, and the
+decrypted associated encrypted metadata (4 bytes). A candidate from an RPI
+filter check is followed by the sequence number and the RPI of the ENS log
+entry, for the phone to confirm. A completion is followed by the number of
+matches or candidates (2 bytes, little endian) and an
+exposure_match_status_t. */
+typedef enum
+{
+    EXPOSURE_MATCH_FOUND = 0x01,
+    EXPOSURE_MATCH_COMPLETE,
+    EXPOSURE_MATCH_CANDIDATE
+} exposure_match_type_t;
+
+/* This enum contains the status of a completed check. A check that is
+incomplete has not been matched against every key or the whole ENS log, and
+the phone should run it again. */
+typedef enum
+{
+    EXPOSURE_MATCH_STATUS_SUCCESS,
+    EXPOSURE_MATCH_STATUS_INCOMPLETE
+} exposure_match_status_t;
+
 /* This struct makes up the 16 bits in the WEN features field from Table 4.10 
 in the WENS documentation. */
 typedef struct
@@ -33,7 +62,7 @@ characteristic defined in Table 4.9 in the WENS documentation. */
 typedef struct
 {
     features_t wen_features;
-    uint16_t storage_capacity;
+    uint16_t storage_capacity; // ENS log entries that can still be stored
 } wen_features_t;
 
 /* This struct is made up of the fields in the WEN Status characteristic
@@ -45,7 +74,8 @@ typedef struct
 } wen_status_t;
 
 /* This struct is made up of the fields in the ENS Settings 
-characteristic defined in Table 4.13 in the WENS documentation. */
+characteristic defined in Table 4.13 in the WENS documentation. The struct is
+padded, so the characteristic value is packed field by field. */
 typedef struct
 {
     uint8_t data_retention;
@@ -60,15 +90,6 @@ typedef struct
     uint8_t self_pause_resume;
 } ens_settings_t;
 
-/* This struct is made up of the fields in the ENS Log characteristic defined 
-in Table 4.6 in the WENS documentation. */
-typedef struct
-{
-    unsigned int segmentation : 2;
-    unsigned int flags : 6; // Reserved for future use
-    uint8_t *ens_payload;
-} ens_log_t;
-
 /* This struct is made up of the fields in the ENS Identifier characteristic
 defined in Table 4.11 in the WENS documentation. */
 typedef struct
@@ -84,11 +105,12 @@ typedef struct
 /**
  * @brief Function for indicating the WEN Feature characteristic.
  * 
+ * @param conn The peer to indicate to, or NULL for all subscribed peers.
  * @param data The data to indicate.
  * 
  * @return int Returns 0 on success, negative otherwise.
  */
-int wens_features_indicate(wen_features_t data);
+int wens_features_indicate(struct bt_conn *conn, wen_features_t data);
 
 /**
  * @brief Function for retreiving the ENS Settings.
@@ -102,49 +124,102 @@ int wens_get_ens_settings(ens_settings_t *settings);
 /**
  * @brief Function for notifying ENS records on the ENS Log characteristic.
  * 
- * @param record ENS record.
+ * @param conn The peer to notify.
+ * @param data The notification, see @c ens_log_encode.
+ * @param len Length of the notification.
+ * @param func Called once the notification is sent, so the caller can keep a
+ * number of notifications in flight.
+ * @param user_data User data passed to @c func.
  * 
- * @return int 0 in case of success or negative value in case of error.
+ * @return int 0 in case of success, -EINVAL if the peer has not subscribed
+ * or another negative value in case of error.
  */
-int wens_ens_log_notify(ens_log_t record);
+int wens_ens_log_notify(struct bt_conn *conn, const uint8_t *data,
+                        uint16_t len, bt_gatt_complete_func_t func,
+                        void *user_data);
+
+/**
+ * @brief Function for checking if a peer has enabled notifications on the ENS
+ * Log characteristic.
+ * 
+ * @param conn The peer.
+ * 
+ * @return bool True if the peer has subscribed.
+ */
+bool wens_ens_log_subscribed(struct bt_conn *conn);
+
+/**
+ * @brief Function for telling the WENS that an ENS log record has been
+ * stored, so it can be pushed to the subscribed peers.
+ */
+void wens_ens_log_added(void);
 
 /**
  * @brief Function for indicating ENS identifier characteristic.
  * 
+ * @param conn The peer to indicate to, or NULL for all subscribed peers.
  * @param identifier ENS identifier.
  * 
  * @return int 0 in case of success or negative value in case of error.
  */
-int wens_ens_identifier_indicate(ens_identifier_t identifier);
+int wens_ens_identifier_indicate(struct bt_conn *conn,
+                                 ens_identifier_t identifier);
 
 /**
  * @brief Function for indicating ENS settings characteristic.
  * 
+ * @param conn The peer to indicate to, or NULL for all subscribed peers.
  * @param settings ENS settings.
  * 
  * @return int 0 in case of success or negative value in case of error.
  */
-int wens_ens_settings_indicate(ens_settings_t settings);
+int wens_ens_settings_indicate(struct bt_conn *conn, ens_settings_t settings);
 
 /**
- * @brief Function for indicating WEN features characteristic.
+ * @brief Function for indicating a response on the RACP characteristic. The
+ * indication is queued behind the others to the peer, see indication.h.
  * 
- * @note The data parameter is not supposed to be an uint8_t, but it 
- * is set to that temporarily until more of the RACP is implemented.
+ * @param conn The peer that wrote the RACP request.
+ * @param data The response.
+ * @param len Length of the response, at most RACP_MAX_RESPONSE_LENGTH.
  * 
- * @param data RACP data.
- * 
- * @return int 0 in case of success or negative value in case of error.
+ * @return int 0 in case of success, -ENOMEM if the indication queue is full
+ * or another negative value in case of error.
  */
-int wens_racp_indicate(uint8_t data);
+int wens_racp_indicate(struct bt_conn *conn, const uint8_t *data,
+                       uint16_t len);
 
 /**
  * @brief Function for indicating WEN status characteristic.
  * 
+ * @param conn The peer to indicate to, or NULL for all subscribed peers.
  * @param status WEN status.
  * 
  * @return int 0 in case of success or negative value in case of error.
  */
-int wens_status_indicate(wen_status_t status);
+int wens_status_indicate(struct bt_conn *conn, wen_status_t status);
+
+/**
+ * @brief Function for notifying the Exposure Match characteristic. The
+ * notification goes to the peer that started the check in progress. Only a
+ * few notifications are handed to the stack at a time, and this waits for one
+ * of them to be sent, or for a free buffer, before giving up. Must not be
+ * called from the system work queue, which completes the notifications.
+ * 
+ * @param data The notification, starting with an @c exposure_match_type_t.
+ * @param len Length of the notification.
+ * 
+ * @return int 0 in case of success, -ENOTCONN if the peer has disconnected
+ * or another negative value in case of error.
+ */
+int wens_exposure_match_notify(const uint8_t *data, uint16_t len);
+
+/**
+ * @brief Function for telling the service that a peer has disconnected. A
+ * check the peer was running is left without a receiver.
+ * 
+ * @param conn The peer.
+ */
+void wens_disconnected(struct bt_conn *conn);
 
 #endif // WENS_H
\ No newline at end of file
@@ -55,6 +55,18 @@
 #define WEN_STATUS_UUID    0xFF06 // NOTE: Temporary
 #define BT_UUID_WEN_STATUS BT_UUID_DECLARE_16(WEN_STATUS_UUID)
 
+/* Diagnosis Keys */
+#define DIAGNOSIS_KEYS_UUID    0xFF07 // NOTE: Temporary
+#define BT_UUID_DIAGNOSIS_KEYS BT_UUID_DECLARE_16(DIAGNOSIS_KEYS_UUID)
+
+/* Exposure Match */
+#define EXPOSURE_MATCH_UUID    0xFF08 // NOTE: Temporary
+#define BT_UUID_EXPOSURE_MATCH BT_UUID_DECLARE_16(EXPOSURE_MATCH_UUID)
+
+/* RPI Filter */
+#define RPI_FILTER_UUID    0xFF09 // NOTE: Temporary
+#define BT_UUID_RPI_FILTER BT_UUID_DECLARE_16(RPI_FILTER_UUID)
+
 ////////////////////////////////////////////////////////////////////////////////
 // Device Time Service
 ////////////////////////////////////////////////////////////////////////////////
@@ -98,13 +98,20 @@ int crypto_rpik(const uint8_t *tek, const uint8_t tek_len, uint8_t *rpik,
 }
 
 int crypto_rpi(const uint8_t *rpik, uint8_t *rpi)
+{
+    uint32_t en_in_j;
+    crypto_en_interval_number(&en_in_j);
+
+    return crypto_rpi_interval(rpik, en_in_j, rpi);
+}
+
+int crypto_rpi_interval(const uint8_t *rpik, uint32_t en_interval_number,
+                        uint8_t *rpi)
 {
     // Create data to be encrypted
     // Format: [<"EN-RPI"><000000000000><EN-INTERVAL-NUM>] (without <,>,")
     uint8_t padded_data[16] = "EN-RPI";
-    uint32_t en_in_j;
-    crypto_en_interval_number(&en_in_j);
-    memcpy(&padded_data[12], &en_in_j, sizeof(en_in_j));
+    memcpy(&padded_data[12], &en_interval_number, sizeof(en_interval_number));
 
     // Set the encryption key
     if (mbedtls_aes_setkey_enc(&rpi_aes_ctx, rpik, 128) != 0)
@@ -108,6 +108,20 @@ int crypto_rpik(const uint8_t *tek, const uint8_t tek_len, uint8_t *rpik,
  */
 int crypto_rpi(const uint8_t *rpik, uint8_t *rpi);
 
+/**
+ * @brief Derive the Rolling Proximity Identifier for a given Exposure 
+ * Notification Interval Number. This is used when deriving the RPIs of a
+ * diagnosis key, where the interval is not the current one.
+ * 
+ * @param rpik Pointer to rolling proximity identifier key
+ * @param en_interval_number The interval number to derive the RPI for
+ * @param rpi Pointer to store rolling proximity identifier in (should be
+ * @c RPI_LENGTH)
+ * @return int 0 on success, negative otherwise
+ */
+int crypto_rpi_interval(const uint8_t *rpik, uint32_t en_interval_number,
+                        uint8_t *rpi);
+
 /**
  * @brief Decrypt a Rolling Proximity Identifier
  * 
@@ -0,0 +1,258 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "exposure.h"
+#include "../ble/services/wens/wens.h"
+#include "../records/storage.h"
+#include "crypto.h"
+#include "gaens.h"
+#include "match.h"
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <sys/byteorder.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME exposure
+LOG_MODULE_REGISTER(exposure);
+
+#define EXPOSURE_MATCH_FOUND_LENGTH    13
+#define EXPOSURE_MATCH_COMPLETE_LENGTH 4
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static volatile bool check_running = false;
+static volatile bool check_ending = false;
+static volatile bool check_aborting = false;
+static bool check_failed = false; // A batch of keys could not be matched
+
+static key_export_key_t batch[KEY_EXPORT_BATCH_SIZE];
+
+K_MSGQ_DEFINE(_key_queue, sizeof(key_export_key_t), EXPOSURE_KEY_QUEUE_SIZE, 4);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static int _match_cb(const uint8_t entry[], uint32_t entry_index,
+                     const key_export_key_t *key, void *user_data);
+
+static void _match_handler(struct k_work *unused);
+K_WORK_DEFINE(_match_work, _match_handler);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int exposure_begin(void)
+{
+    if (check_running)
+    {
+        LOG_ERR("An exposure check is already running");
+        return -EBUSY;
+    }
+
+    k_msgq_purge(&_key_queue);
+
+    if (match_begin(_match_cb, NULL) < 0)
+    {
+        return -1;
+    }
+
+    check_ending = false;
+    check_aborting = false;
+    check_failed = false;
+    check_running = true;
+
+    LOG_INF("Exposure check started");
+
+    return 0;
+}
+
+int exposure_add_keys(const uint8_t *data, size_t len)
+{
+    size_t count = len / EXPOSURE_DIAGNOSIS_KEY_LENGTH;
+    key_export_key_t key;
+
+    if (!check_running || check_ending || check_aborting ||
+        len % EXPOSURE_DIAGNOSIS_KEY_LENGTH != 0)
+    {
+        return -EINVAL;
+    }
+
+    // Reject the whole write if it does not fit, so the phone can retry it
+    if (k_msgq_num_free_get(&_key_queue) < count)
+    {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *raw = &data[i * EXPOSURE_DIAGNOSIS_KEY_LENGTH];
+
+        memcpy(key.key_data, raw, TEK_LENGTH);
+        key.rolling_start_interval_number = sys_get_le32(&raw[TEK_LENGTH]);
+        key.rolling_period = MIN(raw[TEK_LENGTH + 4], TEK_ROLLING_PERIOD);
+        key.transmission_risk_level = raw[TEK_LENGTH + 5];
+
+        k_msgq_put(&_key_queue, &key, K_NO_WAIT);
+    }
+
+    match_submit(&_match_work);
+
+    return 0;
+}
+
+int exposure_end(void)
+{
+    if (!check_running || check_aborting)
+    {
+        return -EINVAL;
+    }
+
+    check_ending = true;
+    match_submit(&_match_work);
+
+    return 0;
+}
+
+void exposure_abort(void)
+{
+    if (!check_running)
+    {
+        return;
+    }
+
+    // The run is finished by the work handler, as it may be matching a batch
+    check_aborting = true;
+    k_msgq_purge(&_key_queue);
+    match_submit(&_match_work);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Match callback reporting a match to the phone, together with the
+ * decrypted metadata of the matching advertisement. Waits for room to send the
+ * match, and stops the batch if the match could not be sent.
+ *
+ * @param entry The matching ENS log entry.
+ * @param entry_index The index of the entry in the ENS log.
+ * @param key The diagnosis key that was matched.
+ * @param user_data Not in use.
+ *
+ * @return int 0 if the match was sent, negative otherwise.
+ */
+static int _match_cb(const uint8_t entry[], uint32_t entry_index,
+                     const key_export_key_t *key, void *user_data)
+{
+    uint8_t match[EXPOSURE_MATCH_FOUND_LENGTH];
+    uint8_t aemk[AEMK_LENGTH];
+    uint8_t rpi[RPI_LENGTH];
+    int err;
+
+    match[0] = EXPOSURE_MATCH_FOUND;
+    memcpy(&match[1], &entry[ENTRY_SEQUENCE_NUMBER_OFFSET], 3);
+    memcpy(&match[4], &entry[ENTRY_TIMESTAMP_OFFSET], sizeof(uint32_t));
+    match[8] = entry[ENTRY_RSSI_OFFSET];
+
+    // The RPI is used as the counter of the AES-CTR decryption, which changes
+    // it, so a copy is used
+    memcpy(rpi, &entry[ENTRY_RPI_OFFSET], RPI_LENGTH);
+
+    if (crypto_aemk(key->key_data, TEK_LENGTH, aemk, AEMK_LENGTH) < 0 ||
+        crypto_aem_decrypt(&entry[ENTRY_AEM_OFFSET], AEM_LENGTH, aemk, rpi,
+                           &match[9]) < 0)
+    {
+        LOG_ERR("Failed to decrypt metadata of ENS log entry %u", entry_index);
+        memset(&match[9], 0, AEM_LENGTH);
+    }
+
+    if (check_aborting)
+    {
+        return -ECANCELED;
+    }
+
+    err = wens_exposure_match_notify(match, sizeof(match));
+    if (err < 0)
+    {
+        LOG_WRN("Failed to report match of ENS log entry %u", entry_index);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Work handler matching one batch of queued keys. The handler submits
+ * itself again while there are keys left, so other work is not held up by a
+ * long check.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _match_handler(struct k_work *unused)
+{
+    uint8_t complete[EXPOSURE_MATCH_COMPLETE_LENGTH];
+    size_t count = 0;
+    int matches;
+
+    if (!check_running)
+    {
+        return;
+    }
+
+    if (check_aborting)
+    {
+        k_msgq_purge(&_key_queue);
+        match_end();
+        check_running = false;
+
+        LOG_INF("Exposure check aborted");
+        return;
+    }
+
+    while (count < KEY_EXPORT_BATCH_SIZE &&
+           k_msgq_get(&_key_queue, &batch[count], K_NO_WAIT) == 0)
+    {
+        count++;
+    }
+
+    if (count > 0 && match_keys(batch, count, NULL) < 0)
+    {
+        LOG_ERR("Failed to match %u diagnosis keys", (unsigned int)count);
+        check_failed = true;
+    }
+
+    if (k_msgq_num_used_get(&_key_queue) > 0 || check_aborting)
+    {
+        match_submit(&_match_work);
+        return;
+    }
+
+    if (!check_ending)
+    {
+        return;
+    }
+
+    matches = match_end();
+
+    complete[0] = EXPOSURE_MATCH_COMPLETE;
+    sys_put_le16(MIN(matches, UINT16_MAX), &complete[1]);
+    complete[3] = check_failed ? EXPOSURE_MATCH_STATUS_INCOMPLETE
+                               : EXPOSURE_MATCH_STATUS_SUCCESS;
+
+    // A new check is only let in once the result of this one has been sent
+    wens_exposure_match_notify(complete, sizeof(complete));
+    check_running = false;
+
+    LOG_INF("Exposure check finished%s", check_failed ? ", incomplete" : "");
+}
@@ -0,0 +1,81 @@
+/**
+ * @file
+ * @brief On-device exposure check module
+ *
+ * This is a module for checking exposure on the device itself. The phone
+ * pushes diagnosis keys over WENS, the keys are matched against the ENS log by
+ * the matching module, and only the matches are reported back. The ENS log
+ * therefore never has to leave the device.
+ *
+ * Keys are queued as they arrive and matched one batch at a time on the match
+ * work queue, so RAM use is bounded by the queue and a single batch.
+ */
+
+#ifndef EXPOSURE_H
+#define EXPOSURE_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "key_export.h"
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Number of diagnosis keys that can be queued for matching.
+ */
+#define EXPOSURE_KEY_QUEUE_SIZE 32
+
+/**
+ * @brief Length of a diagnosis key as pushed by the phone (in bytes). The key
+ * is made up of the TEK, the rolling start interval number (4 bytes, little
+ * endian), the rolling period and the transmission risk level.
+ */
+#define EXPOSURE_DIAGNOSIS_KEY_LENGTH (TEK_LENGTH + 6)
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Start an exposure check. Keys can be added after this call.
+ *
+ * @return int 0 on success, negative if a check is already running.
+ */
+int exposure_begin(void);
+
+/**
+ * @brief Queue diagnosis keys for matching. Either all or none of the keys are
+ * queued.
+ *
+ * @param data Diagnosis keys in the format described by
+ * @c EXPOSURE_DIAGNOSIS_KEY_LENGTH.
+ * @param len Length of @c data. Must be a multiple of
+ * @c EXPOSURE_DIAGNOSIS_KEY_LENGTH.
+ *
+ * @return int 0 on success, -EINVAL if the data is malformed or no check is
+ * running, -ENOMEM if the queue does not have room for the keys.
+ */
+int exposure_add_keys(const uint8_t *data, size_t len);
+
+/**
+ * @brief End an exposure check. The result is reported once all queued keys
+ * have been matched.
+ *
+ * @return int 0 on success, negative if no check is running.
+ */
+int exposure_end(void);
+
+/**
+ * @brief Abort an exposure check, as the phone has gone. The queued keys are
+ * dropped and the matching run is finished without a result. Does nothing if
+ * no check is running.
+ */
+void exposure_abort(void);
+
+#endif // EXPOSURE_H
@@ -88,8 +88,7 @@ int gaens_init(void)
     }
 
     // Change advertise data
-    if (advertise_change_gaens_service_data(current_rpi, RPI_LENGTH, aem,
-                                            AEM_LENGTH) < 0)
+    if (advertise_gaens_rotate(current_rpi, RPI_LENGTH, aem, AEM_LENGTH) < 0)
     {
         LOG_ERR("Failed to update initial advertise data");
         return -1;
@@ -278,18 +277,13 @@ static int _gaens_random_rotation_interval(uint32_t *interval)
 
 /**
  * @brief Work handler for changing the RPI, AEM and update advertise data. 
+ * The new data is swapped in on the live advertising set, so there is no gap
+ * in the advertising.
  * 
  * @param unused Not in use, but required.
  */
 static void _rotate_rpi_handler(struct k_work *unused)
 {
-    // Stop advertising
-    if (advertise_stop() < 0)
-    {
-        LOG_ERR("Failed to pause the advertising");
-        return;
-    }
-
     // Stop the timer
     k_timer_stop(&_rpi_rotation_timer);
 
@@ -318,9 +312,8 @@ static void _rotate_rpi_handler(struct k_work *unused)
         return;
     }
 
-    // Change advertise data
-    if (advertise_change_gaens_service_data(current_rpi, RPI_LENGTH, aem,
-                                            AEM_LENGTH) < 0)
+    // Change advertise data and address together
+    if (advertise_gaens_rotate(current_rpi, RPI_LENGTH, aem, AEM_LENGTH) < 0)
     {
         LOG_ERR("Failed to change the gaens service data to advertise");
         return;
@@ -338,13 +331,6 @@ static void _rotate_rpi_handler(struct k_work *unused)
     k_timer_start(&_rpi_rotation_timer, K_SECONDS(random_time),
                   K_SECONDS(random_time));
 
-    // Start advertising
-    if (advertise_start() < 0)
-    {
-        LOG_ERR("Failed to resume advertising");
-        return;
-    }
-
     LOG_INF("Successfully updated RPI and AEM");
 }
 
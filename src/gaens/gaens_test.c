@@ -1,9 +1,11 @@
 
+#include "../ble/advertise.h"
 #include "../time/time.h"
 #include "logging/log.h"
 
 #include "crypto.h"
 #include "gaens.h"
+#include "key_export.h"
 
 #include <sys/printk.h>
 #include <unistd.h>
@@ -149,6 +151,198 @@ void test_aem(void)
            arrays_eq(dummy_metadata, decrypted_aem, AEM_LENGTH));
 }
 
+/* A key export holding a region field and two keys, where the second key uses
+the default rolling period */
+static const uint8_t test_export[] = {
+    'E',  'K',  ' ',  'E',  'x',  'p',  'o',  'r',  't',  ' ',  'v',  '1',
+    ' ',  ' ',  ' ',  ' ',  0x1A, 0x02, 'N',  'O',  0x3A, 0x1B, 0x0A, 0x10,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x04, 0x18, 0x90, 0xDF, 0xA1, 0x01, 0x20,
+    0x64, 0x3A, 0x17, 0x0A, 0x10, 0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6,
+    0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF, 0x18, 0xA0, 0xE0,
+    0xA1, 0x01};
+
+static key_export_key_t test_export_keys[2];
+
+static int test_key_export_batch_cb(const key_export_key_t *keys, size_t count,
+                                    void *user_data)
+{
+    int *decoded = user_data;
+
+    int max_keys = sizeof(test_export_keys) / sizeof(test_export_keys[0]);
+
+    for (int i = 0; i < count && *decoded < max_keys; i++)
+    {
+        test_export_keys[(*decoded)++] = keys[i];
+    }
+
+    return 0;
+}
+
+void test_key_export(void)
+{
+    printk("------------------------------------------------------------\n");
+    printk("Testing key export decoding. Test will do the following:\n"
+           "1. Feed a key export to the decoder one byte at a time\n"
+           "2. Check the decoded keys\n"
+           "3. Derive the first RPI of the first key\n");
+    printk("------------------------------------------------------------\n");
+
+    printk("1. Decoding key export\n");
+    key_export_ctx_t ctx;
+    int decoded = 0;
+    key_export_init(&ctx, test_key_export_batch_cb, &decoded);
+    for (int i = 0; i < sizeof(test_export); i++)
+    {
+        key_export_feed(&ctx, &test_export[i], 1);
+    }
+    printk("\tDecoded keys: %d (should be 2)\n", key_export_finish(&ctx));
+
+    printk("2. Checking decoded keys\n");
+    print_array_hex(test_export_keys[0].key_data, TEK_LENGTH, "\t1st TEK: ");
+    printk("\tRolling start: %u (should be 2650000), rolling period: %u "
+           "(should be 100)\n",
+           test_export_keys[0].rolling_start_interval_number,
+           test_export_keys[0].rolling_period);
+    printk("\t2nd rolling period: %u (should be %u)\n",
+           test_export_keys[1].rolling_period, TEK_ROLLING_PERIOD);
+
+    printk("3. Deriving first RPI of the first key\n");
+    uint8_t rpik[RPIK_LENGTH];
+    uint8_t rpi[RPI_LENGTH];
+    uint8_t dec_rpi[RPI_LENGTH];
+    crypto_rpik(test_export_keys[0].key_data, TEK_LENGTH, rpik, RPIK_LENGTH);
+    crypto_rpi_interval(rpik, test_export_keys[0].rolling_start_interval_number,
+                        rpi);
+    print_array_hex(rpi, RPI_LENGTH, "\tRPI: ");
+    crypto_rpi_decrypt(rpik, rpi, dec_rpi);
+    printk("\tDecrypted RPI starts with EN-RPI: %d (should be 1)\n",
+           arrays_eq(dec_rpi, "EN-RPI", 6));
+}
+
+/* A rotation made during a burst of advertising events delays the end of the
+burst, which the controller reports, by the time the set was off the air */
+#define BURST_EVENTS  3
+#define BURST_REPEATS 4
+
+enum
+{
+    ROTATE_NONE,
+    ROTATE_RESTART, // Stop, rotate and start again (old way)
+    ROTATE_LIVE     // Swap address and data on the live set
+};
+
+K_SEM_DEFINE(burst_sent, 0, 1);
+static uint32_t burst_sent_at;
+
+static void burst_sent_cb(uint8_t num_sent)
+{
+    burst_sent_at = k_cycle_get_32();
+    k_sem_give(&burst_sent);
+}
+
+int time_burst(int rotation, uint32_t *us)
+{
+    uint8_t rpi[RPI_LENGTH];
+    uint8_t aem[AEM_LENGTH] = {0};
+    uint32_t start;
+
+    gaens_update_rpi();
+    gaens_get_rpi(rpi);
+
+    k_sem_reset(&burst_sent);
+    start = k_cycle_get_32();
+
+    if (advertise_gaens_start_events(BURST_EVENTS) < 0)
+    {
+        return -1;
+    }
+
+    if (rotation == ROTATE_RESTART)
+    {
+        advertise_gaens_stop();
+        advertise_gaens_rotate(rpi, RPI_LENGTH, aem, AEM_LENGTH);
+        advertise_gaens_start_events(BURST_EVENTS);
+    }
+    else if (rotation == ROTATE_LIVE)
+    {
+        advertise_gaens_rotate(rpi, RPI_LENGTH, aem, AEM_LENGTH);
+    }
+
+    if (k_sem_take(&burst_sent, K_SECONDS(5)) < 0)
+    {
+        return -1;
+    }
+
+    *us = k_cyc_to_us_floor32(burst_sent_at - start);
+
+    return 0;
+}
+
+uint32_t time_bursts(int rotation)
+{
+    uint32_t total = 0;
+    uint32_t us;
+
+    for (int i = 0; i < BURST_REPEATS; i++)
+    {
+        if (time_burst(rotation, &us) < 0)
+        {
+            printk("\tAdvertising burst did not finish\n");
+            return 0;
+        }
+
+        total += us;
+    }
+
+    return total / BURST_REPEATS;
+}
+
+void test_rotation_gap(void)
+{
+    printk("------------------------------------------------------------\n");
+    printk("Testing advertising gap of RPI rotation. Bursts of %d\n"
+           "advertising events are timed until the controller reports\n"
+           "them sent. Test will do the following:\n"
+           "1. Time bursts without rotation\n"
+           "2. Time bursts rotated by stopping and restarting (old way)\n"
+           "3. Time bursts rotated by swapping address and data live\n",
+           BURST_EVENTS);
+    printk("------------------------------------------------------------\n");
+
+    bool was_active = advertise_gaens_active();
+    uint32_t base;
+    uint32_t restart;
+    uint32_t live;
+
+    advertise_gaens_stop();
+    advertise_gaens_set_sent_cb(burst_sent_cb);
+
+    printk("1. Bursts without rotation\n");
+    base = time_bursts(ROTATE_NONE);
+    printk("\tBurst time: %u us\n", base);
+
+    printk("2. Bursts rotated with stop and restart\n");
+    restart = time_bursts(ROTATE_RESTART);
+    printk("\tBurst time: %u us, gap added: %d us\n", restart,
+           (int)(restart - base));
+
+    printk("3. Bursts rotated with live swap\n");
+    live = time_bursts(ROTATE_LIVE);
+    printk("\tBurst time: %u us, gap added: %d us (should be far below "
+           "200000, the advertising interval)\n",
+           live, (int)(live - base));
+
+    // Leave advertising as it was found
+    advertise_gaens_set_sent_cb(NULL);
+    advertise_gaens_stop();
+
+    if (was_active && advertise_gaens_start() < 0)
+    {
+        printk("\tFailed to restart advertising\n");
+    }
+}
+
 void gaens_test_run_all(void)
 {
     printk("============================================================\n");
@@ -158,4 +352,6 @@ void gaens_test_run_all(void)
     gaens_init();
     test_rpi();
     test_aem();
+    test_key_export();
+    test_rotation_gap();
 }
\ No newline at end of file
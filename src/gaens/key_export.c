@@ -0,0 +1,432 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "key_export.h"
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define KEY_EXPORT_HEADER "EK Export v1    "
+
+/* Field numbers of the TemporaryExposureKeyExport message */
+#define EXPORT_FIELD_KEYS         7
+#define EXPORT_FIELD_REVISED_KEYS 8
+
+/* Field numbers of the TemporaryExposureKey message */
+#define KEY_FIELD_KEY_DATA                      1
+#define KEY_FIELD_TRANSMISSION_RISK_LEVEL       2
+#define KEY_FIELD_ROLLING_START_INTERVAL_NUMBER 3
+#define KEY_FIELD_ROLLING_PERIOD                4
+
+/* Protobuf wire types */
+#define WIRE_TYPE_VARINT           0
+#define WIRE_TYPE_FIXED64          1
+#define WIRE_TYPE_LENGTH_DELIMITED 2
+#define WIRE_TYPE_FIXED32          5
+
+#define VARINT_MAX_SHIFT 63
+#define FIELD_MAX        0x1FFFFFFF // Largest protobuf field number
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static int _varint_byte(key_export_ctx_t *ctx, uint8_t byte);
+
+static int _tag_done(key_export_ctx_t *ctx);
+
+static int _length_done(key_export_ctx_t *ctx);
+
+static void _varint_done(key_export_ctx_t *ctx);
+
+static int _field_done(key_export_ctx_t *ctx);
+
+static int _emit_key(key_export_ctx_t *ctx);
+
+static int _fail(key_export_ctx_t *ctx, int err);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+void key_export_init(key_export_ctx_t *ctx, key_export_batch_cb_t batch_cb,
+                     void *user_data)
+{
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->state = KEY_EXPORT_STATE_HEADER;
+    ctx->batch_cb = batch_cb;
+    ctx->user_data = user_data;
+}
+
+int key_export_feed(key_export_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+    int err = 0;
+    size_t i = 0;
+
+    while (i < len)
+    {
+        size_t consumed = 1;
+
+        switch (ctx->state)
+        {
+        case KEY_EXPORT_STATE_HEADER:
+            if (data[i] != KEY_EXPORT_HEADER[ctx->position])
+            {
+                err = KEY_EXPORT_ERR_HEADER;
+                break;
+            }
+
+            if (++ctx->position == KEY_EXPORT_HEADER_LENGTH)
+            {
+                ctx->state = KEY_EXPORT_STATE_TAG;
+            }
+            break;
+        case KEY_EXPORT_STATE_TAG:
+            err = _varint_byte(ctx, data[i]);
+            if (err == 1)
+            {
+                err = _tag_done(ctx);
+            }
+            break;
+        case KEY_EXPORT_STATE_VARINT:
+            err = _varint_byte(ctx, data[i]);
+            if (err == 1)
+            {
+                _varint_done(ctx);
+                err = 0;
+            }
+            break;
+        case KEY_EXPORT_STATE_LENGTH:
+            err = _varint_byte(ctx, data[i]);
+            if (err == 1)
+            {
+                err = _length_done(ctx);
+            }
+            break;
+        case KEY_EXPORT_STATE_SKIP:
+            // Skip as much of the field as is available in this chunk
+            consumed = MIN(ctx->remaining, len - i);
+            ctx->remaining -= consumed;
+            break;
+        case KEY_EXPORT_STATE_KEY_DATA:
+            consumed = MIN(ctx->remaining, len - i);
+            memcpy(&ctx->key.key_data[TEK_LENGTH - ctx->remaining], &data[i],
+                   consumed);
+            ctx->remaining -= consumed;
+            break;
+        default:
+            // Decoding has already failed
+            return ctx->error < 0 ? ctx->error : KEY_EXPORT_ERR_MALFORMED;
+        }
+
+        if (err < 0)
+        {
+            return _fail(ctx, err);
+        }
+
+        // Every byte inside a key message counts towards its length
+        if (ctx->in_key)
+        {
+            if (consumed > ctx->key_remaining)
+            {
+                return _fail(ctx, KEY_EXPORT_ERR_MALFORMED);
+            }
+
+            ctx->key_remaining -= consumed;
+        }
+
+        i += consumed;
+
+        if ((ctx->state == KEY_EXPORT_STATE_SKIP ||
+             ctx->state == KEY_EXPORT_STATE_KEY_DATA) &&
+            ctx->remaining == 0)
+        {
+            err = _field_done(ctx);
+        }
+        else if (ctx->state == KEY_EXPORT_STATE_TAG && ctx->in_key &&
+                 ctx->key_remaining == 0 && ctx->varint_shift == 0)
+        {
+            // The last field of the key message was a varint
+            err = _field_done(ctx);
+        }
+
+        if (err < 0)
+        {
+            return _fail(ctx, err);
+        }
+    }
+
+    return 0;
+}
+
+int key_export_finish(key_export_ctx_t *ctx)
+{
+    int err;
+
+    if (ctx->state == KEY_EXPORT_STATE_ERROR)
+    {
+        return ctx->error < 0 ? ctx->error : KEY_EXPORT_ERR_MALFORMED;
+    }
+
+    if (ctx->state != KEY_EXPORT_STATE_TAG || ctx->in_key ||
+        ctx->varint_shift != 0)
+    {
+        return ctx->state == KEY_EXPORT_STATE_HEADER
+                   ? KEY_EXPORT_ERR_HEADER
+                   : KEY_EXPORT_ERR_TRUNCATED;
+    }
+
+    if (ctx->batch_count > 0)
+    {
+        err = ctx->batch_cb(ctx->batch, ctx->batch_count, ctx->user_data);
+        ctx->batch_count = 0;
+
+        if (err < 0)
+        {
+            return _fail(ctx, err);
+        }
+    }
+
+    return ctx->keys_decoded;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Accumulate one byte of a varint.
+ *
+ * @param ctx The decoder context.
+ * @param byte The byte to accumulate.
+ *
+ * @return int 1 if the varint is complete, 0 if more bytes are needed,
+ * negative if the varint is malformed.
+ */
+static int _varint_byte(key_export_ctx_t *ctx, uint8_t byte)
+{
+    if (ctx->varint_shift == 0)
+    {
+        ctx->varint = 0;
+    }
+
+    if (ctx->varint_shift > VARINT_MAX_SHIFT)
+    {
+        return KEY_EXPORT_ERR_MALFORMED;
+    }
+
+    ctx->varint |= (uint64_t)(byte & 0x7F) << ctx->varint_shift;
+
+    if (byte & 0x80)
+    {
+        ctx->varint_shift += 7;
+        return 0;
+    }
+
+    ctx->varint_shift = 0;
+    return 1;
+}
+
+/**
+ * @brief Handle a completed field tag and select how to decode the field.
+ *
+ * @param ctx The decoder context.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _tag_done(key_export_ctx_t *ctx)
+{
+    if ((ctx->varint >> 3) == 0 || (ctx->varint >> 3) > FIELD_MAX)
+    {
+        return KEY_EXPORT_ERR_MALFORMED;
+    }
+
+    ctx->field = ctx->varint >> 3;
+    ctx->wire_type = ctx->varint & 0x07;
+
+    switch (ctx->wire_type)
+    {
+    case WIRE_TYPE_VARINT:
+        ctx->state = KEY_EXPORT_STATE_VARINT;
+        break;
+    case WIRE_TYPE_FIXED64:
+        ctx->state = KEY_EXPORT_STATE_SKIP;
+        ctx->remaining = 8;
+        break;
+    case WIRE_TYPE_FIXED32:
+        ctx->state = KEY_EXPORT_STATE_SKIP;
+        ctx->remaining = 4;
+        break;
+    case WIRE_TYPE_LENGTH_DELIMITED:
+        ctx->state = KEY_EXPORT_STATE_LENGTH;
+        break;
+    default:
+        return KEY_EXPORT_ERR_MALFORMED;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Handle a completed length prefix of a length delimited field.
+ *
+ * @param ctx The decoder context.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _length_done(key_export_ctx_t *ctx)
+{
+    uint32_t length = (uint32_t)ctx->varint;
+
+    if (!ctx->in_key && (ctx->field == EXPORT_FIELD_KEYS ||
+                         ctx->field == EXPORT_FIELD_REVISED_KEYS))
+    {
+        // Descend in to the key message. Its fields are decoded as they come.
+        memset(&ctx->key, 0, sizeof(ctx->key));
+        ctx->key.rolling_period = TEK_ROLLING_PERIOD;
+        ctx->in_key = 1;
+        ctx->has_key_data = 0;
+        ctx->key_remaining = length;
+        ctx->state = KEY_EXPORT_STATE_TAG;
+
+        // The length byte itself is accounted for after this returns
+        ctx->key_remaining += 1;
+
+        return 0;
+    }
+
+    if (ctx->in_key && ctx->field == KEY_FIELD_KEY_DATA)
+    {
+        if (length != TEK_LENGTH)
+        {
+            return KEY_EXPORT_ERR_MALFORMED;
+        }
+
+        ctx->state = KEY_EXPORT_STATE_KEY_DATA;
+        ctx->remaining = length;
+        return 0;
+    }
+
+    ctx->state = KEY_EXPORT_STATE_SKIP;
+    ctx->remaining = length;
+
+    return 0;
+}
+
+/**
+ * @brief Handle a completed varint field.
+ *
+ * @param ctx The decoder context.
+ */
+static void _varint_done(key_export_ctx_t *ctx)
+{
+    ctx->state = KEY_EXPORT_STATE_TAG;
+
+    if (!ctx->in_key)
+    {
+        return;
+    }
+
+    switch (ctx->field)
+    {
+    case KEY_FIELD_TRANSMISSION_RISK_LEVEL:
+        ctx->key.transmission_risk_level = (uint8_t)ctx->varint;
+        break;
+    case KEY_FIELD_ROLLING_START_INTERVAL_NUMBER:
+        ctx->key.rolling_start_interval_number = (uint32_t)ctx->varint;
+        break;
+    case KEY_FIELD_ROLLING_PERIOD:
+        ctx->key.rolling_period = (uint8_t)MIN(ctx->varint, TEK_ROLLING_PERIOD);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Handle the end of a field. Emits the current key if it was the last
+ * field of the key message. A key message without key data is malformed, as
+ * there is nothing to match.
+ *
+ * @param ctx The decoder context.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _field_done(key_export_ctx_t *ctx)
+{
+    if (ctx->state == KEY_EXPORT_STATE_KEY_DATA)
+    {
+        ctx->has_key_data = 1;
+    }
+
+    ctx->state = KEY_EXPORT_STATE_TAG;
+
+    if (ctx->in_key && ctx->key_remaining == 0)
+    {
+        ctx->in_key = 0;
+
+        if (!ctx->has_key_data)
+        {
+            return KEY_EXPORT_ERR_MALFORMED;
+        }
+
+        return _emit_key(ctx);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add the current key to the batch, and hand the batch to the batch
+ * callback when it is full.
+ *
+ * @param ctx The decoder context.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _emit_key(key_export_ctx_t *ctx)
+{
+    int err;
+
+    ctx->batch[ctx->batch_count++] = ctx->key;
+    ctx->keys_decoded++;
+
+    if (ctx->batch_count < KEY_EXPORT_BATCH_SIZE)
+    {
+        return 0;
+    }
+
+    err = ctx->batch_cb(ctx->batch, ctx->batch_count, ctx->user_data);
+    ctx->batch_count = 0;
+
+    return err < 0 ? err : 0;
+}
+
+/**
+ * @brief Stop decoding after an error. The first error is kept, so
+ * @c key_export_finish can report what went wrong.
+ *
+ * @param ctx The decoder context.
+ * @param err The error.
+ *
+ * @return int The error.
+ */
+static int _fail(key_export_ctx_t *ctx, int err)
+{
+    if (ctx->error == 0)
+    {
+        ctx->error = err;
+    }
+
+    ctx->state = KEY_EXPORT_STATE_ERROR;
+
+    return err;
+}
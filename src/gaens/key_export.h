@@ -0,0 +1,146 @@
+/**
+ * @file
+ * @brief Exposure Notification key export module
+ *
+ * This is a module for decoding the diagnosis keys published by health
+ * authorities in the Exposure Notification key export format (the
+ * @c export.bin file found inside the published zip archive).
+ *
+ * The decoder is a push parser: the export can be fed in chunks of any size
+ * (down to a single byte), and the decoded Temporary Exposure Keys are handed
+ * to a callback in batches of @c KEY_EXPORT_BATCH_SIZE. The parser never
+ * buffers more than one batch, so memory use is the same regardless of how
+ * many keys the export holds. It has no Zephyr dependencies and can be built
+ * for a host, where an mmapped export can be passed in a single call.
+ */
+
+#ifndef KEY_EXPORT_H
+#define KEY_EXPORT_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "crypto.h"
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Number of keys collected before they are handed to the batch
+ * callback.
+ */
+#define KEY_EXPORT_BATCH_SIZE 8
+
+/**
+ * @brief Length of the fixed header in front of the protobuf message.
+ */
+#define KEY_EXPORT_HEADER_LENGTH 16
+
+/* Error codes returned by the decoder */
+#define KEY_EXPORT_ERR_HEADER    -1 // The export header did not match
+#define KEY_EXPORT_ERR_MALFORMED -2 // The protobuf encoding is malformed
+#define KEY_EXPORT_ERR_TRUNCATED -3 // The export ended in the middle of a field
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the fields of one TemporaryExposureKey message that are
+needed for matching. */
+typedef struct
+{
+    uint8_t key_data[TEK_LENGTH];
+    uint32_t rolling_start_interval_number;
+    uint8_t rolling_period;
+    uint8_t transmission_risk_level;
+} key_export_key_t;
+
+/**
+ * @brief Callback receiving a batch of decoded keys.
+ *
+ * @param keys Pointer to the decoded keys. Only valid during the callback.
+ * @param count Number of keys in @c keys.
+ * @param user_data User data given to @c key_export_init.
+ *
+ * @return int 0 to continue decoding, negative to abort.
+ */
+typedef int (*key_export_batch_cb_t)(const key_export_key_t *keys,
+                                     size_t count, void *user_data);
+
+/* The internal states of the decoder */
+typedef enum
+{
+    KEY_EXPORT_STATE_HEADER,
+    KEY_EXPORT_STATE_TAG,
+    KEY_EXPORT_STATE_VARINT,
+    KEY_EXPORT_STATE_LENGTH,
+    KEY_EXPORT_STATE_SKIP,
+    KEY_EXPORT_STATE_KEY_DATA,
+    KEY_EXPORT_STATE_ERROR
+} key_export_state_t;
+
+/* Decoder context. The fields are internal to the module. */
+typedef struct
+{
+    key_export_state_t state;
+    int error;            // The first error, 0 until decoding fails
+    uint32_t position;    // Bytes consumed in the current state
+    uint64_t varint;      // Varint being accumulated
+    uint8_t varint_shift; // Bit position of the next varint byte
+    uint32_t field;       // Field number of the current field
+    uint8_t wire_type;    // Wire type of the current field
+    uint32_t remaining;   // Bytes left of the field being skipped or copied
+    uint8_t in_key;       // 1 while decoding a TemporaryExposureKey message
+    uint8_t has_key_data; // 1 once the key data of the key has been copied
+    uint32_t key_remaining; // Bytes left of the current key message
+    key_export_key_t key;   // Key currently being decoded
+    key_export_key_t batch[KEY_EXPORT_BATCH_SIZE];
+    size_t batch_count;
+    uint32_t keys_decoded;
+    key_export_batch_cb_t batch_cb;
+    void *user_data;
+} key_export_ctx_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Initialize a decoder context. Must be called before feeding an
+ * export.
+ *
+ * @param ctx The decoder context.
+ * @param batch_cb Callback receiving the decoded keys.
+ * @param user_data User data passed to @c batch_cb.
+ */
+void key_export_init(key_export_ctx_t *ctx, key_export_batch_cb_t batch_cb,
+                     void *user_data);
+
+/**
+ * @brief Feed the next chunk of the export to the decoder.
+ *
+ * @param ctx The decoder context.
+ * @param data Pointer to the chunk.
+ * @param len Length of the chunk.
+ *
+ * @return int 0 on success, negative KEY_EXPORT_ERR_* code or the return
+ * value of the batch callback otherwise.
+ */
+int key_export_feed(key_export_ctx_t *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Finish decoding. Hands the last, partially filled, batch to the
+ * batch callback.
+ *
+ * @param ctx The decoder context.
+ *
+ * @return int Number of keys decoded on success, the error that stopped
+ * decoding if it failed, negative otherwise.
+ */
+int key_export_finish(key_export_ctx_t *ctx);
+
+#endif // KEY_EXPORT_H
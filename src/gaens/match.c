@@ -0,0 +1,541 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "match.h"
+#include "../records/rpi_index.h"
+#include "../records/storage.h"
+#include "crypto.h"
+#include "rpi_cache.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME match
+LOG_MODULE_REGISTER(match);
+
+#define ENTRIES_PER_READ 8 // Number of ENS log entries read from flash at once
+
+/* Number of ENS log entries in the range of a key above which the key is
+looked up in the RPI index instead of scanned. A lookup costs a few short reads
+for each RPI of the key. */
+#define INDEX_THRESHOLD 512
+
+#define INDEX_HITS 4 // Number of entries read per RPI index lookup
+
+#define MATCH_STACK_SIZE 2048
+#define MATCH_PRIORITY   K_PRIO_PREEMPT(8)
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds a diagnosis key while it is being matched. */
+typedef struct
+{
+    const key_export_key_t *key;
+    int slot;       // Slot in the RPI cache, negative if not cached
+    uint32_t from;  // Index of the first ENS log entry not yet matched
+    uint32_t start; // Index of the first ENS log entry to match against
+    uint32_t end;   // Index of the ENS log entry after the last to match
+    uint32_t fingerprints[TEK_ROLLING_PERIOD];
+} match_key_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static match_cb_t match_cb;
+static void *match_user_data;
+static uint32_t match_end_index = 0;
+static uint32_t match_end_seq = 0; // Sequence number of match_end_index
+static int match_count = 0;
+static uint32_t match_cached = 0; // Keys of the run that are in the cache
+
+static match_key_t batch[KEY_EXPORT_BATCH_SIZE];
+static uint8_t entry_buf[ENTRIES_PER_READ * SIZE_OF_ONE_ENTRY];
+
+K_THREAD_STACK_DEFINE(_match_stack, MATCH_STACK_SIZE);
+static struct k_work_q match_work_q;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static int _scan(match_key_t keys[], size_t count);
+
+static int _key_range(match_key_t *key);
+
+static int _scan_range(match_key_t *keys[], size_t count, uint32_t start,
+                       uint32_t end);
+
+static bool _use_index(const match_key_t *key);
+
+static int _lookup(const match_key_t *key);
+
+static bool _match_entry(const match_key_t *key, const uint8_t entry[]);
+
+static bool _confirm(const key_export_key_t *key, uint32_t en_interval_number,
+                     const uint8_t *rpi);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int match_init(void)
+{
+    if (rpi_cache_init() < 0)
+    {
+        LOG_ERR("Failed to initialize the RPI cache");
+        return -1;
+    }
+
+    k_work_q_start(&match_work_q, _match_stack,
+                   K_THREAD_STACK_SIZEOF(_match_stack), MATCH_PRIORITY);
+
+    return 0;
+}
+
+void match_submit(struct k_work *work)
+{
+    k_work_submit_to_queue(&match_work_q, work);
+}
+
+int match_begin(match_cb_t cb, void *user_data)
+{
+    match_cb = cb;
+    match_user_data = user_data;
+    match_count = 0;
+    match_cached = 0;
+
+    // The ranges of the keys are kept as indices, so no entries can be
+    // deleted until the run is finished. Entries written during the run are
+    // left for the next run.
+    storage_hold();
+    match_end_index = storage_get_entry_count();
+    match_end_seq = storage_get_sequence_number(match_end_index);
+
+    LOG_INF("Matching run started (%u log entries)", match_end_index);
+
+    return 0;
+}
+
+int match_keys(const key_export_key_t *keys, size_t count, void *unused)
+{
+    size_t cached = 0;
+    size_t fresh = count;
+
+    ARG_UNUSED(unused);
+
+    if (count > KEY_EXPORT_BATCH_SIZE)
+    {
+        return -1;
+    }
+
+    // Sort the keys in to keys that are already cached, which only need to be
+    // matched against new log entries, and keys that are new, which have to be
+    // matched against the whole log. The cached keys are placed first.
+    for (size_t i = 0; i < count; i++)
+    {
+        int slot = rpi_cache_lookup(&keys[i]);
+        uint32_t from = 0;
+        uint32_t watermark;
+        match_key_t *key;
+
+        if (slot >= 0)
+        {
+            // The entries are found by sequence number, as their indices move
+            // when entries are deleted. A watermark before the first entry
+            // gives 0.
+            if (rpi_cache_get_watermark(slot, &watermark) == 0 &&
+                storage_find_sequence(watermark, &from) == 0)
+            {
+                from = MIN(from, match_end_index);
+            }
+            else
+            {
+                from = 0;
+            }
+
+            key = &batch[cached++];
+        }
+        else
+        {
+            key = &batch[--fresh];
+        }
+
+        key->key = &keys[i];
+        key->slot = slot;
+        key->from = from;
+
+        if (slot < 0 && match_cached >= rpi_cache_capacity())
+        {
+            // The export does not fit in the cache, so the key is not cached
+            // and does not evict the keys of this run
+            if (rpi_cache_derive(&keys[i], key->fingerprints) < 0)
+            {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (slot < 0)
+        {
+            key->slot = rpi_cache_insert(&keys[i]);
+            if (key->slot < 0)
+            {
+                LOG_ERR("Failed to cache diagnosis key");
+                return -1;
+            }
+        }
+
+        match_cached++;
+
+        if (rpi_cache_read_fingerprints(key->slot, key->fingerprints) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (_scan(batch, cached) < 0 ||
+        _scan(&batch[fresh], count - fresh) < 0)
+    {
+        return -1;
+    }
+
+    // The watermarks are only moved once every match of the batch has been
+    // reported, so a failed batch is matched again on the next run. A match
+    // may then be reported twice, under the same sequence number.
+    for (size_t i = 0; i < count; i++)
+    {
+        if (batch[i].slot >= 0)
+        {
+            rpi_cache_set_watermark(batch[i].slot, match_end_seq);
+        }
+    }
+
+    return 0;
+}
+
+int match_end(void)
+{
+    storage_release();
+
+    LOG_INF("Matching run finished (%d matches)", match_count);
+
+    return match_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Match keys against the ENS log. The log is written in time order, so
+ * each key is only matched against the entries from its rolling period. Keys
+ * with many entries in their range are looked up in the RPI index, and the
+ * rest are scanned. Keys whose entries overlap are matched in one pass over
+ * the log.
+ *
+ * @param keys The keys to match.
+ * @param count Number of keys.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _scan(match_key_t keys[], size_t count)
+{
+    match_key_t *order[KEY_EXPORT_BATCH_SIZE];
+    size_t first = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (_key_range(&keys[i]) < 0)
+        {
+            return -1;
+        }
+
+        if (_use_index(&keys[i]))
+        {
+            if (_lookup(&keys[i]) < 0)
+            {
+                return -1;
+            }
+
+            // Nothing is left to scan
+            keys[i].start = keys[i].end;
+        }
+
+        // Insertion sort by the start of the range of entries
+        size_t j = i;
+        while (j > 0 && order[j - 1]->start > keys[i].start)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = &keys[i];
+    }
+
+    while (first < count)
+    {
+        uint32_t start = order[first]->start;
+        uint32_t end = order[first]->end;
+        size_t last = first + 1;
+
+        while (last < count && order[last]->start <= end)
+        {
+            end = MAX(end, order[last]->end);
+            last++;
+        }
+
+        if (_scan_range(&order[first], last - first, start, end) < 0)
+        {
+            return -1;
+        }
+
+        first = last;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the range of ENS log entries a key has to be matched against.
+ * The range covers the rolling period of the key, and starts no earlier than
+ * the watermark of the key.
+ *
+ * @param key The key.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _key_range(match_key_t *key)
+{
+    uint32_t rolling_start = key->key->rolling_start_interval_number;
+    uint32_t first_interval = rolling_start > MATCH_INTERVAL_TOLERANCE
+                                  ? rolling_start - MATCH_INTERVAL_TOLERANCE
+                                  : 0;
+    uint32_t end_interval =
+        rolling_start + key->key->rolling_period + MATCH_INTERVAL_TOLERANCE;
+
+    if (storage_find_entry(first_interval, &key->start) < 0 ||
+        storage_find_entry(end_interval, &key->end) < 0)
+    {
+        return -1;
+    }
+
+    key->start = MAX(key->start, key->from);
+    key->end = MIN(key->end, match_end_index);
+    key->start = MIN(key->start, key->end);
+
+    return 0;
+}
+
+/**
+ * @brief Match keys against a range of ENS log entries.
+ *
+ * @param keys The keys to match.
+ * @param count Number of keys.
+ * @param start Index of the first entry of the range.
+ * @param end Index of the entry after the range.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _scan_range(match_key_t *keys[], size_t count, uint32_t start,
+                       uint32_t end)
+{
+    for (uint32_t index = start; index < end; index += ENTRIES_PER_READ)
+    {
+        size_t entries = MIN(ENTRIES_PER_READ, end - index);
+
+        if (storage_read_entries(index, entry_buf, entries) < 0)
+        {
+            return -1;
+        }
+
+        for (size_t e = 0; e < entries; e++)
+        {
+            const uint8_t *entry = &entry_buf[e * SIZE_OF_ONE_ENTRY];
+
+            for (size_t k = 0; k < count; k++)
+            {
+                if (index + e < keys[k]->start || index + e >= keys[k]->end ||
+                    !_match_entry(keys[k], entry))
+                {
+                    continue;
+                }
+
+                if (match_cb && match_cb(entry, index + e, keys[k]->key,
+                                         match_user_data) < 0)
+                {
+                    return -1;
+                }
+
+                match_count++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check if a key should be looked up in the RPI index rather than
+ * scanned.
+ *
+ * @param key The key.
+ *
+ * @return bool True if the range of the key is large and fully indexed.
+ */
+static bool _use_index(const match_key_t *key)
+{
+    return key->end - key->start >= INDEX_THRESHOLD &&
+           rpi_index_covers(key->start, key->end);
+}
+
+/**
+ * @brief Match a key against the ENS log by looking up the fingerprint of each
+ * of its RPIs in the RPI index. Only entries in the range of the key are
+ * matched.
+ *
+ * @param key The key.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _lookup(const match_key_t *key)
+{
+    uint32_t rolling_start = key->key->rolling_start_interval_number;
+    uint8_t entry[SIZE_OF_ONE_ENTRY];
+    uint32_t indices[INDEX_HITS];
+
+    for (int i = 0; i < key->key->rolling_period; i++)
+    {
+        uint32_t interval = rolling_start + i;
+        uint32_t first_day =
+            RPI_INDEX_DAY(interval > MATCH_INTERVAL_TOLERANCE
+                              ? interval - MATCH_INTERVAL_TOLERANCE
+                              : 0);
+        uint32_t last_day =
+            RPI_INDEX_DAY(interval + MATCH_INTERVAL_TOLERANCE);
+
+        for (uint32_t day = first_day; day <= last_day; day++)
+        {
+            int found = rpi_index_find(day, key->fingerprints[i], indices,
+                                       INDEX_HITS);
+
+            // A day that is not indexed has no entries in the range of the key
+            if (found == -ENOENT)
+            {
+                continue;
+            }
+            else if (found < 0)
+            {
+                return -1;
+            }
+
+            for (int h = 0; h < found; h++)
+            {
+                uint32_t timestamp;
+
+                if (indices[h] < key->start || indices[h] >= key->end)
+                {
+                    continue;
+                }
+
+                if (storage_read_entries(indices[h], entry, 1) < 0)
+                {
+                    return -1;
+                }
+
+                timestamp = storage_entry_timestamp(entry);
+                if (timestamp + MATCH_INTERVAL_TOLERANCE < interval ||
+                    timestamp > interval + MATCH_INTERVAL_TOLERANCE ||
+                    !_confirm(key->key, interval, &entry[ENTRY_RPI_OFFSET]))
+                {
+                    continue;
+                }
+
+                if (match_cb && match_cb(entry, indices[h], key->key,
+                                         match_user_data) < 0)
+                {
+                    return -1;
+                }
+
+                match_count++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check if an ENS log entry holds one of the RPIs of a key. Only the
+ * RPIs of the intervals around the timestamp of the entry are checked.
+ *
+ * @param key The key.
+ * @param entry The ENS log entry.
+ *
+ * @return bool True if the entry matches the key.
+ */
+static bool _match_entry(const match_key_t *key, const uint8_t entry[])
+{
+    uint32_t timestamp = storage_entry_timestamp(entry);
+    uint32_t rolling_start = key->key->rolling_start_interval_number;
+    uint32_t fingerprint = rpi_cache_fingerprint(&entry[ENTRY_RPI_OFFSET]);
+
+    if (timestamp + MATCH_INTERVAL_TOLERANCE < rolling_start ||
+        timestamp >= rolling_start + key->key->rolling_period +
+                         MATCH_INTERVAL_TOLERANCE)
+    {
+        return false;
+    }
+
+    for (int d = -MATCH_INTERVAL_TOLERANCE; d <= MATCH_INTERVAL_TOLERANCE; d++)
+    {
+        int64_t i = (int64_t)timestamp + d - rolling_start;
+
+        if (i < 0 || i >= key->key->rolling_period ||
+            key->fingerprints[i] != fingerprint)
+        {
+            continue;
+        }
+
+        if (_confirm(key->key, rolling_start + i, &entry[ENTRY_RPI_OFFSET]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Confirm a fingerprint match by deriving the whole RPI.
+ *
+ * @param key The diagnosis key.
+ * @param en_interval_number The interval of the RPI.
+ * @param rpi The RPI from the ENS log entry.
+ *
+ * @return bool True if the RPIs are equal.
+ */
+static bool _confirm(const key_export_key_t *key, uint32_t en_interval_number,
+                     const uint8_t *rpi)
+{
+    uint8_t rpik[RPIK_LENGTH];
+    uint8_t derived_rpi[RPI_LENGTH];
+
+    if (crypto_rpik(key->key_data, TEK_LENGTH, rpik, RPIK_LENGTH) < 0 ||
+        crypto_rpi_interval(rpik, en_interval_number, derived_rpi) < 0)
+    {
+        return false;
+    }
+
+    return memcmp(derived_rpi, rpi, RPI_LENGTH) == 0;
+}
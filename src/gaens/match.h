@@ -0,0 +1,118 @@
+/**
+ * @file
+ * @brief Exposure matching module
+ *
+ * This is a module for matching diagnosis keys against the ENS log. Matching
+ * is incremental: the RPIs of a diagnosis key are derived once and kept in the
+ * RPI cache, and a key that was matched on an earlier run is only matched
+ * against the ENS log entries written since. A daily run therefore costs time
+ * proportional to the new keys and the new log entries, as long as the export
+ * fits in the RPI cache, see rpi_cache.h. As the ENS log is
+ * written in time order, each key is only matched against the entries from
+ * its own rolling period, which are found by binary search. Once a day has
+ * been compacted by the RPI index, keys with many entries in their range are
+ * looked up there instead.
+ *
+ * A run is started with @c match_begin, fed with batches of keys through
+ * @c match_keys and finished with @c match_end. @c match_keys has the
+ * signature of a key export batch callback, so a key export can be decoded
+ * and matched in one pass.
+ *
+ * Checks run on the match work queue rather than the system work queue, as
+ * they wait for their results to be sent to the phone, and the notifications
+ * are completed from the system work queue.
+ */
+
+#ifndef MATCH_H
+#define MATCH_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "key_export.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Zephyr includes */
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Number of intervals an ENS log entry may be off from the interval of
+ * the RPI it holds, to allow for clock drift between the devices.
+ */
+#define MATCH_INTERVAL_TOLERANCE 1
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Callback receiving the ENS log entries that match a diagnosis key.
+ * Returning an error stops the batch, and the keys of the batch are matched
+ * again on the next run, so a match that could not be reported is not lost.
+ *
+ * @param entry The matching ENS log entry.
+ * @param entry_index The index of the entry in the ENS log.
+ * @param key The diagnosis key that was matched.
+ * @param user_data User data given to @c match_begin.
+ *
+ * @return int 0 if the match was reported, negative otherwise.
+ */
+typedef int (*match_cb_t)(const uint8_t entry[], uint32_t entry_index,
+                           const key_export_key_t *key, void *user_data);
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Initialize the matching module and the RPI cache, and start the
+ * match work queue.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int match_init(void);
+
+/**
+ * @brief Submit work to the match work queue.
+ *
+ * @param work The work item.
+ */
+void match_submit(struct k_work *work);
+
+/**
+ * @brief Start a matching run. The run covers the ENS log entries written
+ * before this call.
+ *
+ * @param match_cb Callback receiving the matches.
+ * @param user_data User data passed to @c match_cb.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int match_begin(match_cb_t match_cb, void *user_data);
+
+/**
+ * @brief Match a batch of diagnosis keys against the ENS log.
+ *
+ * @param keys The diagnosis keys.
+ * @param count Number of keys. At most @c KEY_EXPORT_BATCH_SIZE.
+ * @param unused Not in use, but required to be used as a key export batch
+ * callback.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int match_keys(const key_export_key_t *keys, size_t count, void *unused);
+
+/**
+ * @brief Finish a matching run.
+ *
+ * @return int The number of matches reported in the run.
+ */
+int match_end(void);
+
+#endif // MATCH_H
@@ -0,0 +1,360 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "rpi_cache.h"
+#include "../records/extmem.h"
+#include "../records/rpi_index.h"
+#include "crypto.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME rpi_cache
+LOG_MODULE_REGISTER(rpi_cache);
+
+#define RPI_CACHE_MAGIC 0x32495052 // "RPI2", watermarks are sequence numbers
+
+#define WATERMARK_UNUSED 0xFFFFFFFF
+
+#define SLOT_HEADER_SIZE sizeof(rpi_cache_header_t)
+#define SLOT_SIZE                                                              \
+    (SLOT_HEADER_SIZE + TEK_ROLLING_PERIOD * RPI_CACHE_FINGERPRINT_LENGTH)
+#define SLOTS_PER_SUBSECTOR (EXTMEM_SUBSECTOR_SIZE / SLOT_SIZE)
+#define NUMBER_OF_SLOTS                                                        \
+    (EXTMEM_RPI_CACHE_SIZE / EXTMEM_SUBSECTOR_SIZE * SLOTS_PER_SUBSECTOR)
+
+/* Size of the part of the header that is written when a key is inserted. The
+watermarks after it are programmed one by one later. */
+#define SLOT_KEY_HEADER_SIZE offsetof(rpi_cache_header_t, watermarks)
+
+#define EMPTY_SLOT 0xFFFFFFFF
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct is the header stored in front of the fingerprints in each
+slot. */
+typedef struct
+{
+    uint32_t magic;
+    uint8_t tek[TEK_LENGTH];
+    uint32_t rolling_start_interval_number;
+    uint8_t rolling_period;
+    uint8_t rfu[3];
+    uint32_t generation; // Insertion order, used to find the ring position
+    uint32_t watermarks[RPI_CACHE_WATERMARKS];
+} rpi_cache_header_t;
+
+/* This struct is the part of a slot kept in RAM to find keys quickly. */
+typedef struct
+{
+    uint32_t rolling_start_interval_number; // EMPTY_SLOT if the slot is empty
+    uint32_t tek_prefix;
+} rpi_cache_index_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static rpi_cache_index_t slot_index[NUMBER_OF_SLOTS];
+static uint32_t next_slot = 0;
+static uint32_t next_generation = 0;
+
+static uint32_t fingerprint_buf[TEK_ROLLING_PERIOD];
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t _slot_offset(int slot);
+
+static int _allocate_slot(void);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int rpi_cache_init(void)
+{
+    rpi_cache_header_t header;
+    uint32_t newest = 0;
+    bool found = false;
+
+    for (int slot = 0; slot < NUMBER_OF_SLOTS; slot++)
+    {
+        slot_index[slot].rolling_start_interval_number = EMPTY_SLOT;
+
+        if (extmem_read(_slot_offset(slot), (uint8_t *)&header,
+                        SLOT_KEY_HEADER_SIZE) != 0)
+        {
+            LOG_ERR("Failed to read RPI cache slot %d", slot);
+            return -1;
+        }
+
+        if (header.magic != RPI_CACHE_MAGIC)
+        {
+            continue;
+        }
+
+        slot_index[slot].rolling_start_interval_number =
+            header.rolling_start_interval_number;
+        memcpy(&slot_index[slot].tek_prefix, header.tek, sizeof(uint32_t));
+
+        if (!found || header.generation - newest < 0x80000000)
+        {
+            newest = header.generation;
+            next_slot = (slot + 1) % NUMBER_OF_SLOTS;
+            found = true;
+        }
+    }
+
+    next_generation = found ? newest + 1 : 0;
+
+    LOG_INF("RPI cache initialized (%u slots)", NUMBER_OF_SLOTS);
+
+    return 0;
+}
+
+int rpi_cache_lookup(const key_export_key_t *key)
+{
+    uint32_t tek_prefix;
+    uint8_t tek[TEK_LENGTH];
+
+    memcpy(&tek_prefix, key->key_data, sizeof(tek_prefix));
+
+    for (int slot = 0; slot < NUMBER_OF_SLOTS; slot++)
+    {
+        if (slot_index[slot].rolling_start_interval_number !=
+                key->rolling_start_interval_number ||
+            slot_index[slot].tek_prefix != tek_prefix)
+        {
+            continue;
+        }
+
+        // Confirm the whole key, the prefix is only a hint
+        if (extmem_read(_slot_offset(slot) +
+                            offsetof(rpi_cache_header_t, tek),
+                        tek, TEK_LENGTH) != 0)
+        {
+            return -1;
+        }
+
+        if (memcmp(tek, key->key_data, TEK_LENGTH) == 0)
+        {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+uint32_t rpi_cache_capacity(void)
+{
+    // The erase of the subsector ahead evicts up to a subsector of keys
+    return NUMBER_OF_SLOTS - SLOTS_PER_SUBSECTOR;
+}
+
+int rpi_cache_derive(const key_export_key_t *key, uint32_t fingerprints[])
+{
+    uint8_t rpik[RPIK_LENGTH];
+    uint8_t rpi[RPI_LENGTH];
+
+    if (key->rolling_period > TEK_ROLLING_PERIOD)
+    {
+        LOG_ERR("Invalid rolling period %u", key->rolling_period);
+        return -1;
+    }
+
+    if (crypto_rpik(key->key_data, TEK_LENGTH, rpik, RPIK_LENGTH) < 0)
+    {
+        LOG_ERR("Failed to derive RPIK of diagnosis key");
+        return -1;
+    }
+
+    memset(fingerprints, 0,
+           TEK_ROLLING_PERIOD * RPI_CACHE_FINGERPRINT_LENGTH);
+
+    for (int i = 0; i < key->rolling_period; i++)
+    {
+        if (crypto_rpi_interval(rpik, key->rolling_start_interval_number + i,
+                                rpi) < 0)
+        {
+            LOG_ERR("Failed to derive RPI of diagnosis key");
+            return -1;
+        }
+
+        fingerprints[i] = rpi_cache_fingerprint(rpi);
+    }
+
+    return 0;
+}
+
+int rpi_cache_insert(const key_export_key_t *key)
+{
+    rpi_cache_header_t header;
+    int slot;
+
+    if (rpi_cache_derive(key, fingerprint_buf) < 0)
+    {
+        return -1;
+    }
+
+    slot = _allocate_slot();
+    if (slot < 0)
+    {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = RPI_CACHE_MAGIC;
+    memcpy(header.tek, key->key_data, TEK_LENGTH);
+    header.rolling_start_interval_number = key->rolling_start_interval_number;
+    header.rolling_period = key->rolling_period;
+    header.generation = next_generation++;
+
+    // Write the fingerprints before the header, so a slot with a valid magic
+    // always has its fingerprints in place
+    if (extmem_write(_slot_offset(slot) + SLOT_HEADER_SIZE, fingerprint_buf,
+                     sizeof(fingerprint_buf)) != 0 ||
+        extmem_write(_slot_offset(slot), &header, SLOT_KEY_HEADER_SIZE) != 0)
+    {
+        LOG_ERR("Failed to write RPI cache slot %d", slot);
+        return -1;
+    }
+
+    slot_index[slot].rolling_start_interval_number =
+        key->rolling_start_interval_number;
+    memcpy(&slot_index[slot].tek_prefix, key->key_data, sizeof(uint32_t));
+
+    return slot;
+}
+
+int rpi_cache_read_fingerprints(int slot, uint32_t fingerprints[])
+{
+    if (extmem_read(_slot_offset(slot) + SLOT_HEADER_SIZE,
+                    (uint8_t *)fingerprints,
+                    TEK_ROLLING_PERIOD * RPI_CACHE_FINGERPRINT_LENGTH) != 0)
+    {
+        LOG_ERR("Failed to read fingerprints of RPI cache slot %d", slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+int rpi_cache_get_watermark(int slot, uint32_t *watermark)
+{
+    uint32_t watermarks[RPI_CACHE_WATERMARKS];
+
+    if (extmem_read(_slot_offset(slot) +
+                        offsetof(rpi_cache_header_t, watermarks),
+                    (uint8_t *)watermarks, sizeof(watermarks)) != 0)
+    {
+        return -1;
+    }
+
+    if (watermarks[0] == WATERMARK_UNUSED)
+    {
+        return -ENOENT;
+    }
+
+    for (int i = 0; i < RPI_CACHE_WATERMARKS; i++)
+    {
+        if (watermarks[i] == WATERMARK_UNUSED)
+        {
+            break;
+        }
+
+        *watermark = watermarks[i];
+    }
+
+    return 0;
+}
+
+int rpi_cache_set_watermark(int slot, uint32_t watermark)
+{
+    uint32_t watermarks[RPI_CACHE_WATERMARKS];
+    uint32_t offset =
+        _slot_offset(slot) + offsetof(rpi_cache_header_t, watermarks);
+
+    if (extmem_read(offset, (uint8_t *)watermarks, sizeof(watermarks)) != 0)
+    {
+        return -1;
+    }
+
+    // Watermarks are programmed in to erased words, so the slot does not have
+    // to be erased to move its watermark
+    for (int i = 0; i < RPI_CACHE_WATERMARKS; i++)
+    {
+        if (watermarks[i] == WATERMARK_UNUSED)
+        {
+            return extmem_write(offset + i * sizeof(uint32_t), &watermark,
+                                sizeof(watermark));
+        }
+    }
+
+    LOG_WRN("No free watermarks in RPI cache slot %d", slot);
+    return -1;
+}
+
+uint32_t rpi_cache_fingerprint(const uint8_t *rpi)
+{
+    // Shared with the RPI index, so cached fingerprints can be looked up there
+    return rpi_index_fingerprint(rpi);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Get the external memory offset of a slot.
+ *
+ * @param slot The slot.
+ *
+ * @return uint32_t The offset of the slot.
+ */
+static uint32_t _slot_offset(int slot)
+{
+    return EXTMEM_RPI_CACHE_OFFSET +
+           (slot / SLOTS_PER_SUBSECTOR) * EXTMEM_SUBSECTOR_SIZE +
+           (slot % SLOTS_PER_SUBSECTOR) * SLOT_SIZE;
+}
+
+/**
+ * @brief Allocate the next slot of the ring. Erases the subsector of the slot
+ * if the slot is the first in it, which evicts the keys stored there.
+ *
+ * @return int The allocated slot, or negative on error.
+ */
+static int _allocate_slot(void)
+{
+    int slot = next_slot;
+
+    if (slot % SLOTS_PER_SUBSECTOR == 0)
+    {
+        if (extmem_erase(_slot_offset(slot), EXTMEM_SUBSECTOR_SIZE) != 0)
+        {
+            LOG_ERR("Failed to erase RPI cache subsector");
+            return -1;
+        }
+
+        for (int i = slot; i < slot + SLOTS_PER_SUBSECTOR; i++)
+        {
+            slot_index[i].rolling_start_interval_number = EMPTY_SLOT;
+        }
+    }
+
+    next_slot = (slot + 1) % NUMBER_OF_SLOTS;
+
+    return slot;
+}
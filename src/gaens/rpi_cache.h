@@ -0,0 +1,145 @@
+/**
+ * @file
+ * @brief Derived RPI cache module
+ *
+ * This is a module for caching the Rolling Proximity Identifiers derived from
+ * diagnosis keys. Most diagnosis keys are published again on the following
+ * days, and the cache lets them be matched without deriving their RPIs again.
+ *
+ * The cache lives in its own region of the external memory and has a fixed
+ * layout, so it survives reboots. Every cached key has a slot holding a
+ * header and a 4 byte fingerprint of each of its RPIs. Slots are allocated as
+ * a ring, and the oldest keys are evicted when the region wraps around. Each
+ * slot also records how far in the ENS log the key has been matched, as the
+ * sequence number of the first entry not matched, so later runs only need to
+ * look at log entries written since. Sequence numbers keep counting when
+ * entries are deleted from the log, so a watermark stays valid.
+ *
+ * A slot takes 672 bytes, so the 256 kB region holds 384 keys. A daily export
+ * usually has far more keys than that, and caching all of them would evict
+ * the keys of the same run before they are published again, at the cost of a
+ * flash write per key and an erase per few keys. So a matching run only
+ * caches keys until it has used @c rpi_cache_capacity keys, and derives the
+ * RPIs of the rest in RAM without caching them, see rpi_cache_derive. Those
+ * keys are matched against the whole log on every run.
+ */
+
+#ifndef RPI_CACHE_H
+#define RPI_CACHE_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "key_export.h"
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Length of the RPI fingerprints stored in the cache (in bytes).
+ */
+#define RPI_CACHE_FINGERPRINT_LENGTH 4
+
+/**
+ * @brief Number of match watermarks a slot can hold. A slot that has used all
+ * of them keeps its last watermark.
+ */
+#define RPI_CACHE_WATERMARKS 16
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Initialize the RPI cache by reading back the slot headers from the
+ * external memory.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_cache_init(void);
+
+/**
+ * @brief Look up the slot of a diagnosis key.
+ *
+ * @param key The diagnosis key.
+ *
+ * @return int The slot of the key, or negative if the key is not cached.
+ */
+int rpi_cache_lookup(const key_export_key_t *key);
+
+/**
+ * @brief Get the number of keys a matching run can cache without evicting
+ * keys it has cached itself.
+ *
+ * @return uint32_t The number of keys.
+ */
+uint32_t rpi_cache_capacity(void);
+
+/**
+ * @brief Derive the RPI fingerprints of a diagnosis key without caching them.
+ *
+ * @param key The diagnosis key.
+ * @param fingerprints Buffer to store the fingerprints in, see
+ * rpi_cache_read_fingerprints. Must hold @c TEK_ROLLING_PERIOD fingerprints.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_cache_derive(const key_export_key_t *key, uint32_t fingerprints[]);
+
+/**
+ * @brief Derive the RPIs of a diagnosis key and store them in the cache,
+ * evicting the oldest keys if needed.
+ *
+ * @param key The diagnosis key.
+ *
+ * @return int The slot of the key, or negative on error.
+ */
+int rpi_cache_insert(const key_export_key_t *key);
+
+/**
+ * @brief Read the RPI fingerprints of a cached key.
+ *
+ * @param slot The slot of the key.
+ * @param fingerprints Buffer to store the fingerprints in. Fingerprint i
+ * belongs to the rolling start interval number + i. Must hold
+ * @c TEK_ROLLING_PERIOD fingerprints.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_cache_read_fingerprints(int slot, uint32_t fingerprints[]);
+
+/**
+ * @brief Get how far in the ENS log the key has been matched.
+ *
+ * @param slot The slot of the key.
+ * @param watermark Pointer to store the sequence number of the first entry
+ * not matched in.
+ *
+ * @return int 0 on success, -ENOENT if the key has not been matched yet,
+ * other negative values on error.
+ */
+int rpi_cache_get_watermark(int slot, uint32_t *watermark);
+
+/**
+ * @brief Store how far in the ENS log the key has been matched.
+ *
+ * @param slot The slot of the key.
+ * @param watermark The sequence number of the first entry not matched.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_cache_set_watermark(int slot, uint32_t watermark);
+
+/**
+ * @brief Get the fingerprint of an RPI.
+ *
+ * @param rpi The rolling proximity identifier.
+ *
+ * @return uint32_t The fingerprint.
+ */
+uint32_t rpi_cache_fingerprint(const uint8_t *rpi);
+
+#endif // RPI_CACHE_H
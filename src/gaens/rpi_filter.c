@@ -0,0 +1,402 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "rpi_filter.h"
+#include "../ble/services/wens/wens.h"
+#include "../records/rpi_index.h"
+#include "../records/storage.h"
+#include "gaens.h"
+#include "match.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <sys/byteorder.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME rpi_filter
+LOG_MODULE_REGISTER(rpi_filter);
+
+#define HASH_SEED 0x5BD1E995
+
+#define ENTRIES_PER_READ 8 // Number of ENS log entries read from flash at once
+
+#define CANDIDATE_LENGTH (4 + RPI_LENGTH)
+#define COMPLETE_LENGTH  4
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This enum contains the states of a filter check. */
+typedef enum
+{
+    FILTER_IDLE,
+    FILTER_RECEIVING, // Waiting for the bytes of the current partition
+    FILTER_CHECKING   // Checking the current partition against the log
+} filter_state_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+static volatile filter_state_t state = FILTER_IDLE;
+static volatile bool abort_requested = false;
+
+static uint8_t hash_count;
+static uint8_t partition_bits;
+static uint16_t partition_size;
+
+static uint32_t current_partition;
+static uint32_t received;
+static uint32_t candidates;
+static uint32_t entry_count; // Entries written after the check started are left
+
+static uint8_t partition[RPI_FILTER_MAX_PARTITION_SIZE];
+static uint8_t entry_buf[ENTRIES_PER_READ * SIZE_OF_ONE_ENTRY];
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _check_handler(struct k_work *unused);
+K_WORK_DEFINE(_check_work, _check_handler);
+
+static int _scan_log(uint32_t start, uint32_t end, uint32_t first,
+                     uint32_t last);
+
+static void _index_cb(uint32_t fingerprint, uint32_t index, void *user_data);
+
+static bool _test(uint32_t fingerprint);
+
+static int _report(const uint8_t entry[]);
+
+static uint32_t _mix(uint32_t h);
+
+static void _stop(void);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int rpi_filter_begin(const uint8_t *header, size_t len)
+{
+    if (state == FILTER_CHECKING)
+    {
+        return -EBUSY;
+    }
+
+    if (len != RPI_FILTER_HEADER_LENGTH)
+    {
+        return -EINVAL;
+    }
+
+    if (header[0] != RPI_FILTER_VERSION)
+    {
+        LOG_WRN("RPI filter version %u is not supported", header[0]);
+        return -ENOTSUP;
+    }
+
+    // A check being received is kept as it is if the new header is invalid
+    if (header[1] == 0 || header[1] > RPI_FILTER_MAX_HASH_COUNT ||
+        header[2] > RPI_FILTER_MAX_PARTITION_BITS ||
+        sys_get_le16(&header[3]) == 0 ||
+        sys_get_le16(&header[3]) > RPI_FILTER_MAX_PARTITION_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    hash_count = header[1];
+    partition_bits = header[2];
+    partition_size = sys_get_le16(&header[3]);
+
+    current_partition = 0;
+    received = 0;
+    candidates = 0;
+
+    // The log is scanned by index, so no entries can be deleted until the
+    // check is done. A check started again keeps its hold.
+    if (state == FILTER_IDLE)
+    {
+        storage_hold();
+    }
+
+    entry_count = storage_get_entry_count();
+    abort_requested = false;
+    state = FILTER_RECEIVING;
+
+    LOG_INF("RPI filter check started (%u partitions of %u bytes)",
+            1 << partition_bits, partition_size);
+
+    return 0;
+}
+
+int rpi_filter_add(const uint8_t *chunk, size_t len)
+{
+    size_t data_len = len - RPI_FILTER_CHUNK_HEADER_LENGTH;
+
+    if (state == FILTER_CHECKING)
+    {
+        return -EBUSY;
+    }
+
+    if (state != FILTER_RECEIVING || len < RPI_FILTER_CHUNK_HEADER_LENGTH)
+    {
+        return -EINVAL;
+    }
+
+    if (sys_get_le16(&chunk[0]) != current_partition ||
+        sys_get_le16(&chunk[2]) != received ||
+        received + data_len > partition_size)
+    {
+        return -EINVAL;
+    }
+
+    memcpy(&partition[received], &chunk[RPI_FILTER_CHUNK_HEADER_LENGTH],
+           data_len);
+    received += data_len;
+
+    if (received == partition_size)
+    {
+        state = FILTER_CHECKING;
+        match_submit(&_check_work);
+    }
+
+    return 0;
+}
+
+void rpi_filter_abort(void)
+{
+    if (state == FILTER_CHECKING)
+    {
+        // The check is stopped once the current partition is done
+        abort_requested = true;
+    }
+    else if (state == FILTER_RECEIVING)
+    {
+        _stop();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Work handler checking the current partition against the ENS log.
+ * Indexed entries are found through the RPI index, and the rest of the log is
+ * scanned.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _check_handler(struct k_work *unused)
+{
+    uint8_t complete[COMPLETE_LENGTH];
+    uint32_t shift = 32 - partition_bits;
+    uint32_t first = (uint64_t)current_partition << shift;
+    uint32_t last = (((uint64_t)current_partition + 1) << shift) - 1;
+    uint32_t start;
+    uint32_t end;
+    bool failed = false;
+
+    // Index the current day as well, so only the entries before the index
+    // have to be scanned. The flush is compacted as low priority work, which
+    // this waits for.
+    if (current_partition == 0 && rpi_index_flush() < 0)
+    {
+        LOG_WRN("Failed to flush the RPI index");
+    }
+
+    rpi_index_range(&start, &end);
+    start = MIN(start, entry_count);
+    end = MIN(end, entry_count);
+
+    if (rpi_index_scan(first, last, _index_cb, NULL) < 0 ||
+        _scan_log(0, start, first, last) < 0 ||
+        _scan_log(end, entry_count, first, last) < 0)
+    {
+        LOG_ERR("Failed to check RPI filter partition %u", current_partition);
+        failed = true;
+    }
+
+    if (abort_requested)
+    {
+        _stop();
+        return;
+    }
+
+    current_partition++;
+    received = 0;
+
+    // The phone is told right away when a partition could not be checked, so
+    // it can run the check again
+    if (!failed && current_partition < (1U << partition_bits))
+    {
+        state = FILTER_RECEIVING;
+        return;
+    }
+
+    complete[0] = EXPOSURE_MATCH_COMPLETE;
+    sys_put_le16(MIN(candidates, UINT16_MAX), &complete[1]);
+    complete[3] = failed ? EXPOSURE_MATCH_STATUS_INCOMPLETE
+                         : EXPOSURE_MATCH_STATUS_SUCCESS;
+
+    wens_exposure_match_notify(complete, sizeof(complete));
+
+    _stop();
+
+    LOG_INF("RPI filter check finished (%u candidates)%s", candidates,
+            failed ? ", incomplete" : "");
+}
+
+/**
+ * @brief Check the ENS log entries in a range that are not indexed.
+ *
+ * @param start Index of the first entry.
+ * @param end Index of the entry after the last.
+ * @param first The first fingerprint of the partition.
+ * @param last The last fingerprint of the partition.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _scan_log(uint32_t start, uint32_t end, uint32_t first,
+                     uint32_t last)
+{
+    for (uint32_t index = start; index < end && !abort_requested;
+         index += ENTRIES_PER_READ)
+    {
+        size_t entries = MIN(ENTRIES_PER_READ, end - index);
+
+        if (storage_read_entries(index, entry_buf, entries) < 0)
+        {
+            return -1;
+        }
+
+        for (size_t e = 0; e < entries; e++)
+        {
+            const uint8_t *entry = &entry_buf[e * SIZE_OF_ONE_ENTRY];
+            uint32_t fingerprint =
+                rpi_index_fingerprint(&entry[ENTRY_RPI_OFFSET]);
+
+            if (fingerprint >= first && fingerprint <= last &&
+                _test(fingerprint) && _report(entry) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief RPI index scan callback checking an indexed entry.
+ *
+ * @param fingerprint The RPI fingerprint of the entry.
+ * @param index The index of the entry.
+ * @param user_data Not in use.
+ */
+static void _index_cb(uint32_t fingerprint, uint32_t index, void *user_data)
+{
+    uint8_t entry[SIZE_OF_ONE_ENTRY];
+
+    if (abort_requested || index >= entry_count || !_test(fingerprint))
+    {
+        return;
+    }
+
+    // A candidate that can not be read or sent fails the check
+    if (storage_read_entries(index, entry, 1) < 0 || _report(entry) < 0)
+    {
+        abort_requested = true;
+    }
+}
+
+/**
+ * @brief Test a fingerprint against the current partition.
+ *
+ * @param fingerprint The fingerprint.
+ *
+ * @return bool True if all the bits of the fingerprint are set.
+ */
+static bool _test(uint32_t fingerprint)
+{
+    uint32_t bits = partition_size * 8;
+    uint32_t h1 = _mix(fingerprint);
+    uint32_t h2 = _mix(fingerprint ^ HASH_SEED) | 1;
+
+    for (uint32_t j = 0; j < hash_count; j++)
+    {
+        uint32_t bit = (h1 + j * h2) % bits;
+
+        if (!(partition[bit / 8] & BIT(bit % 8)))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Report a candidate to the phone. Waits for room to send the
+ * candidate, so candidates are not dropped while the stack is out of buffers.
+ * Only the candidates that were sent are counted.
+ *
+ * @param entry The ENS log entry that passed the filter.
+ *
+ * @return int 0 if the candidate was sent, negative otherwise.
+ */
+static int _report(const uint8_t entry[])
+{
+    uint8_t candidate[CANDIDATE_LENGTH];
+    int err;
+
+    candidate[0] = EXPOSURE_MATCH_CANDIDATE;
+    memcpy(&candidate[1], &entry[ENTRY_SEQUENCE_NUMBER_OFFSET], 3);
+    memcpy(&candidate[4], &entry[ENTRY_RPI_OFFSET], RPI_LENGTH);
+
+    err = wens_exposure_match_notify(candidate, sizeof(candidate));
+    if (err < 0)
+    {
+        LOG_WRN("Failed to report RPI filter candidate (err %d)", err);
+        return err;
+    }
+
+    candidates++;
+
+    return 0;
+}
+
+/**
+ * @brief The 32 bit finalizer of MurmurHash3.
+ *
+ * @param h The value to mix.
+ *
+ * @return uint32_t The mixed value.
+ */
+static uint32_t _mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/**
+ * @brief Function for ending the check, and releasing the ENS log.
+ */
+static void _stop(void)
+{
+    state = FILTER_IDLE;
+    storage_release();
+}
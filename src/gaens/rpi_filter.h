@@ -0,0 +1,105 @@
+/**
+ * @file
+ * @brief RPI filter module
+ *
+ * This is a module for checking the ENS log against a Bloom filter of the
+ * RPIs of published diagnosis keys. The phone derives the RPIs and builds the
+ * filter, so the device does not have to derive anything. The device reports
+ * the entries that pass the filter as candidates, and the phone confirms them.
+ *
+ * The filter is split in to partitions by RPI fingerprint (see
+ * @c rpi_index_fingerprint). Partition p holds the RPIs whose fingerprint has
+ * p as its @c partition_bits most significant bits. The partitions are sent
+ * one at a time and in order, and only one partition is held in RAM. Thanks to
+ * the RPI index, the entries of a partition are read from one place in each
+ * day of the log.
+ *
+ * Bit i of a partition is bit (i % 8) of byte (i / 8). An RPI with
+ * fingerprint f sets the bits (h1 + j * h2) % m for j = 0 .. hash_count - 1,
+ * where m is the number of bits in a partition, h1 = mix(f),
+ * h2 = mix(f ^ 0x5BD1E995) | 1 and mix is the 32 bit finalizer of MurmurHash3.
+ * All of it is computed with 32 bit unsigned arithmetic.
+ */
+
+#ifndef RPI_FILTER_H
+#define RPI_FILTER_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief The filter format version supported.
+ */
+#define RPI_FILTER_VERSION 1
+
+/**
+ * @brief Largest partition supported (in bytes).
+ */
+#define RPI_FILTER_MAX_PARTITION_SIZE 4096
+
+/**
+ * @brief Largest number of hash functions supported.
+ */
+#define RPI_FILTER_MAX_HASH_COUNT 16
+
+/**
+ * @brief Largest number of partition bits supported.
+ */
+#define RPI_FILTER_MAX_PARTITION_BITS 16
+
+/**
+ * @brief Length of the filter header (in bytes). The header is made up of the
+ * version, the hash count, the partition bits and the partition size (2 bytes,
+ * little endian).
+ */
+#define RPI_FILTER_HEADER_LENGTH 5
+
+/**
+ * @brief Length of the header of a filter chunk (in bytes). The header is made
+ * up of the partition (2 bytes, little endian) and the offset in the
+ * partition (2 bytes, little endian), and is followed by the filter bytes.
+ */
+#define RPI_FILTER_CHUNK_HEADER_LENGTH 4
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Start a filter check.
+ *
+ * @param header The filter header, see @c RPI_FILTER_HEADER_LENGTH.
+ * @param len Length of @c header.
+ *
+ * @return int 0 on success, -ENOTSUP if the version is not supported, -EINVAL
+ * if the header is malformed, -EBUSY if a check is already running.
+ */
+int rpi_filter_begin(const uint8_t *header, size_t len);
+
+/**
+ * @brief Add a chunk of the filter. Chunks must be sent in order. A partition
+ * is checked once all of its bytes have been received, and the result is
+ * reported once the last partition is checked.
+ *
+ * @param chunk The chunk, see @c RPI_FILTER_CHUNK_HEADER_LENGTH.
+ * @param len Length of @c chunk.
+ *
+ * @return int 0 on success, -EINVAL if the chunk is out of order or no check
+ * is running, -EBUSY if the previous partition is still being checked.
+ */
+int rpi_filter_add(const uint8_t *chunk, size_t len);
+
+/**
+ * @brief Abort a filter check.
+ */
+void rpi_filter_abort(void);
+
+#endif // RPI_FILTER_H
@@ -8,7 +8,10 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "ble/ble.h"
+#include "gaens/match.h"
 #include "records/extmem.h"
+#include "records/rpi_index.h"
+#include "records/storage.h"
 
 /* Zephyr includes */
 #include <logging/log.h>
@@ -37,6 +40,25 @@ void main(void)
         LOG_ERR("Failed to initialize external memory");
     }
 
+    // The RPI index keeps the runs of the entries found in the log
+    err = storage_init();
+    if (err)
+    {
+        LOG_ERR("Failed to recover the ENS log");
+    }
+
+    err = rpi_index_init();
+    if (err)
+    {
+        LOG_ERR("Failed to initialize the RPI index");
+    }
+
+    err = match_init();
+    if (err)
+    {
+        LOG_ERR("Failed to initialize exposure matching");
+    }
+
     err = ble_init();
     if (err)
     {
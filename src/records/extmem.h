@@ -23,6 +23,14 @@
 #define EXTMEM_SECTOR_SIZE    65536   // Size of one sector in bytes
 #define EXTMEM_CHIP_SIZE      4194304 // Size of the chip in bytes
 
+/* Memory map of the external memory. All regions are subsector aligned. */
+#define EXTMEM_LOG_OFFSET       0x000000 // ENS log records
+#define EXTMEM_LOG_SIZE         0x300000
+#define EXTMEM_RPI_INDEX_OFFSET 0x300000 // Sorted RPI runs of the ENS log
+#define EXTMEM_RPI_INDEX_SIZE   0x0C0000
+#define EXTMEM_RPI_CACHE_OFFSET 0x3C0000 // Derived RPIs of diagnosis keys
+#define EXTMEM_RPI_CACHE_SIZE   0x040000
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
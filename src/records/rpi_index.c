@@ -0,0 +1,1438 @@
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include "rpi_index.h"
+#include "../ble/radio.h"
+#include "extmem.h"
+#include "storage.h"
+#include <errno.h>
+#include <string.h>
+
+/* Zephyr includes */
+#include <logging/log.h>
+#include <zephyr.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_MODULE_NAME rpi_index
+LOG_MODULE_REGISTER(rpi_index);
+
+#define RPI_INDEX_MAGIC 0x32585052 // "RPX2"
+
+#define RUN_HEADER_SIZE sizeof(rpi_index_header_t)
+#define RUN_ENTRY_SIZE  sizeof(rpi_index_entry_t)
+
+/* Every run wastes at most one partly filled fence interval */
+#define MAX_FENCES                                                             \
+    (EXTMEM_RPI_INDEX_SIZE / RUN_ENTRY_SIZE / RPI_INDEX_FENCE_INTERVAL +       \
+     RPI_INDEX_MAX_RUNS)
+
+#define FLUSH_TIMEOUT 30000 // Time to wait for a flush to be compacted (in ms)
+
+#define BATCH_SIZE       256 // Number of run entries sorted in RAM at once
+#define SCAN_SIZE        32  // Number of run entries read from flash at once
+#define ENTRIES_PER_READ 8   // Number of ENS log entries read from flash at once
+#define AHEAD_SIZE       256 // Number of sub-run entries buffered for merging
+
+/* The sorted sub-runs of a day take as much space as its run, so a day can
+fill at most half of the RPI index region */
+#define MAX_SUB_RUNS                                                           \
+    (EXTMEM_RPI_INDEX_SIZE / 2 / RUN_ENTRY_SIZE / BATCH_SIZE + 1)
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct is the header stored in front of the entries of a run. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t day;
+    uint32_t first_seq; // Sequence number of the first ENS log entry of the day
+    uint32_t count;     // Number of ENS log entries of the day
+} rpi_index_header_t;
+
+/* This struct is one entry of a run. Runs are sorted by fingerprint, and then
+by sequence number. The entries are kept by sequence number, as their indices
+move when the oldest entries of the log are deleted. */
+typedef struct
+{
+    uint32_t fingerprint;
+    uint32_t seq;
+} rpi_index_entry_t;
+
+/* This struct is the part of a run kept in RAM. */
+typedef struct
+{
+    uint32_t offset; // Offset of the run in the RPI index region
+    uint32_t day;
+    uint32_t first_seq;
+    uint32_t count;
+    uint16_t fence; // Position of the first fence of the run in fences
+} rpi_index_run_t;
+
+/* This struct holds the state of the run being compacted. The entries of the
+day are first sorted in batches in to sub-runs in the scratch space after the
+run, and the sub-runs are then merged in to the run. */
+typedef struct
+{
+    bool active;
+    uint32_t epoch;
+    rpi_index_run_t run;
+    uint32_t scratch; // Offset of the sub-runs in the RPI index region
+    uint32_t sorted;  // Number of entries written to sub-runs
+    uint32_t written; // Number of entries merged in to the run
+} rpi_index_build_t;
+
+/* This struct is the smallest entry of a sub-run not yet merged. */
+typedef struct
+{
+    rpi_index_entry_t entry;
+    uint16_t sub_run;
+} rpi_index_head_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Private variables
+////////////////////////////////////////////////////////////////////////////////
+
+/* Runs ordered from oldest to newest. The fences of the runs are stored in the
+same order in fences. */
+static rpi_index_run_t runs[RPI_INDEX_MAX_RUNS];
+static size_t run_count = 0;
+
+static uint32_t fences[MAX_FENCES];
+static size_t fence_count = 0;
+
+/* Sequence number of the first ENS log entry not yet compacted, and the day
+after the newest run */
+static uint32_t compact_from = 0;
+static uint32_t next_day = 0;
+
+/* Entries before this index are compacted even if their day has not ended */
+static volatile uint32_t flush_until = 0;
+
+/* Given each time the compaction runs out of work, with the result of the last
+step */
+static int flush_result = 0;
+K_SEM_DEFINE(_flush_sem, 0, 1);
+
+/* Incremented when a compaction in progress is aborted */
+static uint32_t epoch = 0;
+
+static uint32_t last_day = 0;
+static bool last_day_valid = false;
+
+static rpi_index_build_t build;
+static rpi_index_entry_t batch[BATCH_SIZE];
+static uint8_t entry_buf[ENTRIES_PER_READ * SIZE_OF_ONE_ENTRY];
+
+/* A min-heap of the sub-runs being merged, and the number of entries taken
+from each */
+static rpi_index_head_t heads[MAX_SUB_RUNS];
+static size_t head_count = 0;
+static uint16_t taken[MAX_SUB_RUNS];
+
+/* The next entries of each sub-run being merged, read from flash a chunk at a
+time. The buffer is split evenly between the sub-runs. */
+static rpi_index_entry_t ahead[AHEAD_SIZE];
+static uint16_t chunk = 1;
+
+K_MUTEX_DEFINE(rpi_index_mutex);
+
+////////////////////////////////////////////////////////////////////////////////
+// Private function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+static void _compact_handler(struct k_work *unused);
+K_WORK_DEFINE(_compact_work, _compact_handler);
+
+static int _compact_step(void);
+
+static int _start_run(void);
+
+static int _sort_batch(void);
+
+static int _start_merge(void);
+
+static int _merge_batch(void);
+
+static int _publish_run(void);
+
+static void _abort_run(void);
+
+static int _allocate(rpi_index_run_t *run, uint32_t *scratch);
+
+static void _evict_oldest(void);
+
+static void _invalidate(uint32_t offset);
+
+static int _load_fences(rpi_index_run_t *run);
+
+static int _find_in_run(const rpi_index_run_t *run, uint32_t fingerprint,
+                        uint32_t indices[], size_t max);
+
+static int _lower_bound(const rpi_index_run_t *run, uint32_t fingerprint,
+                        uint32_t *position);
+
+static int _read_entry(const rpi_index_run_t *run, uint32_t position,
+                       rpi_index_entry_t *entry);
+
+static int _read_head(uint16_t sub_run, rpi_index_entry_t *entry);
+
+static const rpi_index_run_t *_find_run(uint32_t seq, bool after);
+
+static bool _to_index(uint32_t seq, uint32_t *index);
+
+static uint32_t _index_of(uint32_t seq);
+
+static uint32_t _run_size(uint32_t count);
+
+static uint32_t _scratch_size(uint32_t count);
+
+static size_t _fences_of(uint32_t count);
+
+static bool _less(const rpi_index_entry_t *a, const rpi_index_entry_t *b);
+
+static void _sift_down(rpi_index_entry_t heap[], size_t size, size_t i);
+
+static void _sift_down_heads(size_t i);
+
+////////////////////////////////////////////////////////////////////////////////
+// Public functions
+////////////////////////////////////////////////////////////////////////////////
+
+int rpi_index_init(void)
+{
+    rpi_index_header_t header;
+    uint32_t first = storage_get_sequence_number(0);
+    uint32_t next = storage_get_sequence_number(storage_get_entry_count());
+    uint32_t offset = 0;
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    run_count = 0;
+    fence_count = 0;
+
+    while (offset < EXTMEM_RPI_INDEX_SIZE)
+    {
+        if (extmem_read(EXTMEM_RPI_INDEX_OFFSET + offset, (uint8_t *)&header,
+                        RUN_HEADER_SIZE) != 0)
+        {
+            LOG_ERR("Failed to read RPI index run header");
+            k_mutex_unlock(&rpi_index_mutex);
+            return -1;
+        }
+
+        if (header.magic != RPI_INDEX_MAGIC ||
+            _run_size(header.count) > EXTMEM_RPI_INDEX_SIZE - offset)
+        {
+            offset += EXTMEM_SUBSECTOR_SIZE;
+            continue;
+        }
+
+        // A run of entries that are not in the log any more, or not yet, is
+        // stale. A run the start of the log falls in is kept.
+        if (storage_sequence_compare(header.first_seq + header.count,
+                                     first) <= 0 ||
+            storage_sequence_compare(header.first_seq + header.count,
+                                     next) > 0)
+        {
+            _invalidate(offset);
+            offset += EXTMEM_SUBSECTOR_SIZE;
+            continue;
+        }
+
+        // Keep the newest runs. The fences are not loaded yet, so the runs
+        // are dropped without _evict_oldest.
+        if (run_count == RPI_INDEX_MAX_RUNS)
+        {
+            if (storage_sequence_compare(header.first_seq,
+                                         runs[0].first_seq) < 0)
+            {
+                _invalidate(offset);
+                offset += _run_size(header.count);
+                continue;
+            }
+
+            _invalidate(runs[0].offset);
+            memmove(&runs[0], &runs[1], (run_count - 1) * sizeof(runs[0]));
+            run_count--;
+        }
+
+        // Keep the runs in log order
+        size_t i = run_count;
+        while (i > 0 && storage_sequence_compare(runs[i - 1].first_seq,
+                                                 header.first_seq) > 0)
+        {
+            runs[i] = runs[i - 1];
+            i--;
+        }
+
+        runs[i].offset = offset;
+        runs[i].day = header.day;
+        runs[i].first_seq = header.first_seq;
+        runs[i].count = header.count;
+        run_count++;
+
+        offset += _run_size(header.count);
+    }
+
+    // The fences are loaded once the runs are in order
+    for (size_t i = 0; i < run_count; i++)
+    {
+        if (_load_fences(&runs[i]) < 0)
+        {
+            k_mutex_unlock(&rpi_index_mutex);
+            return -1;
+        }
+    }
+
+    if (run_count > 0)
+    {
+        compact_from = (runs[run_count - 1].first_seq +
+                        runs[run_count - 1].count) &
+                       STORAGE_SEQUENCE_NUMBER_MAX;
+        next_day = runs[run_count - 1].day + 1;
+    }
+    else
+    {
+        compact_from = first;
+        next_day = 0;
+    }
+
+    build.active = false;
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    LOG_INF("RPI index initialized (%u runs)", run_count);
+
+    k_work_submit(&_compact_work);
+
+    return 0;
+}
+
+void rpi_index_entry_added(uint32_t timestamp)
+{
+    uint32_t day = RPI_INDEX_DAY(timestamp);
+
+    if (last_day_valid && day != last_day)
+    {
+        radio_submit_low_priority(&_compact_work);
+    }
+
+    last_day = day;
+    last_day_valid = true;
+}
+
+int rpi_index_flush(void)
+{
+    uint32_t end = storage_get_entry_count();
+    uint32_t from;
+    int err;
+
+    flush_until = end;
+
+    // The flush is compacted as the ended days are, one batch at a time as
+    // low priority work, and the caller waits for it
+    do
+    {
+        k_sem_reset(&_flush_sem);
+        radio_submit_low_priority(&_compact_work);
+
+        if (k_sem_take(&_flush_sem, K_MSEC(FLUSH_TIMEOUT)) < 0)
+        {
+            LOG_WRN("Timed out flushing the RPI index");
+            err = -ETIMEDOUT;
+            break;
+        }
+
+        err = flush_result;
+
+        // Entries deleted meanwhile move the end of the flush down
+        k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+        from = _index_of(compact_from);
+        k_mutex_unlock(&rpi_index_mutex);
+    } while (err == 0 && from < MIN(end, storage_get_entry_count()));
+
+    flush_until = 0;
+
+    return err;
+}
+
+void rpi_index_entries_deleted(void)
+{
+    uint32_t first = storage_get_sequence_number(0);
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    // Only the runs that hold no entries that are kept are dropped. The
+    // deleted entries of the run the new start of the log falls in are
+    // skipped when the run is read.
+    while (run_count > 0 &&
+           storage_sequence_compare(runs[0].first_seq + runs[0].count,
+                                    first) <= 0)
+    {
+        _evict_oldest();
+    }
+
+    // A day that was being compacted from deleted entries is started again
+    if (build.active && storage_sequence_compare(build.run.first_seq,
+                                                 first) < 0)
+    {
+        _abort_run();
+    }
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    radio_submit_low_priority(&_compact_work);
+}
+
+bool rpi_index_covers(uint32_t start, uint32_t end)
+{
+    bool covered;
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+    covered = run_count > 0 && start >= _index_of(runs[0].first_seq) &&
+              end <= _index_of(compact_from);
+    k_mutex_unlock(&rpi_index_mutex);
+
+    return covered;
+}
+
+int rpi_index_find(uint32_t day, uint32_t fingerprint, uint32_t indices[],
+                   size_t max)
+{
+    int found = 0;
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    if (run_count == 0 || day < runs[0].day || day >= next_day)
+    {
+        k_mutex_unlock(&rpi_index_mutex);
+        return -ENOENT;
+    }
+
+    // A flushed day is split over more than one run, and days between the
+    // runs had no ENS log entries
+    for (size_t i = 0; i < run_count && (size_t)found < max; i++)
+    {
+        if (runs[i].day != day)
+        {
+            continue;
+        }
+
+        int err = _find_in_run(&runs[i], fingerprint, &indices[found],
+                               max - found);
+        if (err < 0)
+        {
+            k_mutex_unlock(&rpi_index_mutex);
+            return err;
+        }
+
+        found += err;
+    }
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    return found;
+}
+
+void rpi_index_range(uint32_t *start, uint32_t *end)
+{
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    *start = run_count > 0 ? _index_of(runs[0].first_seq) : 0;
+    *end = run_count > 0 ? _index_of(compact_from) : 0;
+
+    k_mutex_unlock(&rpi_index_mutex);
+}
+
+int rpi_index_scan(uint32_t first, uint32_t last, rpi_index_scan_cb_t cb,
+                   void *user_data)
+{
+    rpi_index_entry_t block[SCAN_SIZE];
+    const rpi_index_run_t *run;
+    uint32_t run_seq = 0;
+    uint32_t position = 0;
+    uint32_t index;
+    bool started = false;
+    bool next = false;
+
+    while (true)
+    {
+        size_t entries;
+
+        k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+        // The mutex is let go of while the callback runs, so the run is found
+        // again by its first sequence number, as runs may have been dropped
+        if (!started)
+        {
+            run = run_count > 0 ? &runs[0] : NULL;
+        }
+        else
+        {
+            run = _find_run(run_seq, next);
+        }
+
+        if (!run)
+        {
+            k_mutex_unlock(&rpi_index_mutex);
+            return 0;
+        }
+
+        if (!started || next || run->first_seq != run_seq)
+        {
+            started = true;
+            next = false;
+            run_seq = run->first_seq;
+
+            if (_lower_bound(run, first, &position) < 0)
+            {
+                k_mutex_unlock(&rpi_index_mutex);
+                return -1;
+            }
+        }
+
+        if (position >= run->count)
+        {
+            next = true;
+            k_mutex_unlock(&rpi_index_mutex);
+            continue;
+        }
+
+        // The entries of the range are next to each other in the run, so they
+        // are read in blocks
+        entries = MIN(SCAN_SIZE, run->count - position);
+
+        if (extmem_read(EXTMEM_RPI_INDEX_OFFSET + run->offset +
+                            RUN_HEADER_SIZE + position * RUN_ENTRY_SIZE,
+                        (uint8_t *)block, entries * RUN_ENTRY_SIZE) != 0)
+        {
+            k_mutex_unlock(&rpi_index_mutex);
+            return -1;
+        }
+
+        k_mutex_unlock(&rpi_index_mutex);
+
+        for (size_t i = 0; i < entries && !next; i++)
+        {
+            next = block[i].fingerprint > last;
+
+            if (!next && _to_index(block[i].seq, &index))
+            {
+                cb(block[i].fingerprint, index, user_data);
+            }
+        }
+
+        position += entries;
+    }
+}
+
+uint32_t rpi_index_fingerprint(const uint8_t *rpi)
+{
+    uint32_t fingerprint;
+
+    memcpy(&fingerprint, rpi, sizeof(fingerprint));
+
+    return fingerprint;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Private functions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Work handler compacting one batch of a day in to its run. The handler
+ * submits itself again until all ended days are compacted, so other work is
+ * not held up by a long compaction.
+ *
+ * @param unused Not in use, but required.
+ */
+static void _compact_handler(struct k_work *unused)
+{
+    int err = _compact_step();
+
+    // Each batch is submitted as low priority work, so the flash is not kept
+    // busy while a connection is moving data
+    if (err > 0)
+    {
+        radio_submit_low_priority(&_compact_work);
+        return;
+    }
+
+    // Everything is compacted, so a flush waiting for it is done
+    flush_result = err;
+    k_sem_give(&_flush_sem);
+}
+
+/**
+ * @brief Sort or merge one batch, starting a new run if none is in progress.
+ *
+ * @return int 1 if there is more to compact, 0 if everything is compacted,
+ * negative on error.
+ */
+static int _compact_step(void)
+{
+    int err;
+
+    if (!build.active)
+    {
+        err = _start_run();
+        if (err <= 0)
+        {
+            return err;
+        }
+    }
+
+    if (build.sorted < build.run.count)
+    {
+        err = _sort_batch();
+    }
+    else
+    {
+        err = _merge_batch();
+    }
+
+    if (err < 0)
+    {
+        LOG_ERR("Failed to compact ENS log entries of day %u", build.run.day);
+        k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+        _abort_run();
+        k_mutex_unlock(&rpi_index_mutex);
+        return -1;
+    }
+
+    if (build.written == build.run.count && _publish_run() < 0)
+    {
+        LOG_ERR("Failed to publish RPI index run of day %u", build.run.day);
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Start compacting the oldest day that has ended and is not indexed,
+ * or the entries of the current day up to @c flush_until.
+ *
+ * @return int 1 if a run was started, 0 if there is nothing to compact,
+ * negative on error.
+ */
+static int _start_run(void)
+{
+    uint8_t entry[SIZE_OF_ONE_ENTRY];
+    uint32_t entry_count = storage_get_entry_count();
+    uint32_t first;
+    uint32_t end;
+    uint32_t day;
+    int err;
+
+    // Entries that were deleted before they were compacted are passed over
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+    first = _index_of(compact_from);
+    k_mutex_unlock(&rpi_index_mutex);
+
+    if (first >= entry_count)
+    {
+        return 0;
+    }
+
+    if (storage_read_entries(first, entry, 1) < 0)
+    {
+        return -1;
+    }
+
+    day = RPI_INDEX_DAY(storage_entry_timestamp(entry));
+
+    if (storage_find_entry((day + 1) * RPI_INDEX_INTERVALS_PER_DAY, &end) < 0)
+    {
+        return -1;
+    }
+
+    // The day has not ended yet, so only a flush compacts it
+    if (end >= entry_count)
+    {
+        if (first >= flush_until)
+        {
+            return 0;
+        }
+
+        end = flush_until;
+    }
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    build.run.day = day;
+    build.run.first_seq = storage_get_sequence_number(first);
+    build.run.count = end - first;
+    build.sorted = 0;
+    build.written = 0;
+    build.epoch = epoch;
+
+    err = _allocate(&build.run, &build.scratch);
+    build.active = err == 0;
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    if (err < 0)
+    {
+        LOG_ERR("Failed to allocate RPI index run of day %u", day);
+        return -1;
+    }
+
+    LOG_INF("Compacting %u ENS log entries of day %u", build.run.count, day);
+
+    return 1;
+}
+
+/**
+ * @brief Sort the next batch of entries of the day being compacted in RAM, and
+ * write it to the scratch space as a sub-run. Each entry of the log is read
+ * once.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _sort_batch(void)
+{
+    uint32_t seq = build.run.first_seq + build.sorted;
+    size_t size = MIN(BATCH_SIZE, build.run.count - build.sorted);
+    uint32_t first;
+    int err = 0;
+
+    // The entries are read by sequence number, as their indices move when the
+    // oldest entries of the log are deleted
+    if (!_to_index(seq, &first))
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < size; i += ENTRIES_PER_READ)
+    {
+        size_t entries = MIN(ENTRIES_PER_READ, size - i);
+
+        if (storage_read_entries(first + i, entry_buf, entries) < 0)
+        {
+            return -1;
+        }
+
+        for (size_t e = 0; e < entries; e++)
+        {
+            batch[i + e].fingerprint = rpi_index_fingerprint(
+                &entry_buf[e * SIZE_OF_ONE_ENTRY + ENTRY_RPI_OFFSET]);
+            batch[i + e].seq = (seq + i + e) & STORAGE_SEQUENCE_NUMBER_MAX;
+        }
+    }
+
+    // Heap sort the batch in to ascending order
+    for (size_t i = size / 2; i > 0; i--)
+    {
+        _sift_down(batch, size, i - 1);
+    }
+
+    for (size_t last = size; last > 1; last--)
+    {
+        rpi_index_entry_t largest = batch[0];
+
+        batch[0] = batch[last - 1];
+        batch[last - 1] = largest;
+        _sift_down(batch, last - 1, 0);
+    }
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    // The compaction was aborted while the day was read
+    if (!build.active || build.epoch != epoch)
+    {
+        k_mutex_unlock(&rpi_index_mutex);
+        return -1;
+    }
+
+    if (extmem_write(EXTMEM_RPI_INDEX_OFFSET + build.scratch +
+                         build.sorted * RUN_ENTRY_SIZE,
+                     batch, size * RUN_ENTRY_SIZE) != 0)
+    {
+        err = -1;
+    }
+    else
+    {
+        build.sorted += size;
+    }
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    return err;
+}
+
+/**
+ * @brief Start merging the sub-runs of the day being compacted, by reading the
+ * first entry of each in to the heap.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _start_merge(void)
+{
+    size_t sub_runs = (build.run.count + BATCH_SIZE - 1) / BATCH_SIZE;
+
+    chunk = MAX(1, MIN(SCAN_SIZE, AHEAD_SIZE / sub_runs));
+    head_count = 0;
+
+    for (size_t i = 0; i < sub_runs; i++)
+    {
+        rpi_index_head_t *head = &heads[head_count];
+
+        taken[i] = 0;
+
+        if (_read_head(i, &head->entry) < 0)
+        {
+            return -1;
+        }
+
+        head->sub_run = i;
+        head_count++;
+    }
+
+    for (size_t i = head_count / 2; i > 0; i--)
+    {
+        _sift_down_heads(i - 1);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Merge the next batch of entries of the sub-runs in to the run being
+ * compacted.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _merge_batch(void)
+{
+    size_t size = 0;
+    int err = 0;
+
+    if (build.written == 0 && _start_merge() < 0)
+    {
+        return -1;
+    }
+
+    while (size < BATCH_SIZE && head_count > 0)
+    {
+        uint16_t sub_run = heads[0].sub_run;
+        uint32_t start = sub_run * BATCH_SIZE;
+        uint32_t length = MIN(BATCH_SIZE, build.run.count - start);
+
+        batch[size++] = heads[0].entry;
+
+        // Replace the smallest entry with the next of its sub-run, or drop the
+        // sub-run if it is done
+        if (taken[sub_run] < length)
+        {
+            if (_read_head(sub_run, &heads[0].entry) < 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            heads[0] = heads[--head_count];
+        }
+
+        _sift_down_heads(0);
+    }
+
+    if (size == 0)
+    {
+        return -1;
+    }
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    if (!build.active || build.epoch != epoch)
+    {
+        k_mutex_unlock(&rpi_index_mutex);
+        return -1;
+    }
+
+    if (extmem_write(EXTMEM_RPI_INDEX_OFFSET + build.run.offset +
+                         RUN_HEADER_SIZE + build.written * RUN_ENTRY_SIZE,
+                     batch, size * RUN_ENTRY_SIZE) != 0)
+    {
+        err = -1;
+    }
+    else
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            if ((build.written + i) % RPI_INDEX_FENCE_INTERVAL == 0)
+            {
+                fences[build.run.fence +
+                       (build.written + i) / RPI_INDEX_FENCE_INTERVAL] =
+                    batch[i].fingerprint;
+            }
+        }
+
+        build.written += size;
+    }
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    return err;
+}
+
+/**
+ * @brief Write the header of the compacted run and add it to the index. The
+ * header is written last, so a run cut short by a reset is never loaded.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _publish_run(void)
+{
+    rpi_index_header_t header = {.magic = RPI_INDEX_MAGIC,
+                                 .day = build.run.day,
+                                 .first_seq = build.run.first_seq,
+                                 .count = build.run.count};
+    int err = 0;
+
+    k_mutex_lock(&rpi_index_mutex, K_FOREVER);
+
+    if (!build.active || build.epoch != epoch)
+    {
+        k_mutex_unlock(&rpi_index_mutex);
+        return -1;
+    }
+
+    if (extmem_write(EXTMEM_RPI_INDEX_OFFSET + build.run.offset, &header,
+                     RUN_HEADER_SIZE) != 0)
+    {
+        _abort_run();
+        err = -1;
+    }
+    else
+    {
+        runs[run_count++] = build.run;
+        compact_from = (build.run.first_seq + build.run.count) &
+                       STORAGE_SEQUENCE_NUMBER_MAX;
+        next_day = build.run.day + 1;
+        build.active = false;
+    }
+
+    k_mutex_unlock(&rpi_index_mutex);
+
+    return err;
+}
+
+/**
+ * @brief Abort the run being compacted, and free its fences. The fences of the
+ * run are the last fences. Must be called with the mutex held.
+ */
+static void _abort_run(void)
+{
+    if (build.active)
+    {
+        fence_count = build.run.fence;
+        build.active = false;
+        epoch++;
+    }
+}
+
+/**
+ * @brief Allocate flash and fences for a run, and scratch space for its
+ * sub-runs right after it. Runs are allocated as a ring after the newest run,
+ * and the oldest runs are evicted to make room. The scratch space is free
+ * again once the run is published. Must be called with the mutex held.
+ *
+ * @param run The run. The offset and fence position are set.
+ * @param scratch Pointer to store the offset of the scratch space in.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _allocate(rpi_index_run_t *run, uint32_t *scratch)
+{
+    uint64_t size = (uint64_t)_run_size(run->count) + _scratch_size(run->count);
+    uint32_t offset = 0;
+    size_t needed_fences = _fences_of(run->count);
+
+    if (size > EXTMEM_RPI_INDEX_SIZE)
+    {
+        LOG_ERR("Day %u has too many ENS log entries to index", run->day);
+        return -1;
+    }
+
+    if (run_count > 0)
+    {
+        const rpi_index_run_t *newest = &runs[run_count - 1];
+
+        offset = newest->offset + _run_size(newest->count);
+        if (offset + size > EXTMEM_RPI_INDEX_SIZE)
+        {
+            offset = 0;
+        }
+    }
+
+    while (run_count > 0)
+    {
+        bool overlaps = run_count == RPI_INDEX_MAX_RUNS ||
+                        fence_count + needed_fences > MAX_FENCES;
+
+        for (size_t i = 0; i < run_count && !overlaps; i++)
+        {
+            overlaps = runs[i].offset < offset + size &&
+                       offset < runs[i].offset + _run_size(runs[i].count);
+        }
+
+        if (!overlaps)
+        {
+            break;
+        }
+
+        _evict_oldest();
+    }
+
+    if (extmem_erase(EXTMEM_RPI_INDEX_OFFSET + offset, size) != 0)
+    {
+        return -1;
+    }
+
+    run->offset = offset;
+    run->fence = fence_count;
+    fence_count += needed_fences;
+    *scratch = offset + _run_size(run->count);
+
+    return 0;
+}
+
+/**
+ * @brief Drop the oldest run. Its header is invalidated, so it is not loaded
+ * again if only part of it is overwritten. Must be called with the mutex held.
+ */
+static void _evict_oldest(void)
+{
+    size_t dropped = _fences_of(runs[0].count);
+
+    _invalidate(runs[0].offset);
+
+    memmove(&runs[0], &runs[1], (run_count - 1) * sizeof(runs[0]));
+    run_count--;
+
+    memmove(&fences[0], &fences[dropped],
+            (fence_count - dropped) * sizeof(fences[0]));
+    fence_count -= dropped;
+
+    for (size_t i = 0; i < run_count; i++)
+    {
+        runs[i].fence -= dropped;
+    }
+
+    if (build.active)
+    {
+        build.run.fence -= dropped;
+    }
+}
+
+/**
+ * @brief Invalidate the header of a run in place. NOR flash bits can be
+ * cleared without an erase, so the magic is overwritten with zeros. The run
+ * is erased when its space is allocated again.
+ *
+ * @param offset Offset of the run in the RPI index region.
+ */
+static void _invalidate(uint32_t offset)
+{
+    uint32_t invalid = 0;
+
+    if (extmem_write(EXTMEM_RPI_INDEX_OFFSET + offset, &invalid,
+                     sizeof(invalid)) != 0)
+    {
+        LOG_WRN("Failed to invalidate RPI index run");
+    }
+}
+
+/**
+ * @brief Read the fences of a run from the external memory in to the end of
+ * the fences. Must be called with the mutex held.
+ *
+ * @param run The run.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _load_fences(rpi_index_run_t *run)
+{
+    size_t count = _fences_of(run->count);
+    rpi_index_entry_t entry;
+
+    if (fence_count + count > MAX_FENCES)
+    {
+        return -1;
+    }
+
+    run->fence = fence_count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (_read_entry(run, i * RPI_INDEX_FENCE_INTERVAL, &entry) < 0)
+        {
+            return -1;
+        }
+
+        fences[fence_count++] = entry.fingerprint;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the entries of a run with a given fingerprint.
+ *
+ * @param run The run.
+ * @param fingerprint The fingerprint.
+ * @param indices Array to store the ENS log entry indices in. Entries that
+ * have been deleted from the log are left out.
+ * @param max Size of @c indices.
+ *
+ * @return int The number of entries found, negative on error.
+ */
+static int _find_in_run(const rpi_index_run_t *run, uint32_t fingerprint,
+                        uint32_t indices[], size_t max)
+{
+    rpi_index_entry_t entry;
+    uint32_t position;
+    int found = 0;
+
+    if (_lower_bound(run, fingerprint, &position) < 0)
+    {
+        return -1;
+    }
+
+    for (; position < run->count && (size_t)found < max; position++)
+    {
+        if (_read_entry(run, position, &entry) < 0)
+        {
+            return -1;
+        }
+
+        if (entry.fingerprint != fingerprint)
+        {
+            break;
+        }
+
+        if (_to_index(entry.seq, &indices[found]))
+        {
+            found++;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * @brief Find the position of the first entry of a run with a fingerprint
+ * equal to or larger than a given fingerprint. The fences narrow the search
+ * down to one fence interval, which is then binary searched in the external
+ * memory.
+ *
+ * @param run The run.
+ * @param fingerprint The fingerprint.
+ * @param position Pointer to store the position in. Set to the number of
+ * entries in the run if all fingerprints are smaller.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _lower_bound(const rpi_index_run_t *run, uint32_t fingerprint,
+                        uint32_t *position)
+{
+    const uint32_t *run_fences = &fences[run->fence];
+    size_t count = _fences_of(run->count);
+    rpi_index_entry_t entry;
+    size_t low = 0;
+    size_t high = count;
+
+    // First fence that is not smaller than the fingerprint
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (run_fences[mid] < fingerprint)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    // The first matching entry is between the previous fence and this one
+    uint32_t first = low > 0 ? (low - 1) * RPI_INDEX_FENCE_INTERVAL : 0;
+    uint32_t last = MIN(low * RPI_INDEX_FENCE_INTERVAL, run->count);
+
+    while (first < last)
+    {
+        uint32_t mid = first + (last - first) / 2;
+
+        if (_read_entry(run, mid, &entry) < 0)
+        {
+            return -1;
+        }
+
+        if (entry.fingerprint < fingerprint)
+        {
+            first = mid + 1;
+        }
+        else
+        {
+            last = mid;
+        }
+    }
+
+    *position = first;
+
+    return 0;
+}
+
+/**
+ * @brief Read one entry of a run.
+ *
+ * @param run The run.
+ * @param position Position of the entry in the run.
+ * @param entry Pointer to store the entry in.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _read_entry(const rpi_index_run_t *run, uint32_t position,
+                       rpi_index_entry_t *entry)
+{
+    if (extmem_read(EXTMEM_RPI_INDEX_OFFSET + run->offset + RUN_HEADER_SIZE +
+                        position * RUN_ENTRY_SIZE,
+                    (uint8_t *)entry, RUN_ENTRY_SIZE) != 0)
+    {
+        LOG_ERR("Failed to read RPI index run of day %u", run->day);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Take the next entry of a sub-run of the run being compacted. The
+ * entries are read from the scratch space a chunk at a time.
+ *
+ * @param sub_run The sub-run. Must have entries left.
+ * @param entry Pointer to store the entry in.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+static int _read_head(uint16_t sub_run, rpi_index_entry_t *entry)
+{
+    uint32_t start = sub_run * BATCH_SIZE;
+    uint32_t length = MIN(BATCH_SIZE, build.run.count - start);
+    rpi_index_entry_t *buf = &ahead[sub_run * chunk];
+    uint16_t position = taken[sub_run];
+
+    if (position % chunk == 0 &&
+        extmem_read(EXTMEM_RPI_INDEX_OFFSET + build.scratch +
+                        (start + position) * RUN_ENTRY_SIZE,
+                    (uint8_t *)buf,
+                    MIN(chunk, length - position) * RUN_ENTRY_SIZE) != 0)
+    {
+        LOG_ERR("Failed to read sorted ENS log entries of day %u",
+                build.run.day);
+        return -1;
+    }
+
+    *entry = buf[position % chunk];
+    taken[sub_run]++;
+
+    return 0;
+}
+
+/**
+ * @brief Find a run by the sequence number of its first entry. Must be called
+ * with the mutex held.
+ *
+ * @param seq The sequence number.
+ * @param after True to find the run after the run starting at @c seq.
+ *
+ * @return const rpi_index_run_t* The oldest run starting at @c seq or later,
+ * or after @c seq, NULL if there is none.
+ */
+static const rpi_index_run_t *_find_run(uint32_t seq, bool after)
+{
+    for (size_t i = 0; i < run_count; i++)
+    {
+        int32_t distance = storage_sequence_compare(runs[i].first_seq, seq);
+
+        if (distance > 0 || (distance == 0 && !after))
+        {
+            return &runs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Find the index of an indexed entry from its sequence number.
+ *
+ * @param seq The sequence number of the entry.
+ * @param index Pointer to store the index of the entry in.
+ *
+ * @return bool True if the entry is still in the ENS log.
+ */
+static bool _to_index(uint32_t seq, uint32_t *index)
+{
+    if (storage_sequence_compare(seq, storage_get_sequence_number(0)) < 0)
+    {
+        return false;
+    }
+
+    storage_find_sequence(seq, index);
+
+    return *index < storage_get_entry_count();
+}
+
+/**
+ * @brief Find the index of the first ENS log entry with a given sequence
+ * number or later.
+ *
+ * @param seq The sequence number.
+ *
+ * @return uint32_t The index, 0 if the entry has been deleted.
+ */
+static uint32_t _index_of(uint32_t seq)
+{
+    uint32_t index = 0;
+
+    storage_find_sequence(seq, &index);
+
+    return index;
+}
+
+/**
+ * @brief Get the size of a run in the external memory, rounded up to whole
+ * subsectors.
+ *
+ * @param count Number of entries in the run.
+ *
+ * @return uint32_t The size of the run.
+ */
+static uint32_t _run_size(uint32_t count)
+{
+    uint64_t size = RUN_HEADER_SIZE + (uint64_t)count * RUN_ENTRY_SIZE;
+
+    size = (size + EXTMEM_SUBSECTOR_SIZE - 1) / EXTMEM_SUBSECTOR_SIZE *
+           EXTMEM_SUBSECTOR_SIZE;
+
+    return MIN(size, UINT32_MAX);
+}
+
+/**
+ * @brief Get the size of the scratch space for the sub-runs of a run, rounded
+ * up to whole subsectors.
+ *
+ * @param count Number of entries in the run.
+ *
+ * @return uint32_t The size of the scratch space.
+ */
+static uint32_t _scratch_size(uint32_t count)
+{
+    uint64_t size = (uint64_t)count * RUN_ENTRY_SIZE;
+
+    size = (size + EXTMEM_SUBSECTOR_SIZE - 1) / EXTMEM_SUBSECTOR_SIZE *
+           EXTMEM_SUBSECTOR_SIZE;
+
+    return MIN(size, UINT32_MAX);
+}
+
+/**
+ * @brief Get the number of fences of a run.
+ *
+ * @param count Number of entries in the run.
+ *
+ * @return size_t The number of fences.
+ */
+static size_t _fences_of(uint32_t count)
+{
+    return (count + RPI_INDEX_FENCE_INTERVAL - 1) / RPI_INDEX_FENCE_INTERVAL;
+}
+
+/**
+ * @brief Compare two run entries.
+ *
+ * @param a The first entry.
+ * @param b The second entry.
+ *
+ * @return bool True if @c a sorts before @c b.
+ */
+static bool _less(const rpi_index_entry_t *a, const rpi_index_entry_t *b)
+{
+    return a->fingerprint < b->fingerprint ||
+           (a->fingerprint == b->fingerprint && a->seq < b->seq);
+}
+
+/**
+ * @brief Restore the max-heap property below an element.
+ *
+ * @param heap The heap.
+ * @param size Number of elements in the heap.
+ * @param i The element.
+ */
+static void _sift_down(rpi_index_entry_t heap[], size_t size, size_t i)
+{
+    rpi_index_entry_t element = heap[i];
+
+    while (2 * i + 1 < size)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child + 1 < size && _less(&heap[child], &heap[child + 1]))
+        {
+            child++;
+        }
+
+        if (!_less(&element, &heap[child]))
+        {
+            break;
+        }
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = element;
+}
+
+/**
+ * @brief Restore the min-heap property of the sub-runs being merged below an
+ * element.
+ *
+ * @param i The element.
+ */
+static void _sift_down_heads(size_t i)
+{
+    rpi_index_head_t element = heads[i];
+
+    while (2 * i + 1 < head_count)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child + 1 < head_count &&
+            _less(&heads[child + 1].entry, &heads[child].entry))
+        {
+            child++;
+        }
+
+        if (!_less(&heads[child].entry, &element.entry))
+        {
+            break;
+        }
+
+        heads[i] = heads[child];
+        i = child;
+    }
+
+    heads[i] = element;
+}
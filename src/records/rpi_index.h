@@ -0,0 +1,176 @@
+/**
+ * @file
+ * @brief RPI index module
+ *
+ * This is a module for finding ENS log entries by their Rolling Proximity
+ * Identifier without scanning the log. Once a day is over, the entries of the
+ * day are compacted in to a run of (RPI fingerprint, sequence number) pairs
+ * sorted by fingerprint. The runs are stored in their own region of the
+ * external memory, next to the log.
+ *
+ * A day is compacted with an external sort: the entries are sorted in RAM one
+ * batch at a time and written to scratch space after the run, and the sorted
+ * batches are then merged in to the run. Each entry of the log is read once.
+ * A day can therefore fill at most half of the region.
+ *
+ * A sparse index holding every @c RPI_INDEX_FENCE_INTERVAL th fingerprint of
+ * each run is kept in RAM, so a lookup is a binary search in RAM followed by a
+ * short binary search in a single page of the run.
+ */
+
+#ifndef RPI_INDEX_H
+#define RPI_INDEX_H
+
+////////////////////////////////////////////////////////////////////////////////
+// Includes
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Defines
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Number of ENS intervals in a day. The timestamps of the ENS log
+ * entries are ENS interval numbers.
+ */
+#define RPI_INDEX_INTERVALS_PER_DAY 144
+
+/**
+ * @brief The day an ENS log entry timestamp belongs to.
+ */
+#define RPI_INDEX_DAY(timestamp) ((timestamp) / RPI_INDEX_INTERVALS_PER_DAY)
+
+/**
+ * @brief Maximum number of runs. A day has one run, or more if it was flushed
+ * before it ended. The oldest run is dropped to make room for a new one.
+ */
+#define RPI_INDEX_MAX_RUNS 32
+
+/**
+ * @brief Number of run entries between each fingerprint kept in RAM. One
+ * interval of entries fills a page of the external memory.
+ */
+#define RPI_INDEX_FENCE_INTERVAL 512
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Callback receiving the entries found by @c rpi_index_scan.
+ *
+ * @param fingerprint The RPI fingerprint of the entry.
+ * @param index The index of the entry in the ENS log.
+ * @param user_data User data given to @c rpi_index_scan.
+ */
+typedef void (*rpi_index_scan_cb_t)(uint32_t fingerprint, uint32_t index,
+                                    void *user_data);
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Initialize the RPI index by reading back the runs from the external
+ * memory. Days that have ended but are not indexed yet are compacted in the
+ * background.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_index_init(void);
+
+/**
+ * @brief Tell the index that an entry has been added to the ENS log. The
+ * previous day is compacted in the background once the first entry of a new
+ * day is added.
+ *
+ * @param timestamp The timestamp of the entry.
+ */
+void rpi_index_entry_added(uint32_t timestamp);
+
+/**
+ * @brief Compact all entries written so far, including the entries of the
+ * current day, so the whole log is indexed. The rest of the current day is
+ * compacted in to a run of its own when the day ends. The entries are
+ * compacted by the background compaction, as low priority work on the system
+ * work queue, and this waits for it, so it must not be called from the system
+ * work queue.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_index_flush(void);
+
+/**
+ * @brief Tell the index that the oldest entries have been deleted from the ENS
+ * log. The runs that only hold deleted entries are dropped, and the rest are
+ * kept, as they hold the sequence numbers of the entries.
+ */
+void rpi_index_entries_deleted(void);
+
+/**
+ * @brief Check if a range of ENS log entries is indexed.
+ *
+ * @param start Index of the first entry of the range.
+ * @param end Index of the entry after the range.
+ *
+ * @return bool True if every entry in the range is in a run.
+ */
+bool rpi_index_covers(uint32_t start, uint32_t end);
+
+/**
+ * @brief Find the ENS log entries of a day with a given RPI fingerprint.
+ * Fingerprints are not unique, so the caller has to confirm the RPI of each
+ * entry.
+ *
+ * @param day The day to search.
+ * @param fingerprint The fingerprint, see @c rpi_index_fingerprint.
+ * @param indices Array to store the indices of the entries in.
+ * @param max Size of @c indices.
+ *
+ * @return int The number of entries found, -ENOENT if the day is not indexed
+ * or another negative value on error.
+ */
+int rpi_index_find(uint32_t day, uint32_t fingerprint, uint32_t indices[],
+                   size_t max);
+
+/**
+ * @brief Get the range of ENS log entries that is indexed. Entries outside of
+ * the range have to be scanned.
+ *
+ * @param start Pointer to store the index of the first indexed entry in.
+ * @param end Pointer to store the index of the entry after the last indexed
+ * entry in. Equal to @c start if nothing is indexed.
+ */
+void rpi_index_range(uint32_t *start, uint32_t *end);
+
+/**
+ * @brief Go through the indexed entries with a fingerprint in a given range.
+ * The entries of each day are sorted by fingerprint, so only the part of each
+ * run within the range is read.
+ *
+ * @param first The first fingerprint of the range.
+ * @param last The last fingerprint of the range (inclusive).
+ * @param cb Callback receiving the entries. The index is not locked while the
+ * callback runs, so the callback may block. Runs dropped meanwhile are
+ * skipped.
+ * @param user_data User data passed to @c cb.
+ *
+ * @return int 0 on success, negative otherwise.
+ */
+int rpi_index_scan(uint32_t first, uint32_t last, rpi_index_scan_cb_t cb,
+                   void *user_data);
+
+/**
+ * @brief Get the fingerprint of an RPI, which is its first 4 bytes.
+ *
+ * @param rpi The RPI.
+ *
+ * @return uint32_t The fingerprint.
+ */
+uint32_t rpi_index_fingerprint(const uint8_t *rpi);
+
+#endif // RPI_INDEX_H
@@ -3,11 +3,18 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "storage.h"
+#include "../ble/radio.h"
 #include "extmem.h"
+#include "rpi_index.h"
+#include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 
 /* Zephyr includes */
 #include <logging/log.h>
+#include <settings/settings.h>
+#include <sys/util.h>
+#include <zephyr.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Defines
@@ -16,48 +23,207 @@
 #define LOG_MODULE_NAME storage
 LOG_MODULE_REGISTER(storage);
 
+#define SEGMENT_COUNT (EXTMEM_LOG_SIZE / STORAGE_SEGMENT_SIZE)
+#define CAPACITY      (EXTMEM_LOG_SIZE / SIZE_OF_ONE_ENTRY) // Slots in the log
+
+#define HEADER_LENGTH (ENTRY_LENGTH_OFFSET + 2) // Up to the length field
+#define ERASED        0xFF                       // Value of an erased byte
+
+#define SETTINGS_KEY "storage/first"
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/* This struct holds the entries of a day. */
+typedef struct
+{
+    uint32_t day;   // See RPI_INDEX_DAY
+    uint32_t first; // Index of the first entry of the day
+    uint32_t count; // Number of entries of the day
+} day_t;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private variables
 ////////////////////////////////////////////////////////////////////////////////
 
-static uint32_t sequence_number = 0;
-static uint32_t memory_offset = 0;
+static uint32_t sequence_number = 0; // Sequence number of the next entry
+static uint32_t first_slot = 0;      // Slot of the entry with index 0
+static uint32_t entry_count = 0;
+static uint32_t holds = 0; // Holds on the indices, see storage_hold
+
+/* Number of entries starting in each segment */
+static uint16_t segment_counts[SEGMENT_COUNT];
+
+/* Segments that are erased, so entries can be written to them */
+static bool erased[SEGMENT_COUNT];
+
+/* The segment being erased in the background, and the bytes erased of it */
+static int reclaim_segment = -1;
+static uint32_t reclaim_offset = 0;
+
+/* The newest days of the log, oldest first */
+static day_t days[STORAGE_DAYS_MAX];
+static uint32_t day_count = 0;
+
+/* Number of days the entries are kept for, and the newest timestamp written.
+The full log is only reported once until an entry can be written again. */
+static uint32_t retention = STORAGE_RETENTION_DEFAULT;
+static uint32_t newest_timestamp = 0;
+static bool full_reported = false;
+
+/* Sequence number of the first entry, stored when the log is cleared */
+static uint32_t stored_first = 0;
+static bool stored_first_valid = false;
+
+K_MUTEX_DEFINE(storage_mutex);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Private function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
+static int _settings_set(const char *name, size_t len,
+                         settings_read_cb read_cb, void *cb_arg);
+SETTINGS_STATIC_HANDLER_DEFINE(storage, SETTINGS_KEY, NULL, _settings_set,
+                               NULL, NULL);
+
+static void _reclaim_handler(struct k_work *unused);
+K_WORK_DEFINE(_reclaim_work, _reclaim_handler);
+
+static void _trim_handler(struct k_work *unused);
+K_WORK_DEFINE(_trim_work, _trim_handler);
+
 static void _pack_ens_log_entry(uint8_t buf[], int timestamp,
                                 const uint8_t gaens_service_data[],
                                 uint8_t rssi);
 
+static int _recover(void);
+
+static int _read_header(uint32_t slot, uint8_t header[]);
+
+static uint32_t _header_sequence_number(const uint8_t header[]);
+
+static int _search(uint32_t timestamp, uint32_t low, uint32_t high,
+                   uint32_t *index);
+
+static void _narrow(uint32_t timestamp, uint32_t *low, uint32_t *high);
+
+static void _count_entry(uint32_t index, uint32_t timestamp);
+
+static int _recount(void);
+
+static void _count_segments(void);
+
+static void _drop_days(uint32_t count);
+
+static uint32_t _slot(uint32_t index);
+
+static uint32_t _segment_of(uint32_t slot);
+
+static uint32_t _segment_first(uint32_t segment);
+
+static uint32_t _slots_in_segment(uint32_t segment, uint32_t start,
+                                  uint32_t end);
+
+static bool _writable(uint32_t slot);
+
+static bool _dead(uint32_t segment);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Public functions
 ////////////////////////////////////////////////////////////////////////////////
 
+int storage_init(void)
+{
+    int err;
+
+    if (IS_ENABLED(CONFIG_SETTINGS))
+    {
+        settings_subsys_init();
+        settings_load_subtree(SETTINGS_KEY);
+    }
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    err = _recover();
+    if (err == 0)
+    {
+        err = _recount();
+    }
+
+    k_mutex_unlock(&storage_mutex);
+
+    LOG_INF("Found %u ENS log entries", entry_count);
+
+    // Segments cleared before the reboot may not have been erased
+    radio_submit_low_priority(&_reclaim_work);
+
+    return err;
+}
+
 int storage_write_entry(int timestamp, const uint8_t gaens_service_data[],
                         uint8_t rssi)
 {
     uint8_t entry[SIZE_OF_ONE_ENTRY] = {};
+    uint32_t slot;
+    bool writable;
 
     _pack_ens_log_entry(entry, timestamp, gaens_service_data, rssi);
 
-    if (extmem_write(memory_offset, entry, SIZE_OF_ONE_ENTRY) != 0)
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    slot = _slot(entry_count);
+    writable = entry_count < CAPACITY && _writable(slot);
+    k_mutex_unlock(&storage_mutex);
+
+    if (!writable)
+    {
+        if (!full_reported)
+        {
+            LOG_ERR("ENS log is full\n");
+            full_reported = true;
+        }
+
+        // Make room for the next entries
+        radio_submit_low_priority(&_trim_work);
+        radio_submit_low_priority(&_reclaim_work);
+        return -1;
+    }
+
+    if (extmem_write(EXTMEM_LOG_OFFSET + slot * SIZE_OF_ONE_ENTRY, entry,
+                     SIZE_OF_ONE_ENTRY) != 0)
     {
         LOG_ERR("Failed to write ENS log entry to external memory\n");
         return -1;
     }
 
-    sequence_number += 1;
+    k_mutex_lock(&storage_mutex, K_FOREVER);
 
-    // According to the WENS specifications, the sequence number shall
-    // roll over when reaching 0xFFFFFF
-    if (sequence_number > 0xFFFFFF)
+    // The entry may run in to the next segment
+    for (uint32_t i = _segment_of(slot);
+         i * STORAGE_SEGMENT_SIZE < (slot + 1) * SIZE_OF_ONE_ENTRY; i++)
+    {
+        erased[i] = false;
+    }
+
+    // Entries of a day that has passed the retention can go
+    if (day_count == 0 ||
+        days[day_count - 1].day != RPI_INDEX_DAY((uint32_t)timestamp))
     {
-        sequence_number = 0x0;
+        radio_submit_low_priority(&_trim_work);
     }
 
-    memory_offset += SIZE_OF_ONE_ENTRY;
+    _count_entry(entry_count, timestamp);
+    entry_count++;
+    newest_timestamp = timestamp;
+    full_reported = false;
+
+    // According to the WENS specifications, the sequence number shall
+    // roll over when reaching 0xFFFFFF
+    sequence_number = (sequence_number + 1) & STORAGE_SEQUENCE_NUMBER_MAX;
+
+    k_mutex_unlock(&storage_mutex);
+
+    rpi_index_entry_added(timestamp);
 
     return 0;
 }
@@ -75,23 +241,442 @@ int storage_read(uint32_t offset, uint8_t buf[], size_t len)
     return 0;
 }
 
-int storage_delete_all(void)
+uint32_t storage_get_entry_count(void) { return entry_count; }
+
+uint32_t storage_count_entries(uint32_t start, uint32_t end)
+{
+    uint32_t count = storage_get_entry_count();
+
+    start = MIN(start, count);
+    end = MIN(end, count);
+
+    return end > start ? end - start : 0;
+}
+
+uint32_t storage_get_free_count(void)
+{
+    uint32_t segment;
+    uint32_t blocked;
+    uint32_t free;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    // The slots before the first entry in its segment are only free once the
+    // segment is erased, and so is an entry running in to the segment
+    segment = _segment_of(first_slot);
+    blocked = first_slot - _segment_first(segment);
+
+    if (_segment_first(segment) * SIZE_OF_ONE_ENTRY >
+        segment * STORAGE_SEGMENT_SIZE)
+    {
+        blocked++;
+    }
+
+    free = CAPACITY - entry_count;
+    free = free > blocked ? free - blocked : 0;
+
+    k_mutex_unlock(&storage_mutex);
+
+    return free;
+}
+
+uint32_t storage_get_segment_count(uint32_t segment)
+{
+    uint32_t count = 0;
+
+    if (segment < SEGMENT_COUNT)
+    {
+        k_mutex_lock(&storage_mutex, K_FOREVER);
+        count = segment_counts[segment];
+        k_mutex_unlock(&storage_mutex);
+    }
+
+    return count;
+}
+
+int storage_get_day_count(uint32_t day, uint32_t *count)
 {
-    if (extmem_erase(0, EXTMEM_CHIP_SIZE) != 0)
+    int err = 0;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    *count = 0;
+
+    // The counted days run up to the end of the log, so a day after the
+    // oldest of them that is not counted has no entries. Neither has a day
+    // before the log.
+    if (day_count > 0 && day < days[0].day && days[0].first > 0)
     {
-        LOG_ERR("Failed to erase the whole external memory\n");
+        err = -ENOENT;
+    }
+
+    for (uint32_t i = 0; i < day_count; i++)
+    {
+        if (days[i].day == day)
+        {
+            *count = days[i].count;
+            break;
+        }
+    }
+
+    k_mutex_unlock(&storage_mutex);
+
+    return err;
+}
+
+int storage_read_entries(uint32_t index, uint8_t buf[], size_t count)
+{
+    uint32_t slot;
+    size_t before_wrap;
+
+    if (index + count > storage_get_entry_count())
+    {
+        LOG_ERR("Attempted to read past the last ENS log entry\n");
         return -1;
     }
 
-    memory_offset = 0;
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    slot = _slot(index);
+    k_mutex_unlock(&storage_mutex);
+
+    // The log continues from the first slot after the last
+    before_wrap = MIN(count, CAPACITY - slot);
+
+    if (extmem_read(EXTMEM_LOG_OFFSET + slot * SIZE_OF_ONE_ENTRY, buf,
+                    before_wrap * SIZE_OF_ONE_ENTRY) != 0 ||
+        (count > before_wrap &&
+         extmem_read(EXTMEM_LOG_OFFSET, &buf[before_wrap * SIZE_OF_ONE_ENTRY],
+                     (count - before_wrap) * SIZE_OF_ONE_ENTRY) != 0))
+    {
+        LOG_ERR("Failed to read ENS log entries from external memory\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int storage_find_entry(uint32_t timestamp, uint32_t *index)
+{
+    uint32_t low = 0;
+    uint32_t high;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    high = storage_get_entry_count();
+    _narrow(timestamp, &low, &high);
+    k_mutex_unlock(&storage_mutex);
+
+    return _search(timestamp, low, high, index);
+}
+
+int storage_find_sequence(uint32_t sequence_number, uint32_t *index)
+{
+    uint32_t count = storage_get_entry_count();
+    int32_t distance =
+        storage_sequence_compare(sequence_number,
+                                 storage_get_sequence_number(0));
+
+    // The entries have consecutive sequence numbers, as the sequence number
+    // keeps counting when the log is erased
+    if (distance < 0)
+    {
+        *index = 0;
+    }
+    else
+    {
+        *index = (uint32_t)distance < count ? distance : count;
+    }
 
     return 0;
 }
 
+uint32_t storage_get_sequence_number(uint32_t index)
+{
+    uint32_t first;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    first = sequence_number - entry_count;
+    k_mutex_unlock(&storage_mutex);
+
+    return (first + index) & STORAGE_SEQUENCE_NUMBER_MAX;
+}
+
+int32_t storage_sequence_compare(uint32_t a, uint32_t b)
+{
+    uint32_t distance = (a - b) & STORAGE_SEQUENCE_NUMBER_MAX;
+
+    // Distances of half the space or more go backwards
+    if (distance > STORAGE_SEQUENCE_NUMBER_MAX / 2)
+    {
+        return (int32_t)distance - (STORAGE_SEQUENCE_NUMBER_MAX + 1);
+    }
+
+    return distance;
+}
+
+uint32_t storage_entry_timestamp(const uint8_t entry[])
+{
+    return ((uint32_t)entry[ENTRY_TIMESTAMP_OFFSET] << 24) |
+           ((uint32_t)entry[ENTRY_TIMESTAMP_OFFSET + 1] << 16) |
+           (entry[ENTRY_TIMESTAMP_OFFSET + 2] << 8) |
+           entry[ENTRY_TIMESTAMP_OFFSET + 3];
+}
+
+int storage_delete_before(uint32_t index)
+{
+    uint32_t first;
+    int err = 0;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    // The indices of the entries that are kept would move under a report or
+    // a check
+    if (holds > 0)
+    {
+        k_mutex_unlock(&storage_mutex);
+        LOG_WRN("ENS log is held, entries not deleted");
+        return -EBUSY;
+    }
+
+    // The log starts at the first entry that is kept, or at the slot of the
+    // next entry if none are
+    index = MIN(index, entry_count);
+    first_slot = _slot(index);
+    entry_count -= index;
+    first = (sequence_number - entry_count) & STORAGE_SEQUENCE_NUMBER_MAX;
+
+    _count_segments();
+    _drop_days(index);
+
+    k_mutex_unlock(&storage_mutex);
+
+    rpi_index_entries_deleted();
+
+    // The entries stay in the external memory until their segments are
+    // erased, so where the log starts must survive a reboot
+    if (IS_ENABLED(CONFIG_SETTINGS))
+    {
+        err = settings_save_one(SETTINGS_KEY, &first, sizeof(first));
+        if (err)
+        {
+            LOG_ERR("Failed to store the start of the ENS log (err %d)", err);
+        }
+    }
+
+    radio_submit_low_priority(&_reclaim_work);
+
+    return err;
+}
+
+int storage_delete_all(void) { return storage_delete_before(UINT32_MAX); }
+
+void storage_set_retention(uint32_t days)
+{
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    retention = days;
+    k_mutex_unlock(&storage_mutex);
+
+    radio_submit_low_priority(&_trim_work);
+}
+
+void storage_hold(void)
+{
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    holds++;
+    k_mutex_unlock(&storage_mutex);
+}
+
+void storage_release(void)
+{
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    if (holds > 0)
+    {
+        holds--;
+    }
+
+    k_mutex_unlock(&storage_mutex);
+}
+
+bool storage_is_held(void)
+{
+    bool held;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+    held = holds > 0;
+    k_mutex_unlock(&storage_mutex);
+
+    return held;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Private functions
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief Settings callback loading the sequence number of the first ENS log
+ * entry, stored when the log was last cleared.
+ * 
+ * @param name The name of the setting, relative to the handler.
+ * @param len Length of the stored value.
+ * @param read_cb Function for reading the value.
+ * @param cb_arg Argument for @c read_cb.
+ * 
+ * @return int 0 on success, negative otherwise.
+ */
+static int _settings_set(const char *name, size_t len,
+                         settings_read_cb read_cb, void *cb_arg)
+{
+    ssize_t read;
+
+    if (len != sizeof(stored_first))
+    {
+        return -EINVAL;
+    }
+
+    read = read_cb(cb_arg, &stored_first, sizeof(stored_first));
+    if (read < 0)
+    {
+        LOG_ERR("Failed to load the start of the ENS log (err %d)", (int)read);
+        return read;
+    }
+
+    stored_first_valid = true;
+
+    return 0;
+}
+
+/**
+ * @brief Work handler deleting the ENS log entries older than the retention,
+ * and the entries of the oldest segment if the log is full. Nothing is
+ * deleted while the log is held, and the handler runs again with the next
+ * day or the next entry that does not fit.
+ * 
+ * @param unused Not in use, but required.
+ */
+static void _trim_handler(struct k_work *unused)
+{
+    uint32_t index = 0;
+    uint32_t oldest = 0;
+    uint32_t slot;
+    bool full;
+    int err;
+
+    if (storage_is_held())
+    {
+        return;
+    }
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    if (retention > 0 &&
+        newest_timestamp > retention * RPI_INDEX_INTERVALS_PER_DAY)
+    {
+        oldest = newest_timestamp - retention * RPI_INDEX_INTERVALS_PER_DAY;
+    }
+
+    k_mutex_unlock(&storage_mutex);
+
+    if (oldest > 0 && storage_find_entry(oldest, &index) < 0)
+    {
+        return;
+    }
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    // The log is full when the next entry runs in to a segment that still
+    // holds entries, which is the segment of the first entry. The entries
+    // starting in it are deleted, so it can be erased.
+    slot = _slot(entry_count);
+    full = !_writable(slot) &&
+           segment_counts[(slot * SIZE_OF_ONE_ENTRY + SIZE_OF_ONE_ENTRY - 1) /
+                          STORAGE_SEGMENT_SIZE] > 0;
+
+    if (full)
+    {
+        index = MAX(index, segment_counts[_segment_of(first_slot)]);
+    }
+
+    k_mutex_unlock(&storage_mutex);
+
+    if (index == 0)
+    {
+        return;
+    }
+
+    err = storage_delete_before(index);
+    if (err == 0)
+    {
+        LOG_INF("Deleted %u ENS log entries %s", index,
+                full ? "to make room" : "past the retention");
+    }
+}
+
+/**
+ * @brief Work handler erasing the segments that hold no ENS log entries. One
+ * subsector is erased at a time, and the handler submits itself again until
+ * every such segment is erased, so the work queue is not held up by a long
+ * erase. A segment is erased from its end, so one that reads as erased at its
+ * start has been erased in full, even if the device was reset in between.
+ * 
+ * @param unused Not in use, but required.
+ */
+static void _reclaim_handler(struct k_work *unused)
+{
+    uint32_t offset;
+    int err;
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    // The segments after the next entry are the first to be needed
+    for (uint32_t i = 1; i <= SEGMENT_COUNT && reclaim_segment < 0; i++)
+    {
+        uint32_t segment = (_segment_of(_slot(entry_count)) + i) %
+                           SEGMENT_COUNT;
+
+        if (!erased[segment] && _dead(segment))
+        {
+            reclaim_segment = segment;
+            reclaim_offset = 0;
+        }
+    }
+
+    if (reclaim_segment < 0)
+    {
+        k_mutex_unlock(&storage_mutex);
+        return;
+    }
+
+    offset = (reclaim_segment + 1) * STORAGE_SEGMENT_SIZE - reclaim_offset -
+             EXTMEM_SUBSECTOR_SIZE;
+
+    k_mutex_unlock(&storage_mutex);
+
+    // No entry is written to the segment until it is marked as erased
+    err = extmem_erase(EXTMEM_LOG_OFFSET + offset, EXTMEM_SUBSECTOR_SIZE);
+
+    k_mutex_lock(&storage_mutex, K_FOREVER);
+
+    if (err)
+    {
+        LOG_ERR("Failed to erase ENS log segment %d", reclaim_segment);
+        reclaim_segment = -1;
+        k_mutex_unlock(&storage_mutex);
+        return;
+    }
+
+    reclaim_offset += EXTMEM_SUBSECTOR_SIZE;
+
+    if (reclaim_offset == STORAGE_SEGMENT_SIZE)
+    {
+        erased[reclaim_segment] = true;
+        reclaim_segment = -1;
+    }
+
+    k_mutex_unlock(&storage_mutex);
+
+    radio_submit_low_priority(&_reclaim_work);
+}
+
 /**
  * @brief Function for packing ENS log data in to an array.
  * 
@@ -154,4 +739,509 @@ static void _pack_ens_log_entry(uint8_t buf[], int timestamp,
     buf[31] = 0x01; // Length of the RSSI value
     buf[32] = 0x02; // The type indicating that this is the RSSI
     buf[33] = rssi;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Function for finding the ENS log entries written before a reboot.
+ * The log is a ring of slots, and a segment is erased before entries are
+ * written to it, so a segment that is not erased is written from its start.
+ * The newest segment is the one whose first entry has the latest sequence
+ * number, and the end of the log is found in it with a binary search. The log
+ * runs back through the segments that continue its sequence numbers, but not
+ * past the entry stored as the first when the log was cleared. Must be called
+ * with the mutex held.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _recover(void)
+{
+    uint8_t header[HEADER_LENGTH];
+    uint32_t seqs[SEGMENT_COUNT];
+    bool written[SEGMENT_COUNT];
+    int head = -1;
+    uint32_t head_slot;
+    uint32_t low;
+    uint32_t high;
+    uint32_t start;
+    uint32_t count;
+
+    for (uint32_t i = 0; i < SEGMENT_COUNT; i++)
+    {
+        uint32_t slot = _segment_first(i);
+
+        if (_read_header(slot, header) != 0)
+        {
+            return -1;
+        }
+
+        // A written entry has a length field, an erased one reads as 0xFF
+        written[i] = header[ENTRY_LENGTH_OFFSET] != ERASED;
+        seqs[i] = _header_sequence_number(header);
+        erased[i] = !written[i];
+
+        // An entry of the segment before may run in to this one
+        if (erased[i] && slot * SIZE_OF_ONE_ENTRY > i * STORAGE_SEGMENT_SIZE)
+        {
+            if (_read_header(slot - 1, header) != 0)
+            {
+                return -1;
+            }
+
+            erased[i] = header[ENTRY_LENGTH_OFFSET] == ERASED;
+        }
+
+        if (written[i] &&
+            (head < 0 || storage_sequence_compare(seqs[i], seqs[head]) > 0))
+        {
+            head = i;
+        }
+    }
+
+    if (head < 0)
+    {
+        first_slot = 0;
+        entry_count = 0;
+        sequence_number = stored_first_valid ? stored_first : 0;
+        return 0;
+    }
+
+    // The log ends at the first slot of the newest segment that does not
+    // continue its sequence numbers
+    head_slot = _segment_first(head);
+    low = head_slot + 1;
+    high = head + 1 < SEGMENT_COUNT ? _segment_first(head + 1) : CAPACITY;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        uint32_t seq = (seqs[head] + mid - head_slot) &
+                       STORAGE_SEQUENCE_NUMBER_MAX;
+
+        if (_read_header(mid, header) != 0)
+        {
+            return -1;
+        }
+
+        if (header[ENTRY_LENGTH_OFFSET] != ERASED &&
+            _header_sequence_number(header) == seq)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    sequence_number = (seqs[head] + low - head_slot) &
+                      STORAGE_SEQUENCE_NUMBER_MAX;
+
+    start = head_slot;
+
+    for (uint32_t i = 1; i < SEGMENT_COUNT; i++)
+    {
+        uint32_t segment = (head + SEGMENT_COUNT - i) % SEGMENT_COUNT;
+        uint32_t slot = _segment_first(segment);
+        uint32_t distance = (head_slot + CAPACITY - slot) % CAPACITY;
+
+        if (!written[segment] ||
+            seqs[segment] !=
+                ((seqs[head] - distance) & STORAGE_SEQUENCE_NUMBER_MAX))
+        {
+            break;
+        }
+
+        start = slot;
+    }
+
+    count = low >= start ? low - start : low + CAPACITY - start;
+
+    // The entries before the stored first entry were cleared
+    if (stored_first_valid)
+    {
+        int32_t cleared = storage_sequence_compare(
+            stored_first,
+            (sequence_number - count) & STORAGE_SEQUENCE_NUMBER_MAX);
+
+        if (cleared > 0)
+        {
+            cleared = MIN((uint32_t)cleared, count);
+            start = (start + cleared) % CAPACITY;
+            count -= cleared;
+        }
+    }
+
+    first_slot = start;
+    entry_count = count;
+
+    return 0;
+}
+
+/**
+ * @brief Function for reading the header of an ENS log entry, which holds the
+ * sequence number, the timestamp and the length field.
+ * 
+ * @param slot The slot of the entry.
+ * @param header Buffer to store the header in, @c HEADER_LENGTH bytes.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _read_header(uint32_t slot, uint8_t header[])
+{
+    if (extmem_read(EXTMEM_LOG_OFFSET + slot * SIZE_OF_ONE_ENTRY, header,
+                    HEADER_LENGTH) != 0)
+    {
+        LOG_ERR("Failed to read ENS log slot %u\n", slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Function for extracting the sequence number from the header of an
+ * ENS log entry.
+ * 
+ * @param header The header.
+ * 
+ * @return uint32_t The sequence number.
+ */
+static uint32_t _header_sequence_number(const uint8_t header[])
+{
+    return ((uint32_t)header[ENTRY_SEQUENCE_NUMBER_OFFSET] << 16) |
+           (header[ENTRY_SEQUENCE_NUMBER_OFFSET + 1] << 8) |
+           header[ENTRY_SEQUENCE_NUMBER_OFFSET + 2];
+}
+
+/**
+ * @brief Function for finding the first ENS log entry with a timestamp equal
+ * to or later than a given timestamp within a range, with a binary search over
+ * the log.
+ * 
+ * @param timestamp The timestamp to search for.
+ * @param low Index of the first entry of the range.
+ * @param high Index of the entry after the range.
+ * @param index Pointer to store the index of the entry in.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _search(uint32_t timestamp, uint32_t low, uint32_t high,
+                   uint32_t *index)
+{
+    uint8_t header[HEADER_LENGTH];
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        uint32_t slot;
+
+        k_mutex_lock(&storage_mutex, K_FOREVER);
+        slot = _slot(mid);
+        k_mutex_unlock(&storage_mutex);
+
+        if (_read_header(slot, header) != 0)
+        {
+            return -1;
+        }
+
+        if (storage_entry_timestamp(header) < timestamp)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    *index = low;
+
+    return 0;
+}
+
+/**
+ * @brief Function for narrowing the range to search for a timestamp down to
+ * the entries of its day, using the counted days. The range is empty if the
+ * timestamp is at the start of a counted day, or the days around it are
+ * counted and it has no entries. Must be called with the mutex held.
+ * 
+ * @param timestamp The timestamp to search for.
+ * @param low Index of the first entry of the range, moved forward.
+ * @param high Index of the entry after the range, moved back.
+ */
+static void _narrow(uint32_t timestamp, uint32_t *low, uint32_t *high)
+{
+    uint32_t day = RPI_INDEX_DAY(timestamp);
+
+    for (uint32_t i = 0; i < day_count; i++)
+    {
+        if (days[i].day < day)
+        {
+            // The entries of earlier days are earlier
+            *low = days[i].first + days[i].count;
+        }
+        else if (days[i].day == day)
+        {
+            *low = days[i].first;
+            *high = timestamp == day * RPI_INDEX_INTERVALS_PER_DAY
+                        ? *low
+                        : days[i].first + days[i].count;
+            return;
+        }
+        else
+        {
+            *high = days[i].first;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Function for counting a new ENS log entry. A day is dropped from the
+ * counted days once there is no room for the new day. Must be called with the
+ * mutex held.
+ * 
+ * @param index The index of the entry.
+ * @param timestamp The timestamp of the entry.
+ */
+static void _count_entry(uint32_t index, uint32_t timestamp)
+{
+    uint32_t day = RPI_INDEX_DAY(timestamp);
+
+    segment_counts[_segment_of(_slot(index))]++;
+
+    if (day_count == 0 || days[day_count - 1].day != day)
+    {
+        if (day_count == STORAGE_DAYS_MAX)
+        {
+            memmove(&days[0], &days[1], (day_count - 1) * sizeof(days[0]));
+            day_count--;
+        }
+
+        days[day_count].day = day;
+        days[day_count].first = index;
+        days[day_count].count = 0;
+        day_count++;
+    }
+
+    days[day_count - 1].count++;
+}
+
+/**
+ * @brief Function for rebuilding the counters of the log. The start of each
+ * of the newest days is found with a binary search. Must be called with the
+ * mutex held.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+static int _recount(void)
+{
+    uint8_t header[HEADER_LENGTH];
+    uint32_t end = entry_count;
+    uint32_t found = 0;
+
+    _count_segments();
+
+    // The days are found from the newest, and stored from the end of the table
+    while (end > 0 && found < STORAGE_DAYS_MAX)
+    {
+        day_t *day = &days[STORAGE_DAYS_MAX - 1 - found];
+
+        if (_read_header(_slot(end - 1), header) != 0)
+        {
+            day_count = 0;
+            return -1;
+        }
+
+        day->day = RPI_INDEX_DAY(storage_entry_timestamp(header));
+
+        if (_search(day->day * RPI_INDEX_INTERVALS_PER_DAY, 0, end,
+                    &day->first) != 0)
+        {
+            day_count = 0;
+            return -1;
+        }
+
+        day->count = end - day->first;
+        end = day->first;
+        found++;
+    }
+
+    memmove(&days[0], &days[STORAGE_DAYS_MAX - found], found * sizeof(days[0]));
+    day_count = found;
+
+    return 0;
+}
+
+/**
+ * @brief Function for counting the entries of each segment. The entries are
+ * contiguous, so this is done without reading the log. Must be called with
+ * the mutex held.
+ */
+static void _count_segments(void)
+{
+    uint32_t wrapped = first_slot + entry_count > CAPACITY
+                           ? first_slot + entry_count - CAPACITY
+                           : 0;
+
+    // The log may continue from the first slot after the last
+    for (uint32_t i = 0; i < SEGMENT_COUNT; i++)
+    {
+        segment_counts[i] =
+            _slots_in_segment(i, first_slot, first_slot + entry_count) +
+            _slots_in_segment(i, 0, wrapped);
+    }
+}
+
+/**
+ * @brief Function for dropping deleted entries from the counted days. The
+ * indices of the entries that are kept move down. Must be called with the
+ * mutex held.
+ * 
+ * @param count Number of entries deleted from the start of the log.
+ */
+static void _drop_days(uint32_t count)
+{
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < day_count; i++)
+    {
+        day_t day = days[i];
+
+        if (day.first + day.count <= count)
+        {
+            continue;
+        }
+
+        if (day.first < count)
+        {
+            day.count -= count - day.first;
+            day.first = 0;
+        }
+        else
+        {
+            day.first -= count;
+        }
+
+        days[kept++] = day;
+    }
+
+    day_count = kept;
+}
+
+/**
+ * @brief Function for getting the slot of an ENS log entry. Must be called
+ * with the mutex held.
+ * 
+ * @param index The index of the entry.
+ * 
+ * @return uint32_t The slot.
+ */
+static uint32_t _slot(uint32_t index)
+{
+    return (first_slot + index) % CAPACITY;
+}
+
+/**
+ * @brief Function for getting the segment a slot starts in.
+ * 
+ * @param slot The slot.
+ * 
+ * @return uint32_t The segment.
+ */
+static uint32_t _segment_of(uint32_t slot)
+{
+    return slot * SIZE_OF_ONE_ENTRY / STORAGE_SEGMENT_SIZE;
+}
+
+/**
+ * @brief Function for getting the first slot that starts in a segment. The
+ * slot before it can cross the start of the segment.
+ * 
+ * @param segment The segment.
+ * 
+ * @return uint32_t The slot.
+ */
+static uint32_t _segment_first(uint32_t segment)
+{
+    return ceiling_fraction(segment * STORAGE_SEGMENT_SIZE, SIZE_OF_ONE_ENTRY);
+}
+
+/**
+ * @brief Function for counting the slots of a range that start in a segment.
+ * 
+ * @param segment The segment.
+ * @param start The first slot of the range.
+ * @param end The slot after the range.
+ * 
+ * @return uint32_t The number of slots.
+ */
+static uint32_t _slots_in_segment(uint32_t segment, uint32_t start,
+                                  uint32_t end)
+{
+    uint32_t first = MAX(_segment_first(segment), start);
+    uint32_t last = MIN(MIN(_segment_first(segment + 1), CAPACITY), end);
+
+    return last > first ? last - first : 0;
+}
+
+/**
+ * @brief Function for checking if an ENS log entry can be written to a slot,
+ * which is when every segment the slot runs in to is erased. Must be called
+ * with the mutex held.
+ * 
+ * @param slot The slot.
+ * 
+ * @return bool True if the slot can be written.
+ */
+static bool _writable(uint32_t slot)
+{
+    uint32_t start = slot * SIZE_OF_ONE_ENTRY;
+
+    for (uint32_t i = ceiling_fraction(start, STORAGE_SEGMENT_SIZE);
+         i * STORAGE_SEGMENT_SIZE < start + SIZE_OF_ONE_ENTRY; i++)
+    {
+        if (!erased[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Function for checking if a segment can be erased, which is when no
+ * ENS log entry lies in it, and the next entry does not start in it. Must be
+ * called with the mutex held.
+ * 
+ * @param segment The segment.
+ * 
+ * @return bool True if the segment can be erased.
+ */
+static bool _dead(uint32_t segment)
+{
+    uint32_t start = segment * STORAGE_SEGMENT_SIZE;
+    uint32_t end = start + STORAGE_SEGMENT_SIZE;
+    uint32_t first = first_slot * SIZE_OF_ONE_ENTRY;
+    uint32_t last = first + entry_count * SIZE_OF_ONE_ENTRY;
+    uint32_t size = CAPACITY * SIZE_OF_ONE_ENTRY;
+    uint32_t next = _slot(entry_count);
+
+    // Entries are written to the segment of the next one without checking
+    // that it is erased, but not to a segment the next one runs in to or
+    // starts at the start of, as after the log has wrapped when full
+    if (_segment_of(next) == segment && next * SIZE_OF_ONE_ENTRY != start)
+    {
+        return false;
+    }
+
+    if (entry_count == 0)
+    {
+        return true;
+    }
+
+    // The log may continue from the first slot after the last
+    return !(first < end && MIN(last, size) > start) &&
+           !(last > size && last - size > start);
+}
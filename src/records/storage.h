@@ -4,11 +4,27 @@
  * 
  * This is a module for adding, reading and manipulating Exposure Notification
  *  records.
+ * 
+ * The entries are counted as they are written, in total, per segment of the
+ * log and per day, so counts and time lookups are answered from RAM. The
+ * counters are rebuilt from the log at boot.
+ * 
+ * The log is a ring of slots in the external memory. Deleting the oldest
+ * entries, or all of them, only moves the start of the log, and the segments
+ * that no longer hold entries are erased in the background, so a delete
+ * returns at once. A segment must be erased before entries are written to it.
+ * 
+ * Deleting renumbers the entries that are kept, so a module that keeps
+ * indices across calls holds the log, and deletes are refused meanwhile.
+ * 
+ * Entries older than the retention are deleted as the days go by, and the
+ * oldest segment is deleted when the log is full, unless the log is held.
  */
 
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -18,10 +34,43 @@
 
 #define SIZE_OF_ONE_ENTRY 34 // The size of one ENS log entry in bytes
 
+/* Offsets of the fields in an ENS log entry, see _pack_ens_log_entry */
+#define ENTRY_SEQUENCE_NUMBER_OFFSET 0
+#define ENTRY_TIMESTAMP_OFFSET       3
+#define ENTRY_LENGTH_OFFSET          7
+#define ENTRY_RPI_OFFSET             11
+#define ENTRY_AEM_OFFSET             27
+#define ENTRY_RSSI_OFFSET            33
+
+/* The sequence number is 3 bytes, and rolls over to 0 after this value */
+#define STORAGE_SEQUENCE_NUMBER_MAX 0xFFFFFF
+
+/* The log is counted in segments of one sector of the external memory */
+#define STORAGE_SEGMENT_SIZE 65536
+
+/* Number of days the entries are counted for, the newest are kept */
+#define STORAGE_DAYS_MAX 32
+
+/* Number of days the entries are kept for until the retention is set, see the
+Data Retention field of the ENS Settings */
+#define STORAGE_RETENTION_DEFAULT 14
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief Function for finding the ENS log entries written before a reboot.
+ * The end of the log is found from the first entry of each segment and a
+ * binary search, and its start from the sequence number stored when it was
+ * last cleared. The sequence number and the counters are restored from the
+ * entries, and the erase of cleared segments is resumed. Must be called
+ * before the log is used.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int storage_init(void);
+
 /**
  * @brief Function for writing an ENS log entry to the external memory.
  * 
@@ -47,10 +96,177 @@ int storage_write_entry(int timestamp, const uint8_t gaens_service_data[],
 int storage_read(uint32_t offset, uint8_t buf[], size_t len);
 
 /**
- * @brief Function for erasing the whole external memory.
+ * @brief Function for getting the number of ENS log entries written. Entries
+ * are indexed from 0 in the order they were written, so this is also the index
+ * of the next entry.
+ * 
+ * @return uint32_t The number of entries.
+ */
+uint32_t storage_get_entry_count(void);
+
+/**
+ * @brief Function for counting the ENS log entries in a range of indices.
+ * 
+ * @param start Index of the first entry of the range.
+ * @param end Index of the entry after the range.
+ * 
+ * @return uint32_t The number of entries.
+ */
+uint32_t storage_count_entries(uint32_t start, uint32_t end);
+
+/**
+ * @brief Function for getting the number of ENS log entries that can still
+ * be written before the log is full. Cleared segments that are still to be
+ * erased are counted as free.
+ * 
+ * @return uint32_t The number of entries.
+ */
+uint32_t storage_get_free_count(void);
+
+/**
+ * @brief Function for getting the number of ENS log entries that start in a
+ * segment of the log.
+ * 
+ * @param segment The segment, counted from the start of the log region.
+ * 
+ * @return uint32_t The number of entries.
+ */
+uint32_t storage_get_segment_count(uint32_t segment);
+
+/**
+ * @brief Function for getting the number of ENS log entries of a day.
+ * 
+ * @param day The day, see @c RPI_INDEX_DAY.
+ * @param count Pointer to store the number of entries in.
+ * 
+ * @return int Returns 0 on success, -ENOENT if the day is older than the
+ * days that are counted.
+ */
+int storage_get_day_count(uint32_t day, uint32_t *count);
+
+/**
+ * @brief Function for reading ENS log entries by index.
+ * 
+ * @param index Index of the first entry to read.
+ * @param buf Buffer that will be filled with the entries. Must hold
+ * @c count * SIZE_OF_ONE_ENTRY bytes.
+ * @param count Number of entries to read.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int storage_read_entries(uint32_t index, uint8_t buf[], size_t count);
+
+/**
+ * @brief Function for finding the first ENS log entry with a timestamp equal
+ * to or later than a given timestamp. Entries are written in time order, so
+ * this is a binary search over the entries of the day of the timestamp. The
+ * log is not read for a timestamp at the start of a counted day, or later
+ * than the log.
+ * 
+ * @param timestamp The timestamp to search for.
+ * @param index Pointer to store the index of the entry in. Set to the entry
+ * count if all entries are earlier than @c timestamp.
+ * 
+ * @return int Returns 0 on success, negative otherwise.
+ */
+int storage_find_entry(uint32_t timestamp, uint32_t *index);
+
+/**
+ * @brief Function for finding the first ENS log entry with a sequence number
+ * equal to or later than a given sequence number. Sequence numbers are
+ * compared with serial number arithmetic, so a sequence number up to half
+ * the sequence number space before the first entry is earlier than it, even
+ * if the sequence number has rolled over in between.
+ * 
+ * @param sequence_number The sequence number to search for.
+ * @param index Pointer to store the index of the entry in. Set to the entry
+ * count if all entries are earlier than @c sequence_number.
  * 
  * @return int Returns 0 on success, negative otherwise.
  */
+int storage_find_sequence(uint32_t sequence_number, uint32_t *index);
+
+/**
+ * @brief Function for getting the sequence number of an ENS log entry.
+ * 
+ * @param index The index of the entry.
+ * 
+ * @return uint32_t The sequence number of the entry.
+ */
+uint32_t storage_get_sequence_number(uint32_t index);
+
+/**
+ * @brief Function for comparing two sequence numbers with serial number
+ * arithmetic, as the sequence number rolls over.
+ * 
+ * @param a The first sequence number.
+ * @param b The second sequence number.
+ * 
+ * @return int32_t The distance from @c b to @c a, negative if @c a is
+ * earlier than @c b.
+ */
+int32_t storage_sequence_compare(uint32_t a, uint32_t b);
+
+/**
+ * @brief Function for extracting the timestamp from an ENS log entry.
+ * 
+ * @param entry The ENS log entry.
+ * 
+ * @return uint32_t The timestamp of the entry.
+ */
+uint32_t storage_entry_timestamp(const uint8_t entry[]);
+
+/**
+ * @brief Function for deleting the oldest ENS log entries. The entries that
+ * are kept are indexed from 0 again, and keep their sequence numbers. The
+ * entries are erased from the external memory in the background, so this
+ * returns without waiting for the erase.
+ * 
+ * @param index Index of the first entry to keep. All entries are deleted if
+ * this is the entry count or more.
+ * 
+ * @return int Returns 0 on success, -EBUSY if the log is held, see
+ * storage_hold, or another negative value otherwise.
+ */
+int storage_delete_before(uint32_t index);
+
+/**
+ * @brief Function for clearing all ENS log entries. The sequence number keeps
+ * counting. The entries are erased from the external memory in the
+ * background, so this returns without waiting for the erase.
+ * 
+ * @return int Returns 0 on success, -EBUSY if the log is held, see
+ * storage_hold, or another negative value otherwise.
+ */
 int storage_delete_all(void);
 
+/**
+ * @brief Function for setting how long the ENS log entries are kept. Older
+ * entries are deleted in the background.
+ * 
+ * @param days Number of days to keep the entries for, 0 to keep them until
+ * the log is full.
+ */
+void storage_set_retention(uint32_t days);
+
+/**
+ * @brief Function for holding the indices of the ENS log entries, while a
+ * report or a check works through a range of them. No entries can be deleted
+ * until every hold is released. Entries can still be written.
+ */
+void storage_hold(void);
+
+/**
+ * @brief Function for releasing a hold taken with storage_hold.
+ */
+void storage_release(void);
+
+/**
+ * @brief Function for checking if the indices of the ENS log entries are
+ * held, so a delete would be refused.
+ * 
+ * @return bool True if the log is held.
+ */
+bool storage_is_held(void);
+
 #endif // STORAGE_H
\ No newline at end of file